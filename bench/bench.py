@@ -0,0 +1,275 @@
+#!/usr/bin/python3
+"""bench.py -- hindex benchmark suite
+
+Generates a file with bench/gen.py, then measures with hindex and, for
+comparison, hindex.py (pure Python, and on the C engine if built with
+"make python"), sed -n and grep:
+
+* index build throughput (hindex -b -f, best of --runs)
+* index load time (hindex -l)
+* cold and warm latency of queries by line number (-S -N), content
+  (-G -L) and count from the start (-N), median of --runs
+
+Cold runs first evict the data and index files from the page cache with
+posix_fadvise(DONTNEED).  Time and memory (peak RSS) of each command
+are taken by bench/measure.  Each
+result is one JSON object per line on --output, with a summary table on
+stderr.  Given --baseline, results are compared with an earlier output
+and slowdowns beyond --threshold reported, failing with exit status 1.
+
+Usage: bench/bench.py [options]   (see --help, and bench/gen.py for data options)
+"""
+
+import sys
+import os
+import argparse
+import hashlib
+import json
+import shutil
+import subprocess
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen  # pylint: disable=wrong-import-position
+
+SNAPLEN = 26
+QUERY_LINES = 1000
+
+
+def evict(*files):
+    "Drop files from the page cache"
+    for fn in files:
+        if not os.path.exists(fn):
+            continue
+        fd = os.open(fn, os.O_RDONLY)
+        try:
+            os.fsync(fd)
+            os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        finally:
+            os.close(fd)
+
+
+def run(cmd, env=None, digest=False, measure=None):
+    """
+    Run command with output to /dev/null (or hashed if digest), return
+    (seconds, peak RSS in KB, md5 of output or None).  Times and memory
+    are taken by bench/measure if given, else memory is None.
+    """
+    result_file = None
+    if measure:
+        fd, result_file = tempfile.mkstemp(prefix='hindex-bench.')
+        os.close(fd)
+        cmd = [measure, result_file] + cmd
+    stdout = subprocess.PIPE if digest else subprocess.DEVNULL
+    t0 = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=stdout, env=env)  # pylint: disable=consider-using-with
+    md5 = None
+    if digest:
+        md5 = hashlib.md5()
+        for block in iter(lambda: proc.stdout.read(1 << 20), b''):
+            md5.update(block)
+        md5 = md5.hexdigest()
+    proc.wait()
+    secs, rss = time.perf_counter() - t0, None
+    if result_file:
+        with open(result_file, encoding='ascii') as fp:
+            flds = fp.read().split()
+        os.unlink(result_file)
+        if flds:
+            secs, rss = float(flds[0]), int(flds[1])
+    if proc.returncode:
+        raise RuntimeError('Command failed ({}): {}'.format(proc.returncode, ' '.join(cmd)))
+    return secs, rss, md5
+
+
+def median(values):
+    "Median of values"
+    values = sorted(values)
+    mid = len(values) // 2
+    return values[mid] if len(values) % 2 else (values[mid - 1] + values[mid]) / 2
+
+
+class Suite:
+    """Runs benchmarks and collects results"""
+
+    def __init__(self, args, data, nbytes, nlines):
+        self.args = args
+        self.data = data
+        self.nbytes = nbytes
+        self.nlines = nlines
+        self.index_dir = os.path.dirname(data)
+        self.results = []
+        self.env_pure = dict(os.environ, HINDEX_PURE_PYTHON='1')
+        self.measure_cmd = args.measure if os.access(args.measure, os.X_OK) else None
+        if not self.measure_cmd:
+            sys.stderr.write('No "{}" (make bench builds it), not measuring memory\n'.format(args.measure))
+
+    def hindex(self, *opts):
+        "hindex command line on the data file"
+        return [self.args.hindex, '-q', '-D', self.index_dir] + list(opts) + [self.data]
+
+    def hindex_py(self, *opts):
+        "hindex.py command line on the data file"
+        return [sys.executable, self.args.hindex_py, '-q', '-D', self.index_dir] + list(opts) + [self.data]
+
+    def tools(self):
+        "hindex.py variants to compare: (name, environment)"
+        tools = [('hindex.py', self.env_pure)]
+        py_dir = os.path.dirname(os.path.abspath(self.args.hindex_py))
+        if any(fn.startswith('_hindex') and fn.endswith('.so') for fn in os.listdir(py_dir)):
+            tools.append(('hindex.py+_hindex', None))
+        return tools
+
+    def record(self, bench, tool, cache, times, rss, **extra):
+        "Add result and report it"
+        result = dict(bench=bench, tool=tool, cache=cache, seconds=round(median(times), 6),
+                      min_seconds=round(min(times), 6), runs=len(times), max_rss_kb=rss)
+        result.update(extra)
+        self.results.append(result)
+        rate = ''
+        if 'mb_per_sec' in result:
+            rate = '{:10.1f} MB/s'.format(result['mb_per_sec'])
+        match = '' if result.get('match', True) else '  OUTPUT DIFFERS'
+        sys.stderr.write('{:14s} {:18s} {:5s} {:10.4f} s {:>9s} KB{}{}\n'.format(
+            bench, tool, cache, result['seconds'], str(rss), rate, match))
+
+    def measure(self, bench, tool, cmd, env=None, cold=True, warm=True, expect=None, **extra):
+        "Run cmd cold and warm, recording median times; check output md5 against expect"
+        _, _, md5 = run(cmd, env, digest=True)
+        match = expect is None or md5 == expect
+        for cache in ('cold', 'warm'):
+            if not (cold if cache == 'cold' else warm):
+                continue
+            times, rss = [], 0
+            for _ in range(self.args.runs):
+                if cache == 'cold':
+                    evict(self.data, *self.index_files())
+                secs, maxrss, _ = run(cmd, env, measure=self.measure_cmd)
+                times.append(secs)
+                rss = max(rss, maxrss) if maxrss is not None else None
+            self.record(bench, tool, cache, times, rss, match=match, **extra)
+        return md5
+
+    def index_files(self):
+        "Index files in the index directory"
+        return [os.path.join(self.index_dir, fn) for fn in os.listdir(self.index_dir) if fn.endswith('.hindex')]
+
+    def build(self):
+        "Index build throughput"
+        mb = self.nbytes / 1e6
+        builds = [('hindex', self.hindex, None)]
+        builds += [(name, self.hindex_py, env) for name, env in self.tools()]
+        for name, cmd, env in builds:
+            runs = self.args.runs if name != 'hindex.py' else 1
+            times, rss = [], 0
+            for _ in range(runs):
+                evict(self.data)
+                secs, maxrss, _ = run(cmd('-b', '-f', '-P', str(SNAPLEN)), env, measure=self.measure_cmd)
+                times.append(secs)
+                rss = max(rss, maxrss) if maxrss is not None else None
+            self.record('build', name, 'cold', times, rss, mb_per_sec=round(mb / min(times), 1))
+
+    def load(self):
+        "Index load time"
+        self.measure('index_load', 'hindex', self.hindex('-l'))
+
+    def middle_line(self):
+        "Number and content of a line near the middle of the data file"
+        with open(self.data, 'rb') as fp:
+            fp.seek(self.nbytes // 2)
+            fp.readline()
+            line = fp.readline()
+        lineno = self.nlines // 2
+        return lineno, line
+
+    def queries(self):
+        "Query latency against baselines"
+        start, line = self.middle_line()
+        end = start + QUERY_LINES - 1
+        # One minute of data, which grep can match by prefix
+        minute = line[:16].decode('ascii')
+
+        bench_queries = (
+            ('query_S', ['-S', str(start), '-N', str(QUERY_LINES)],
+             [('sed', ['sed', '-n', '{},{}p;{}q'.format(start, end, end), self.data])]),
+            ('query_GL', ['-G', minute, '-L', minute],
+             [('grep', ['grep', '^' + minute, self.data])]),
+            ('query_N', ['-N', str(QUERY_LINES)],
+             [('sed', ['sed', '-n', '1,{}p;{}q'.format(QUERY_LINES, QUERY_LINES), self.data])]),
+        )
+        for bench, opts, baselines in bench_queries:
+            expect = self.measure(bench, 'hindex', self.hindex(*opts))
+            for name, env in self.tools():
+                self.measure(bench, name, self.hindex_py(*opts), env, expect=expect)
+            for name, cmd in baselines:
+                self.measure(bench, name, cmd, expect=expect)
+
+
+def compare(results, baseline_file, threshold):
+    "Report results slower than baseline by more than threshold, return False if any"
+    with open(baseline_file, encoding='utf-8') as fp:
+        baseline = [json.loads(line) for line in fp if line.strip()]
+    old = {(r['bench'], r['tool'], r['cache']): r for r in baseline if 'bench' in r}
+    ok = True
+    for result in results:
+        key = (result['bench'], result['tool'], result['cache'])
+        if key not in old or not old[key]['seconds']:
+            continue
+        ratio = result['seconds'] / old[key]['seconds']
+        flag = ''
+        if ratio > 1 + threshold:
+            flag = '  REGRESSION'
+            ok = False
+        sys.stderr.write('{:14s} {:18s} {:5s} {:10.4f} s vs {:10.4f} s {:+7.1f}%{}\n'.format(
+            *key, result['seconds'], old[key]['seconds'], 100 * (ratio - 1), flag))
+    return ok
+
+
+def main():
+    "Generate data, run suite, write results"
+    parser = argparse.ArgumentParser(description='hindex benchmark suite')
+    gen.add_arguments(parser)
+    parser.add_argument('--hindex', default='./hindex', help='hindex executable [./hindex]')
+    parser.add_argument('--hindex-py', default='./hindex.py', help='hindex.py script [./hindex.py]')
+    parser.add_argument('--measure', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'measure'),
+                        help='bench/measure executable for time and memory [bench/measure]')
+    parser.add_argument('--runs', type=int, default=5, help='Runs per measurement [5]')
+    parser.add_argument('-o', '--output', help='Write JSON lines results to OUTPUT [stdout]')
+    parser.add_argument('--baseline', help='Compare with results from an earlier run')
+    parser.add_argument('--threshold', type=float, default=0.10, help='Slowdown fraction reported as regression [0.10]')
+    parser.add_argument('--keep', action='store_true', help='Keep generated data and indexes')
+    args = parser.parse_args()
+
+    work_dir = tempfile.mkdtemp(prefix='hindex-bench.')
+    try:
+        data = os.path.join(work_dir, 'bench.log')
+        sys.stderr.write('Generating {} bytes in "{}" ...\n'.format(gen.parse_size(args.size), data))
+        with open(data, 'wb') as out:
+            nbytes, nlines = gen.generate_args(out, args)
+        suite = Suite(args, data, nbytes, nlines)
+        suite.build()
+        suite.load()
+        suite.queries()
+    finally:
+        if args.keep:
+            sys.stderr.write('Kept "{}"\n'.format(work_dir))
+        else:
+            shutil.rmtree(work_dir)
+
+    info = dict(info='hindex-bench', time=time.strftime('%Y-%m-%dT%H:%M:%S%z'), bytes=nbytes, lines=nlines,
+                size=args.size, seed=args.seed, mean_len=args.mean_len, sigma=args.sigma, step_us=args.step_us,
+                long_rate=args.long_rate, long_len=args.long_len, runs=args.runs, host=os.uname().nodename)
+    out = open(args.output, 'w', encoding='utf-8') if args.output else sys.stdout  # pylint: disable=consider-using-with
+    for result in [info] + suite.results:
+        out.write(json.dumps(result) + '\n')
+    if args.output:
+        out.close()
+
+    if args.baseline:
+        return compare(suite.results, args.baseline, args.threshold)
+    return True
+
+
+if __name__ == '__main__':
+    sys.exit(0 if main() else 1)
@@ -0,0 +1,107 @@
+#!/usr/bin/python3
+"""gen.py -- deterministic synthetic data for hindex benchmarks
+
+Writes lines of the form
+    2024-01-15 00:00:00.123456 host07 INFO <text>
+with a sorted timestamp prefix (26 bytes, for -P 26, from 2024-01-15
+for up to 16 days at the default --step-us), line lengths
+drawn from a lognormal distribution, and rare very long outlier lines.
+The same options and seed always give the same bytes.
+
+Usage: bench/gen.py [options] [FILE]   (stdout if no FILE)
+"""
+
+import sys
+import argparse
+import random
+import math
+
+LEVELS = ('DEBUG', 'INFO', 'INFO', 'INFO', 'WARN', 'ERROR')
+WORDS = ('request', 'served', 'cache', 'miss', 'hit', 'user', 'session', 'timeout', 'retry',
+         'upstream', 'latency', 'bytes', 'ok', 'failed', 'queue', 'worker', 'shard', 'index')
+
+
+def parse_size(text):
+    "Parse size with optional K, M, G (powers of 1024) suffix"
+    mult = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}.get(text[-1:].upper(), 1)
+    return int(float(text[:-1] if mult > 1 else text) * mult)
+
+
+def generate(out, size, seed=1, mean_len=120, sigma=0.5, step_us=1000, long_rate=1e-5, long_len=1 << 20):
+    """
+    Write about size bytes of lines to binary file out, returning (bytes, lines)
+    """
+    rnd = random.Random(seed)
+    # Text bodies are slices of one pseudo-random block, so lines are cheap to make
+    block = ' '.join(rnd.choice(WORDS) for _ in range(200000)).encode('ascii')
+    nblock = len(block)
+    mu = 0
+    if mean_len > 40:
+        # Lognormal with mean mean_len - prefix: mean = exp(mu + sigma^2 / 2)
+        mu = math.log(mean_len - 40) - sigma * sigma / 2
+    usec = 0
+    nbytes = nlines = 0
+    buf = []
+    nbuf = 0
+    while nbytes < size:
+        usec += int(rnd.random() * 2 * step_us)
+        secs, micros = divmod(usec, 1000000)
+        mins, secs = divmod(secs, 60)
+        hours, mins = divmod(mins, 60)
+        days, hours = divmod(hours, 24)
+        prefix = '2024-01-{:02d} {:02d}:{:02d}:{:02d}.{:06d} host{:02d} {:5s} '.format(
+            15 + days, hours, mins, secs, micros, rnd.randrange(32), rnd.choice(LEVELS)).encode('ascii')
+        if long_rate and rnd.random() < long_rate:
+            nbody = long_len
+        else:
+            nbody = max(1, int(rnd.lognormvariate(mu, sigma))) if mu else 1
+        body = b''
+        while len(body) < nbody:
+            off = rnd.randrange(nblock)
+            body += block[off:off + nbody - len(body)]
+        line = prefix + body + b'\n'
+        buf.append(line)
+        nbuf += len(line)
+        nbytes += len(line)
+        nlines += 1
+        if nbuf >= 1 << 20:
+            out.write(b''.join(buf))
+            buf = []
+            nbuf = 0
+    out.write(b''.join(buf))
+    return nbytes, nlines
+
+
+def add_arguments(parser):
+    "Add generator options to argparse parser"
+    parser.add_argument('-s', '--size', default='256M', help='Approximate bytes to write, suffix K, M or G [256M]')
+    parser.add_argument('--seed', type=int, default=1, help='Random seed [1]')
+    parser.add_argument('--mean-len', type=int, default=120, help='Mean line length in bytes [120]')
+    parser.add_argument('--sigma', type=float, default=0.5, help='Lognormal sigma of line lengths [0.5]')
+    parser.add_argument('--step-us', type=int, default=1000, help='Mean microseconds between timestamps [1000]')
+    parser.add_argument('--long-rate', type=float, default=1e-5, help='Fraction of lines that are long outliers [1e-5]')
+    parser.add_argument('--long-len', default='1M', help='Length of long outlier lines, suffix K, M or G [1M]')
+
+
+def generate_args(out, args):
+    "Generate with options from add_arguments()"
+    return generate(out, parse_size(args.size), args.seed, args.mean_len, args.sigma, args.step_us,
+                    args.long_rate, parse_size(args.long_len))
+
+
+def main():
+    "Generate to file or stdout"
+    parser = argparse.ArgumentParser(description='Generate deterministic test data for hindex benchmarks')
+    add_arguments(parser)
+    parser.add_argument('file', nargs='?', help='Output file [stdout]')
+    args = parser.parse_args()
+    if args.file:
+        with open(args.file, 'wb') as out:
+            generate_args(out, args)
+    else:
+        generate_args(sys.stdout.buffer, args)
+    return True
+
+
+if __name__ == '__main__':
+    sys.exit(0 if main() else 1)
@@ -0,0 +1,55 @@
+/*
+
+measure.c - run a command and write its wall time and peak memory
+
+Usage: measure RESULT_FILE COMMAND [ARG ...]
+
+Writes "<seconds> <peak RSS KB>" to RESULT_FILE and exits with the
+status of COMMAND.  Used by bench/bench.py: the peak RSS of a process
+counts that of the process which forked it, so commands are started
+from this small one rather than the Python interpreter.
+
+*/
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if ( argc < 3 ) {
+    fprintf(stderr, "Usage: measure RESULT_FILE COMMAND [ARG ...]\n");
+    return 2;
+  }
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pid_t pid = fork();
+  if ( pid < 0 ) {
+    perror("fork");
+    return 2;
+  }
+  if ( ! pid ) {
+    execvp(argv[2], argv + 2);
+    perror(argv[2]);
+    _exit(127);
+  }
+  int status;
+  struct rusage ru;
+  if ( wait4(pid, &status, 0, &ru) < 0 ) {
+    perror("wait4");
+    return 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  FILE * fp = fopen(argv[1], "w");
+  if ( ! fp ) {
+    perror(argv[1]);
+    return 2;
+  }
+  fprintf(fp, "%.6f %ld\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, ru.ru_maxrss);
+  fclose(fp);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Measure hindex output throughput in lines/sec, with and without -n.
+#
+# Usage: bench/output.sh [LINES] [HINDEX]
+#
+# Generates a file of LINES (default 20000000) short lines in $TMPDIR,
+# indexes it, then extracts all lines to /dev/null, best of 3 runs.
+
+LINES=${1:-20000000}
+HINDEX=${2:-./hindex}
+DIR=${TMPDIR:-/tmp}/hindex-bench.$$
+FILE=$DIR/output.txt
+
+mkdir -p "$DIR" || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+awk -v n="$LINES" 'BEGIN { for ( i = 0; i < n; i++ ) printf "%012d some text %d\n", i, i % 977 }' > "$FILE"
+"$HINDEX" -q -b -D "$DIR" "$FILE" || exit 1
+
+# Print best elapsed seconds of 3 runs of the given hindex options
+best() {
+  b=
+  for r in 1 2 3; do
+    t0=$(date +%s.%N)
+    "$HINDEX" -q -D "$DIR" "$@" "$FILE" > /dev/null || exit 1
+    t1=$(date +%s.%N)
+    b=$(echo "$t0 $t1 $b" | awk '{ t = $2 - $1; print ( $3 == "" || t < $3 ) ? t : $3 }')
+  done
+  echo "$b"
+}
+
+for opts in "" "-n"; do
+  secs=$(best $opts)
+  echo "$LINES $secs" | awk -v o="${opts:-(none)}" '{ printf "options %-8s %12d lines %8.3f s %14.0f lines/sec\n", o, $1, $2, $1 / $2 }'
+done
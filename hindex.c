@@ -12,72 +12,398 @@ int _min_of(int a, int b) {
   return a < b ? a : b;
 }
 
-/* Read line from a file, optionally capturing leading fragment.
-   Return pointer to static buffer with full line (including newline).
-   Store line length, including newline in *nread_p.
+/* Statistics for -T, see struct stats */
+static struct stats _stats;
 
-   If non-null, pointer arg frag is assumed to be allocated to
-   accommodate up to snaplen bytes plus a terminating NUL, and will be
-   populated with leading line fragment of up to snaplen bytes (never
-   including the newline).
+/* Add n to counter field of _stats if collecting them */
+#define STATS_ADD(field, n) do { if ( _stats.on ) atomic_fetch_add_explicit(&_stats.field, (n), memory_order_relaxed); } while (0)
+
+/* Set up records ending with byte delim, or if start is given,
+   beginning at lines matching it */
+bool records_init(struct records * rec, int delim, char * start) {
+  *rec = (struct records) { delim, 0, 0, 0, 0 };
+  if ( ! start )
+    return true;
+  rec->delim = '\n';
+  rec->start = strdup(start);
+  if ( start[0] == '^' && ! strpbrk(start + 1, ".[]()*+?{}|\\^$") ) {
+    rec->prefix = rec->start + 1;
+    rec->nprefix = strlen(rec->prefix);
+    return true;
+  }
+  rec->re = malloc(sizeof *rec->re);
+  if ( regcomp(rec->re, start, REG_EXTENDED | REG_NOSUB) ) {
+    free(rec->re);
+    rec->re = 0;
+    return false;
+  }
+  return true;
+}
+
+/* Free what records_init() allocated, leaving plain lines */
+void records_free(struct records * rec) {
+  if ( rec->re ) {
+    regfree(rec->re);
+    free(rec->re);
+  }
+  free(rec->start);
+  records_init(rec, '\n', 0);
+}
+
+/* Set up rec as its own copy of records src */
+bool records_copy(struct records * rec, struct records * src) {
+  return records_init(rec, src->delim, src->start);
+}
+
+/* Whether records are other than lines */
+bool _records_custom(struct records * rec) {
+  return rec && (rec->delim != '\n' || rec->start);
+}
+
+bool _records_equal(struct records * a, struct records * b) {
+  if ( a->delim != b->delim || ! a->start != ! b->start )
+    return false;
+  return ! a->start || ! strcmp(a->start, b->start);
+}
+
+/* Whether line of len bytes (without newline) begins a record */
+bool _record_starts(struct records * rec, unsigned char * line, long len) {
+  if ( rec->prefix )
+    return len >= rec->nprefix && ! memcmp(line, rec->prefix, rec->nprefix);
+  regmatch_t m = { 0, len };
+  return ! regexec(rec->re, line, 1, &m, REG_STARTEND);
+}
+
+/* Length of record at p in n bytes of data, or 0 if it may go on past
+   them unless at_end, when data ends after them */
+long _record_len(struct records * rec, unsigned char * p, long n, bool at_end) {
+  unsigned char * e = memchr(p, rec->delim, n);
+  long len = e ? e - p + 1 : at_end ? n : 0;
+  while ( rec->start && len && len < n ) {
+    e = memchr(p + len, '\n', n - len);
+    if ( ! e && ! at_end )
+      return 0;
+    long next = e ? e - p + 1 : n;
+    if ( _record_starts(rec, p + len, e ? next - len - 1 : next - len) )
+      return len;
+    len = next;
+  }
+  return rec->start && ! at_end ? 0 : len;
+}
+
+/* Bytes of whole records at the start of n bytes of data beginning
+   with a record, 0 if none are known to end within them */
+long _records_whole(struct records * rec, unsigned char * p, long n) {
+  unsigned char * e = memrchr(p, rec->delim, n);
+  if ( ! rec->start )
+    return e ? e - p + 1 : 0;
+  /* Last whole line after the first that begins a record */
+  while ( e && e > p ) {
+    unsigned char * b = memrchr(p, '\n', e - p);
+    if ( ! b )
+      return 0;
+    if ( _record_starts(rec, b + 1, e - b - 1) )
+      return b + 1 - p;
+    e = b;
+  }
+  return 0;
+}
+
+/* Bytes at the start of n bytes of data that go on a record begun
+   before them, setting *ended_p if it ends there (or at_end, when data
+   ends after them).  *in_line_p tells whether the data begin within a
+   line, and is updated for the data after those bytes.  Stops before a
+   line not seen whole unless it fills the data, when it is judged by
+   its first n bytes, as _record_ahead() does */
+long _record_rest(struct records * rec, unsigned char * p, long n, bool at_end, bool * in_line_p, bool * ended_p) {
+  *ended_p = false;
+  if ( ! rec->start ) {
+    unsigned char * e = memchr(p, rec->delim, n);
+    *ended_p = e || at_end;
+    return e ? e - p + 1 : n;
+  }
+  long len = 0;
+  if ( *in_line_p ) {
+    unsigned char * e = memchr(p, '\n', n);
+    len = e ? e - p + 1 : n;
+    *in_line_p = ! e;
+  }
+  while ( len < n ) {
+    unsigned char * e = memchr(p + len, '\n', n - len);
+    if ( ! e && ! at_end && len )
+      return len;
+    long next = e ? e - p + 1 : n;
+    if ( _record_starts(rec, p + len, e ? next - len - 1 : next - len) ) {
+      *ended_p = true;
+      return len;
+    }
+    *in_line_p = ! e;
+    len = next;
+  }
+  *ended_p = at_end;
+  return len;
+}
+
+/* Length of key of record s of n bytes: without its delimiter and
+   stopping at any newline within it, as for index fragments */
+long _record_key_len(struct records * rec, unsigned char * s, long n) {
+  if ( n && s[n-1] == rec->delim )
+    n--;
+  unsigned char * nl = memchr(s, '\n', n);
+  return nl ? nl - s : n;
+}
+
+/* Lines and records are read in blocks of up to LINE_BLOCK_SIZE bytes,
+   so reading one takes bounded memory and reads each byte once however
+   long it is.  _read_head() reads the first block of a line or record,
+   _read_more() the next while *more_p was set, and _read_rest() reads
+   (copying or discarding) all that is left.  _skip_line() reads past a
+   line capturing its fragment, and _read_line() assembles a whole line
+   for the few callers that need one.
+
+   Each block is NUL terminated.  Three per-thread buffers hold the
+   head, the current block and, for records begun by lines matching
+   rec->start (-J), the block read ahead to see whether the next line
+   goes on the record.  If it begins another record instead, the stream
+   is moved back before it (at most one block, still in the stdio
+   buffer).
 
    FILE pointer fp must be "seekable" backward (i.e., cannot be stdin)
 */
-static unsigned char * _full_buff = 0;
-static int _full_bufflen = 512 * 1024;
-unsigned char * _read_line(FILE * fp, long snaplen, unsigned char * frag, long * nread_p) {
+static __thread unsigned char * _line_buff[3] = { 0, 0, 0 };
+static __thread long _line_bufflen[3] = { 0, 0, 0 };
+static __thread long _nahead = -1;
+static __thread bool _ahead_more = false;
+static __thread unsigned char * _full_buff = 0;
 
-  /* Init buffer */
-  if ( ! _full_buff )
-    _full_buff = malloc(_full_bufflen * sizeof *_full_buff);
-  _full_buff[0] = '\0';
+/* Read up to size bytes into line buffer i, stopping after delim.  Set
+   *more_p if the line goes on past them */
+long _read_upto(FILE * fp, int delim, int i, long size, bool * more_p) {
+  if ( _line_bufflen[i] < size + 1 ) {
+    free(_line_buff[i]);
+    _line_buff[i] = malloc(size + 1);
+    _line_bufflen[i] = size + 1;
+  }
+  unsigned char * p = _line_buff[i];
+  long n = 0;
+  if ( delim == '\n' ) {
+    if ( fgets(p, size + 1, fp) )
+      n = strlen(p);
+  }
+  else {
+    /* A byte at a time: indexing, which reads every record, scans them
+       by memchr over blocks of its own (_skip_block_record()) */
+    int c;
+    flockfile(fp);
+    while ( n < size && (c = getc_unlocked(fp)) != EOF ) {
+      p[n++] = c;
+      if ( c == delim )
+        break;
+    }
+    funlockfile(fp);
+  }
+  p[n] = '\0';
+  *more_p = n == size && p[n-1] != delim;
+  STATS_ADD(bytes_read, n);
+  return n;
+}
 
-  /* Init output fragment */
-  if ( frag )
-    *frag = '\0';
+/* Once a line of a -J record has been read, read ahead the next line:
+   set *more_p if it goes on the record, else move back before it */
+void _record_ahead(FILE * fp, struct records * rec, bool * more_p) {
+  bool more = false;
+  long n = _read_upto(fp, '\n', 2, LINE_BLOCK_SIZE, &more);
+  *more_p = false;
+  if ( ! n )
+    return;
+  unsigned char * p = _line_buff[2];
+  if ( ! _record_starts(rec, p, ! more && p[n-1] == '\n' ? n - 1 : n) ) {
+    _nahead = n;
+    _ahead_more = more;
+    *more_p = true;
+    return;
+  }
+  fseeko(fp, -n, SEEK_CUR);
+  STATS_ADD(bytes_read, -n);
+}
 
-  long nread = 0;
-  while ( true ) {
-    char * data_read = fgets(_full_buff, _full_bufflen, fp);
+/* Read the first block of the line or record at fp, of at least want
+   bytes if it is that long.  Store its length in *n_p and set *more_p
+   if the line or record goes on past it */
+unsigned char * _read_head(FILE * fp, struct records * rec, long want, long * n_p, bool * more_p) {
+  bool more = false;
+  _nahead = -1;
+  long n = _read_upto(fp, rec->delim, 0, want > LINE_BLOCK_SIZE ? want : LINE_BLOCK_SIZE, &more);
+  if ( n && ! more && rec->start )
+    _record_ahead(fp, rec, &more);
+  *n_p = n;
+  *more_p = more;
+  return _line_buff[0];
+}
 
-    /* EOF */
-    if ( ! data_read ) {
-      *nread_p = nread;
-      _full_buff[nread] = '\0';
-      return _full_buff;
-    }
+/* Read the next block of the line or record after _read_head() */
+unsigned char * _read_more(FILE * fp, struct records * rec, long * n_p, bool * more_p) {
+  bool more = false;
+  long n = 0;
+  if ( _nahead >= 0 ) {
+    unsigned char * p = _line_buff[1];
+    long len = _line_bufflen[1];
+    _line_buff[1] = _line_buff[2];
+    _line_bufflen[1] = _line_bufflen[2];
+    _line_buff[2] = p;
+    _line_bufflen[2] = len;
+    n = _nahead;
+    more = _ahead_more;
+    _nahead = -1;
+  }
+  else
+    n = _read_upto(fp, rec->delim, 1, LINE_BLOCK_SIZE, &more);
+  if ( n && ! more && rec->start )
+    _record_ahead(fp, rec, &more);
+  *n_p = n;
+  *more_p = more;
+  return _line_buff[1];
+}
 
-    nread = strlen(data_read);
-    if ( nread < _full_bufflen - 1 )
-      break;
+/* Read past line or record, returning its first want or more bytes
+   (NUL terminated) and storing its full length, including the
+   delimiter, in *nread_p.
+
+   If non-null, frag is assumed to be allocated to accommodate up to
+   want bytes plus a terminating NUL, and will be populated with the
+   leading fragment of up to want bytes, never including the delimiter
+   and stopping at any newline within a record.
+*/
+unsigned char * _skip_line(FILE * fp, struct records * rec, long want, unsigned char * frag, long * nread_p) {
+  long n = 0, nread = 0;
+  bool more = false;
+  unsigned char * head = _read_head(fp, rec, want, &n, &more);
+  nread = n;
+  while ( more ) {
+    _read_more(fp, rec, &n, &more);
+    nread += n;
+  }
+
+  /* Capture leading fragment */
+  if ( frag ) {
+    long to_copy = want < nread ? want : nread;
+    if ( to_copy && head[to_copy-1] == rec->delim )
+      to_copy--;
+    unsigned char * nl = memchr(head, '\n', to_copy);
+    if ( nl )
+      to_copy = nl - head;
+    memcpy(frag, head, to_copy);
+    frag[to_copy] = '\0';
+  }
 
-    /* Grow buffer */
-    _full_bufflen *= 2;
-    _full_buff = realloc(_full_buff, _full_bufflen);
+  *nread_p = nread;
+  return head;
+}
 
-    /* Back up and re-read */
-    fseek(fp, -nread, SEEK_CUR);
+/* As _skip_line() for a record ending with byte rec->delim (-X), read
+   from blocks b of the data file rather than through stdio */
+void _skip_block_record(struct record_block * b, struct records * rec, long want, unsigned char * frag, long * nread_p) {
+  long nread = 0;
+  while ( true ) {
+    if ( b->lo == b->hi ) {
+      ssize_t got = pread(b->fd, b->buf, LINE_BLOCK_SIZE, b->pos);
+      if ( got <= 0 )
+        break;
+      STATS_ADD(bytes_read, got);
+      b->lo = 0;
+      b->hi = got;
+      b->pos += got;
+    }
+    unsigned char * p = b->buf + b->lo;
+    unsigned char * e = memchr(p, rec->delim, b->hi - b->lo);
+    long len = e ? e - p + 1 : b->hi - b->lo;
+    if ( frag && nread < want )
+      memcpy(frag + nread, p, want - nread < len ? want - nread : len);
+    nread += len;
+    b->lo += len;
+    if ( e )
+      break;
   }
 
   /* Capture leading fragment */
   if ( frag ) {
-    int to_copy = _min_of(snaplen, nread);
-    if ( _full_buff[to_copy-1] == '\n' )
+    long to_copy = want < nread ? want : nread;
+    if ( to_copy && frag[to_copy-1] == rec->delim )
       to_copy--;
-    memcpy(frag, _full_buff, to_copy);
+    unsigned char * nl = memchr(frag, '\n', to_copy);
+    if ( nl )
+      to_copy = nl - frag;
     frag[to_copy] = '\0';
   }
 
   *nread_p = nread;
+}
+
+/* Read whole line or record into a buffer, returning it (NUL
+   terminated) and storing its length in *nread_p.  Only a line longer
+   than a block is copied to a buffer of its own, freed on the next
+   call */
+unsigned char * _read_line(FILE * fp, struct records * rec, long * nread_p) {
+  free(_full_buff);
+  _full_buff = 0;
+  long n = 0;
+  bool more = false;
+  unsigned char * head = _read_head(fp, rec, 0, &n, &more);
+  *nread_p = n;
+  if ( ! more )
+    return head;
+
+  long nread = n, len = 4 * n;
+  _full_buff = malloc(len);
+  memcpy(_full_buff, head, n);
+  while ( more ) {
+    unsigned char * p = _read_more(fp, rec, &n, &more);
+    if ( nread + n + 1 > len ) {
+      len = 2 * (nread + n + 1);
+      _full_buff = realloc(_full_buff, len);
+    }
+    memcpy(_full_buff + nread, p, n);
+    nread += n;
+  }
   _full_buff[nread] = '\0';
+  *nread_p = nread;
   return _full_buff;
 }
 
+#ifdef HINDEX_LIBRARY
+/* Messages since the last library call began, for hindex_last_error() */
+static __thread char _last_error[BUFSIZE];
+
+/* Append to last error message and return false */
+bool _error(char * s) {
+  size_t n = strlen(_last_error);
+  if ( n && n < BUFSIZE - 1 ) {
+    _last_error[n] = _last_error[n-1] == ':' ? ' ' : '\n';
+    n++;
+  }
+  snprintf(_last_error + n, BUFSIZE - n, "%s", s);
+  n = strlen(_last_error);
+  while ( n && _last_error[n-1] == '\n' )
+    _last_error[--n] = '\0';
+  return false;
+}
+#else
 /* Output to sdtderr and return false */
 bool _error(char * s) {
   fprintf(stderr, "%s\n", s);
   return false;
 }
+#endif
+
+/* Code (HINDEX_ERR_*) of the first failure since the last library call began */
+static __thread int _error_code = HINDEX_OK;
+
+/* Record error code, then output as _error() */
+bool _error_as(int code, char * s) {
+  if ( _error_code == HINDEX_OK )
+    _error_code = code;
+  return _error(s);
+}
 
 /* Output to stdout */
 void _out(char * s) {
@@ -95,7 +421,7 @@ void _strip_nl(char *s) {
 
 /* Format long int w/ commas. Pad to given len or if 0, shrink to fit */
 char * _out_size(long long n, int len) {
-  static char result[BUFSIZE];
+  static __thread char result[BUFSIZE];
   char buf[BUFSIZE];
 
   sprintf(buf, "%lld", n);
@@ -127,7 +453,7 @@ char * _out_size(long long n, int len) {
 
 /* Format double epoch */
 char * _out_tm(long double tm) {
-  static char result[BUFSIZE];
+  static __thread char result[BUFSIZE];
   char tmpbuf[BUFSIZE];
   time_t secs = floorl(tm);
   struct tm * ltime = localtime(&secs);
@@ -150,6 +476,264 @@ void _out_line(char * prompt, char * line) {
   printf("%-17s%s\n", p, line);
 }
 
+double _ts_secs(struct timespec * from, struct timespec * to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Start collecting statistics, in phase "other" */
+void stats_start(bool json) {
+  _stats.on = true;
+  _stats.json = json;
+  _stats.phase = STATS_OTHER;
+  clock_gettime(CLOCK_MONOTONIC, &_stats.wall0);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &_stats.cpu0);
+}
+
+/* Charge time since the last change to the current phase, then enter phase */
+void stats_phase(int phase) {
+  if ( ! _stats.on )
+    return;
+  struct timespec wall, cpu;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  _stats.wall[_stats.phase] += _ts_secs(&_stats.wall0, &wall);
+  _stats.cpu[_stats.phase] += _ts_secs(&_stats.cpu0, &cpu);
+  _stats.wall0 = wall;
+  _stats.cpu0 = cpu;
+  _stats.phase = phase;
+}
+
+/* Output statistics to stderr, as text or one line of JSON */
+void stats_report() {
+  if ( ! _stats.on )
+    return;
+  stats_phase(STATS_OTHER);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double wall = 0, cpu = 0;
+  int i;
+  for ( i = 0; i < STATS_NPHASE; i++ ) {
+    wall += _stats.wall[i];
+    cpu += _stats.cpu[i];
+  }
+  long long counts[] = { _stats.bytes_read, _stats.index_bytes_read, _stats.bytes_output, _stats.lines_discarded, _stats.seeks,
+                         ru.ru_minflt, ru.ru_majflt, ru.ru_inblock, ru.ru_oublock, ru.ru_maxrss };
+  char * names[] = { "bytes_read", "index_bytes_read", "bytes_output", "lines_discarded", "seeks",
+                     "minor_faults", "major_faults", "blocks_in", "blocks_out", "max_rss_kb" };
+  int ncount = sizeof counts / sizeof counts[0];
+
+  if ( _stats.json ) {
+    fprintf(stderr, "{\"phases\": {");
+    for ( i = 0; i < STATS_NPHASE; i++ )
+      fprintf(stderr, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", i ? ", " : "", STATS_PHASE_NAME[i], _stats.wall[i], _stats.cpu[i]);
+    fprintf(stderr, "}, \"wall\": %.6f, \"cpu\": %.6f", wall, cpu);
+    for ( i = 0; i < ncount; i++ )
+      fprintf(stderr, ", \"%s\": %lld", names[i], counts[i]);
+    fprintf(stderr, "}\n");
+    return;
+  }
+  fprintf(stderr, "%-17s%12s %12s\n", "Phase:", "wall s", "cpu s");
+  for ( i = 0; i < STATS_NPHASE; i++ )
+    fprintf(stderr, "%-17s%12.6f %12.6f\n", STATS_PHASE_NAME[i], _stats.wall[i], _stats.cpu[i]);
+  fprintf(stderr, "%-17s%12.6f %12.6f\n", "total", wall, cpu);
+  for ( i = 0; i < ncount; i++ ) {
+    char prompt[BUFSIZE];
+    sprintf(prompt, "%s:", names[i]);
+    fprintf(stderr, "%-17s%s\n", prompt, _out_size(counts[i], 15));
+  }
+}
+
+/* Get page cache residency of len bytes of fd at page-aligned offset
+   off into vec, one byte per page as mincore() gives it */
+bool _mincore(int fd, long long off, size_t len, unsigned char * vec) {
+  void * base = mmap(0, len, PROT_READ, MAP_SHARED, fd, off);
+  if ( base == MAP_FAILED )
+    return false;
+  bool ok = ! mincore(base, len, vec);
+  munmap(base, len);
+  return ok;
+}
+
+/* Count bytes of [start, end) of fd in the page cache into *cached_p */
+bool cache_residency(int fd, long long start, long long end, long long * cached_p) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t window = 1L << 30;
+  unsigned char * vec = malloc(window / page);
+  long long off = start - start % page;
+  *cached_p = 0;
+  bool ok = true;
+  while ( ok && off < end ) {
+    size_t len = end - off < window ? end - off : window;
+    size_t npage = (len + page - 1) / page, i;
+    if ( ! (ok = _mincore(fd, off, len, vec)) )
+      break;
+    for ( i = 0; i < npage; i++ ) {
+      if ( ! (vec[i] & 1) )
+        continue;
+      long long lo = off + i * page, hi = lo + page;
+      *cached_p += (hi < end ? hi : end) - (lo > start ? lo : start);
+    }
+    off += len;
+  }
+  free(vec);
+  return ok;
+}
+
+/* Drop pages of window at off that were not cached when probed */
+void _cache_drop_window(struct cache_cursor * cc, long long off) {
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned char * vec = cc->resident[(off / CACHE_WINDOW_SIZE) % CACHE_PROBE_WINDOWS];
+  long long len = cc->end - off < CACHE_WINDOW_SIZE ? cc->end - off : CACHE_WINDOW_SIZE;
+  long npage = (len + page - 1) / page, i = 0;
+  while ( i < npage ) {
+    if ( vec[i] & 1 ) {
+      i++;
+      continue;
+    }
+    long j = i;
+    while ( j < npage && ! (vec[j] & 1) )
+      j++;
+    posix_fadvise(cc->fd, off + i * page, (j - i) * page, POSIX_FADV_DONTNEED);
+    i = j;
+  }
+}
+
+/* Drop windows wholly behind pos, probe residency of windows up to
+   CACHE_PROBE_WINDOWS - 1 ahead and advise those up to one ahead.
+   Callers check pos >= cc->due first. */
+void cache_cursor_advance(struct cache_cursor * cc, long long pos) {
+  long page = sysconf(_SC_PAGESIZE);
+  while ( cc->drop && cc->done < cc->next && cc->done + CACHE_WINDOW_SIZE <= pos ) {
+    _cache_drop_window(cc, cc->done);
+    cc->done += CACHE_WINDOW_SIZE;
+  }
+  while ( cc->drop && cc->probed < cc->end && cc->probed < pos + CACHE_PROBE_WINDOWS * CACHE_WINDOW_SIZE - CACHE_WINDOW_SIZE ) {
+    long long len = cc->end - cc->probed < CACHE_WINDOW_SIZE ? cc->end - cc->probed : CACHE_WINDOW_SIZE;
+    unsigned char * vec = cc->resident[(cc->probed / CACHE_WINDOW_SIZE) % CACHE_PROBE_WINDOWS];
+    /* Treat window as cached if residency is unknown, so it is kept */
+    if ( ! _mincore(cc->fd, cc->probed, len, vec) )
+      memset(vec, 1, CACHE_WINDOW_SIZE / page);
+    cc->probed += CACHE_WINDOW_SIZE;
+  }
+  while ( cc->next < cc->end && cc->next <= pos + CACHE_WINDOW_SIZE ) {
+    long long len = cc->end - cc->next < CACHE_WINDOW_SIZE ? cc->end - cc->next : CACHE_WINDOW_SIZE;
+    posix_fadvise(cc->fd, cc->next, len, POSIX_FADV_WILLNEED);
+    cc->next += CACHE_WINDOW_SIZE;
+  }
+  cc->due = cc->next < cc->end ? cc->next - CACHE_WINDOW_SIZE : LLONG_MAX;
+  if ( cc->drop && cc->done < cc->next && cc->done + CACHE_WINDOW_SIZE < cc->due )
+    cc->due = cc->done + CACHE_WINDOW_SIZE;
+}
+
+/* Start hints for reading fd forward from pos up to end, dropping
+   newly cached pages behind the cursor if drop */
+void cache_cursor_init(struct cache_cursor * cc, int fd, long long pos, long long end, bool drop) {
+  long page = sysconf(_SC_PAGESIZE);
+  int i;
+  cc->fd = fd;
+  cc->drop = drop;
+  cc->end = end;
+  cc->next = cc->done = cc->probed = pos - pos % CACHE_WINDOW_SIZE;
+  for ( i = 0; i < CACHE_PROBE_WINDOWS; i++ )
+    cc->resident[i] = drop ? malloc(CACHE_WINDOW_SIZE / page) : 0;
+  /* Kernel readahead would cache windows before they are probed, so
+     when dropping only the windows advised are read ahead */
+  posix_fadvise(fd, pos, end - pos, drop ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL);
+  cache_cursor_advance(cc, pos);
+}
+
+/* Drop the windows still pending and free the cursor */
+void cache_cursor_finish(struct cache_cursor * cc) {
+  int i;
+  for ( ; cc->drop && cc->done < cc->next; cc->done += CACHE_WINDOW_SIZE )
+    _cache_drop_window(cc, cc->done);
+  for ( i = 0; i < CACHE_PROBE_WINDOWS; i++ ) {
+    free(cc->resident[i]);
+    cc->resident[i] = 0;
+  }
+}
+
+/* Drop data read by index builds from the page cache, set from -U */
+static bool _build_drop_cache = false;
+
+void set_build_drop_cache(bool drop) {
+  _build_drop_cache = drop;
+}
+
+/* Rates of index build throttle, set from -W for builds no one waits on */
+static double _build_throttle_bytes = 0;
+static double _build_throttle_reads = 0;
+
+void set_build_throttle(double bytes_per_sec, double reads_per_sec) {
+  _build_throttle_bytes = bytes_per_sec;
+  _build_throttle_reads = reads_per_sec;
+}
+
+/* Start throttling a build scan at pos, if a throttle is set */
+void throttle_init(struct throttle * th, long long pos) {
+  memset(th, 0, sizeof *th);
+  th->bytes_per_sec = _build_throttle_bytes;
+  th->reads_per_sec = _build_throttle_reads;
+  th->scale = 1;
+  th->pos = pos;
+  th->due = th->bytes_per_sec > 0 ? pos + THROTTLE_READ_SIZE : LLONG_MAX;
+  clock_gettime(CLOCK_MONOTONIC, &th->wall0);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &th->cpu0);
+}
+
+/* Account for the scan having reached pos: adapt the scale to the time
+   stalled per read (wall less CPU time since last accounting), then
+   take tokens for the bytes and reads and sleep off any deficit.
+   Callers check pos >= th->due first. */
+void throttle_advance(struct throttle * th, long long pos) {
+  struct timespec wall, cpu;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  long long nbytes = pos - th->pos;
+  double nread = nbytes / THROTTLE_READ_SIZE > 1 ? nbytes / THROTTLE_READ_SIZE : 1;
+  double secs = _ts_secs(&th->wall0, &wall);
+  double stall = (secs - _ts_secs(&th->cpu0, &cpu)) / nread;
+  if ( stall < 0 )
+    stall = 0;
+
+  /* Back off while reads stall well beyond the baseline, which follows
+     the lowest stall seen down at once and drifts up to a sustained one */
+  th->stall_avg = th->stall_base ? 0.8 * th->stall_avg + 0.2 * stall : stall;
+  if ( ! th->stall_base || th->stall_avg < th->stall_base )
+    th->stall_base = fmax(th->stall_avg, THROTTLE_MIN_STALL);
+  else
+    th->stall_base += (th->stall_avg - th->stall_base) * THROTTLE_DRIFT;
+  if ( th->stall_avg > 2 * th->stall_base )
+    th->scale = fmax(th->scale / 2, THROTTLE_MIN_SCALE);
+  else
+    th->scale = fmin(th->scale + THROTTLE_STEP, 1);
+
+  /* Refill and take from the buckets, the deficit of either sets the sleep */
+  double byte_rate = th->bytes_per_sec * th->scale, read_rate = th->reads_per_sec * th->scale;
+  double burst = fmax(byte_rate * THROTTLE_BURST_SECS, THROTTLE_READ_SIZE);
+  th->byte_tokens = fmin(th->byte_tokens + byte_rate * secs, burst) - nbytes;
+  double wait = th->byte_tokens < 0 ? -th->byte_tokens / byte_rate : 0;
+  if ( read_rate > 0 ) {
+    burst = fmax(read_rate * THROTTLE_BURST_SECS, 1);
+    th->read_tokens = fmin(th->read_tokens + read_rate * secs, burst) - nread;
+    if ( th->read_tokens < 0 && -th->read_tokens / read_rate > wait )
+      wait = -th->read_tokens / read_rate;
+    th->read_tokens += read_rate * wait;
+  }
+  th->byte_tokens += byte_rate * wait;
+  if ( wait > 0 ) {
+    struct timespec ts = { (time_t) wait, (long) ((wait - (time_t) wait) * 1e9) };
+    while ( nanosleep(&ts, &ts) && errno == EINTR )
+      ;
+    th->slept += wait;
+  }
+
+  th->pos = pos;
+  th->due = pos + THROTTLE_READ_SIZE;
+  clock_gettime(CLOCK_MONOTONIC, &th->wall0);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &th->cpu0);
+}
+
 /* Get file size and mtime w/  nanos */
 void _get_file_size_mtime(char *fn, long long * size, long double * mtime) {
   struct stat statinfo;
@@ -186,7 +770,7 @@ int usage_error(char * msg) {
 
 /* Get a hash for a file name given full (real) path */
 char * get_filename_hash(char * fn) {
-  static char result[BUFSIZE];
+  static __thread char result[BUFSIZE];
   size_t len = strlen(fn);
   unsigned char hash[SHA256_DIGEST_LENGTH];
   SHA256((const unsigned char *)fn, len, hash);
@@ -301,9 +885,13 @@ void init_hindex(struct hindex * s) {
   s->index_mtime     = 0;
   s->chunk_size      = DEFAULT_CHUNK_SIZE;
   s->snaplen         = 0;
+  records_init(&s->rec, '\n', 0);
   s->nentry          = 0;
   s->maxentry        = 0;
   s->entries         = 0;
+  s->build_secs      = 0;
+  s->build_bytes     = 0;
+  s->oc              = 0;
 }
 
 /* Load info from index file */
@@ -326,6 +914,7 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
     _error(buf);
     return _error(strerror(errno));
   }
+  STATS_ADD(index_bytes_read, idx->index_file_size);
 
   /*
     Read header lines (2).  First is filename, then (mtime, size, lines, chunk_size, snaplen, nentry)
@@ -340,13 +929,13 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
   if ( ! h_filename ) {
     fclose(fp);
     sprintf(buf, "ERROR: Got EOF reading filename on index file \"%s\"", filename_full);
-    return _error(buf);
+    return _error_as(HINDEX_ERR_FORMAT, buf);
   }
   _strip_nl(h_filename);
   if ( 0 != strcmp(filename_full, h_filename) ) {
     fclose(fp);
     sprintf(buf, "ERROR: Name mismatch: index \"%s\" has \"%s\" for file \"%s\"", index_filename, h_filename, filename_full);
-    return _error(buf);
+    return _error_as(HINDEX_ERR_FORMAT, buf);
   }
 
   /* Read (mtime, size, lines, chunk_size, snaplen, nentry) from header */
@@ -354,7 +943,7 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
   if ( ! h_mslcse_flds ) {
     fclose(fp);
     sprintf(buf, "ERRROR: Got EOF reading stats on index file \"%s\"", filename_full);
-    return _error(buf);
+    return _error_as(HINDEX_ERR_FORMAT, buf);
   }
   _strip_nl(h_mslcse_flds);
 
@@ -362,11 +951,23 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
   long long _hdr_file_size; /* Ignored */
   long long _hdr_file_lines; /* Ignored */
   long double _hdr_file_mtime; /* Ignored */
-  int nparse = sscanf(h_mslcse_flds, "%Lf %lld %lld %ld %ld %d", &_hdr_file_mtime, &_hdr_file_size, &_hdr_file_lines, &idx->chunk_size, &idx->snaplen, &nentry_expected);
+  int nhdr = 0;
+  int nparse = sscanf(h_mslcse_flds, "%Lf %lld %lld %ld %ld %d%n", &_hdr_file_mtime, &_hdr_file_size, &_hdr_file_lines, &idx->chunk_size, &idx->snaplen, &nentry_expected, &nhdr);
   if ( nparse != 6 ) {
     fclose(fp);
     sprintf(buf, "ERROR: Line not of form (mtime, size, lines, chunk_size, snaplen, nentry) in \"%s\":\n%s\n", index_filename, h_mslcse_flds);
-    return _error(buf);
+    return _error_as(HINDEX_ERR_FORMAT, buf);
+  }
+
+  /* Records other than lines follow as (delim, [start]) */
+  int rec_delim = '\n', nrec = 0;
+  char * rec_start = 0;
+  if ( sscanf(h_mslcse_flds + nhdr, " %d%n", &rec_delim, &nrec) == 1 && h_mslcse_flds[nhdr + nrec] == ' ' )
+    rec_start = h_mslcse_flds + nhdr + nrec + 1;
+  if ( ! records_init(&idx->rec, rec_delim, rec_start) ) {
+    fclose(fp);
+    sprintf(buf, "ERROR: Invalid record start pattern \"%s\" in \"%s\"", rec_start, index_filename);
+    return _error_as(HINDEX_ERR_FORMAT, buf);
   }
 
   /* Read index entries */
@@ -378,7 +979,7 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
     if ( ! i_line ) {
       fclose(fp);
       sprintf(buf, "ERROR: EOF after %d lines(s) in \"%s\"\n", nread, index_filename);
-      return _error(buf);
+      return _error_as(HINDEX_ERR_FORMAT, buf);
     }
     _strip_nl(h_mslcse_flds);
 
@@ -389,7 +990,7 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
     if ( nparse != 2 ) {
       fclose(fp);
       sprintf(buf, "ERROR: Index line %d not of form (offset, lineno, ...) in \"%s\":%s\n", nread+1, index_filename, i_line);
-      return _error(buf);
+      return _error_as(HINDEX_ERR_FORMAT, buf);
     }
     /* Get line fragment */
     unsigned char * e_frag = 0;
@@ -415,7 +1016,7 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
 
   if ( idx->nentry != nentry_expected ) {
     sprintf(buf, "ERROR: Expected %d entries, read %d in \"%s\"\n", nentry_expected, idx->nentry, index_filename);
-    return _error(buf);
+    return _error_as(HINDEX_ERR_FORMAT, buf);
   }
 
   /* File exists, check if stale due to file replaced or grew */
@@ -444,12 +1045,55 @@ bool get_index_info(char * filename_full, char * index_filename, struct hindex *
   return true;
 }
 
+/* Write index file of idx, indexing size bytes of size lines */
+bool _write_index(struct hindex * idx, long long size, long long lines, long chunk_size) {
+  char buf[BUFSIZE];
+  FILE * idx_fp = fopen(idx->index_filename, "wb");
+  if ( ! idx_fp ) {
+    sprintf(buf, "ERROR: Cannot write index file \"%s\":", idx->index_filename);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Write two-line header: filename then (mtime, size, lines, chunk_size, snaplen, nentry), and
+     for records other than lines (delim, [start]) */
+  fprintf(idx_fp, "%s\n%.6Lf %lld %lld %ld %ld %d", idx->filename_full, idx->file_mtime, size, lines, chunk_size, idx->snaplen, idx->nentry);
+  if ( _records_custom(&idx->rec) )
+    fprintf(idx_fp, " %d", idx->rec.delim);
+  if ( idx->rec.start )
+    fprintf(idx_fp, " %s", idx->rec.start);
+  fprintf(idx_fp, "\n");
+
+  /* Write entries */
+  int i;
+  for ( i = 0; i < idx->nentry; i++ ) {
+    struct entry ent = idx->entries[i];
+    fprintf(idx_fp, "%lld %lld", ent.filepos, ent.lineno);
+    if ( ent.frag )
+      fprintf(idx_fp, " %s", ent.frag);
+    fprintf(idx_fp, "\n");
+  }
+
+  if ( fclose(idx_fp) ) {
+    sprintf(buf, "ERROR: Cannot write index file \"%s\":", idx->index_filename);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Offsets cached for the old index may be off in the new one */
+  snprintf(buf, BUFSIZE, "%s%s", idx->index_filename, OFFSET_CACHE_SUFFIX);
+  unlink(buf);
+  return true;
+}
+
 /* Check, build or freshen an index file */
-bool index_file(struct hindex * idx, char * filename, char * index_filename, long chunk_size, long snaplen, bool quiet, bool verbose, bool force, bool dryrun, bool for_content_search) {
+bool index_file(struct hindex * idx, char * filename, char * index_filename, long chunk_size, long snaplen, struct records * rec, bool quiet, bool verbose, bool force, bool dryrun, bool for_content_search) {
   char buf[BUFSIZE], bytes_disp[BUFSIZE], last_bytes_disp[BUFSIZE], lines_disp[BUFSIZE];
 
   /* Get current index info */
+  stats_phase(STATS_LOAD);
   bool success = get_index_info(filename, index_filename, idx);
+  stats_phase(STATS_REFRESH);
   if ( !success )
     return false;
   bool exists = idx->status != INDEX_STATUS_ABSENT;
@@ -457,7 +1101,7 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
   /* Report newly indexed file */
   if ( !exists ) {
     if ( for_content_search  && ! snaplen )
-      return _error("ERROR: Need to specify -P <snaplen> for new index when using -G or -L");
+      return _error_as(HINDEX_ERR_SNAPLEN, "ERROR: Need to specify -P <snaplen> for new index when using -G or -L");
     if ( !quiet ) {
       char * action = dryrun ? "Would create" : "Creating";
       sprintf(buf, "%s new index \"%s\" on \"%s\" %s bytes .. please wait ... (-q to suppress)", action, index_filename, filename, _out_size(idx->file_size, 0));
@@ -465,6 +1109,10 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     }
   }
 
+  /* Keep snap len of existing index unless given anew with -P */
+  if ( exists && ! snaplen && ! force )
+    snaplen = idx->snaplen;
+
   /* Report status */
   if (verbose) {
     if (idx->status == INDEX_STATUS_ABSENT) {
@@ -500,6 +1148,20 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
 
   idx->snaplen = snaplen;
 
+  /* Records are as given, else as in the index.  Rebuild an index of other records */
+  if ( rec && exists && ! force && ! _records_equal(rec, &idx->rec) ) {
+    if ( ! quiet ) {
+      sprintf(buf, "Index \"%s\" on \"%s\" was made with other records (-X/-J), rebuilding it", index_filename, filename);
+      _error(buf);
+    }
+    _reset_entries(idx);
+    idx->status = INDEX_STATUS_INVALID;
+  }
+  if ( rec ) {
+    records_free(&idx->rec);
+    records_copy(&idx->rec, rec);
+  }
+
   /* Reset entries if force-rebuild */
   if ( force ) {
     _reset_entries(idx);
@@ -513,12 +1175,16 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     return true;
 
   /* Write new or appended entries */
+  struct timespec scan_t0, scan_t1;
+  clock_gettime(CLOCK_MONOTONIC, &scan_t0);
   FILE * src_fp = fopen(filename, "rb");
   if ( ! src_fp ) {
     sprintf(buf, "ERROR: Cannot read data file \"%s\":", filename);
     _error(buf);
     return _error(strerror(errno));
   }
+  if ( _build_throttle_bytes > 0 )
+    setvbuf(src_fp, 0, _IOFBF, THROTTLE_READ_SIZE);
 
   long long line_start = 0;
   long long chunk_bytes_read = 0;
@@ -538,7 +1204,7 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     }
 
     long linelen = 0;
-    _read_line(src_fp, snaplen, frag, &linelen);
+    _skip_line(src_fp, &idx->rec, snaplen, frag, &linelen);
     line_start = last_pos + linelen;
     chunk_bytes_read = linelen;
     if ( linelen )
@@ -550,6 +1216,13 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
   long long tot_bytes_to_read = idx->file_size - line_start;
   long long last_report_bytes = 0;
   unsigned char * last_line = 0;
+  struct cache_cursor cc;
+  cache_cursor_init(&cc, fileno(src_fp), line_start, idx->file_size, _build_drop_cache);
+  struct throttle th;
+  throttle_init(&th, line_start);
+  struct record_block blk = { fileno(src_fp), 0, 0, 0, line_start };
+  if ( idx->rec.delim != '\n' )
+    blk.buf = malloc(LINE_BLOCK_SIZE);
 
   while ( true ) {
     if ( chunk_bytes_read && (chunk_bytes_read >= chunk_size) ) {
@@ -558,7 +1231,10 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     }
     frag = snaplen ? malloc((snaplen + 1) * sizeof *frag) : 0;
     long nread = 0;
-    _read_line(src_fp, snaplen, frag, &nread);
+    if ( blk.buf )
+      _skip_block_record(&blk, &idx->rec, snaplen, frag, &nread);
+    else
+      _skip_line(src_fp, &idx->rec, snaplen, frag, &nread);
     if ( ! nread )
       break;
     if ( snaplen && last_line ) {
@@ -568,7 +1244,9 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
       if ( strcmp(frag, last_line) < 0 ) {
         sprintf(buf, "ERROR: -P/--snaplen = %ld given and have unordered data in \"%s\"\nFirst %ld chars of line %lld:\n%s\nis less than that in previous line:\n%s\n",
                 snaplen, filename, snaplen, lineno+1, frag, last_line);
-        _error(buf);
+        _error_as(HINDEX_ERR_UNORDERED, buf);
+        cache_cursor_finish(&cc);
+        free(blk.buf);
         fclose(src_fp);
         return false;
       }
@@ -585,6 +1263,10 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     last_report_bytes += bytes_read;
     line_start = next_line_start;
     lineno += 1;
+    if ( line_start >= cc.due )
+      cache_cursor_advance(&cc, line_start);
+    if ( line_start >= th.due )
+      throttle_advance(&th, line_start);
     if ( ! quiet && last_report_bytes >= INDEX_PROGRESS_INTERVAL ) {
       strcpy(bytes_disp, _out_size(tot_bytes_read, 0));
       strcpy(last_bytes_disp, _out_size(tot_bytes_to_read, 0));
@@ -594,8 +1276,14 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
       last_report_bytes = 0;
     }
   }
+  cache_cursor_finish(&cc);
+  free(blk.buf);
   fclose(src_fp);
   src_fp = 0;
+  if ( verbose && th.bytes_per_sec > 0 ) {
+    sprintf(buf, "Throttled indexing of \"%s\" slept %.1f seconds, ending at %.0f%% of the -W rates", filename, th.slept, 100 * th.scale);
+    _error(buf);
+  }
 
   /* Add terminating entry: file size and total line count.
      Don't write if we hit EOF exactly on a chunk boundary.  This will
@@ -618,7 +1306,7 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     strcpy(bytes_disp, _out_size(idx->file_size, 0));
     strcpy(last_bytes_disp, _out_size(line_start, 0));
     sprintf(buf, "ERROR: File \"%s\" was originally %s bytes but shrank to %s while indexing it", filename, bytes_disp, last_bytes_disp);
-    return _error(buf);
+    return _error_as(HINDEX_ERR_CHANGED, buf);
   }
   if ( line_start > idx->file_size ) {
     if ( verbose ) {
@@ -632,25 +1320,8 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
   idx->file_size = line_start;
 
   /* Write out file all at once */
-  FILE * idx_fp = fopen(index_filename, "wb");
-  if ( ! idx_fp ) {
-    sprintf(buf, "ERROR: Cannot write index file \"%s\":", index_filename);
-    _error(buf);
-    return _error(strerror(errno));
-  }
-
-  /* Write two-line header: filename then (mtime, size, lines, chunk_size, snaplen, nentry) */
-  fprintf(idx_fp, "%s\n%.6Lf %lld %lld %ld %ld %d\n", filename, idx->file_mtime, idx->file_size, lineno, chunk_size, snaplen, idx->nentry);
-
-  /* Write entries */
-  int i;
-  for ( i = 0; i < idx->nentry; i++ ) {
-    struct entry ent = idx->entries[i];
-    fprintf(idx_fp, "%lld %lld", ent.filepos, ent.lineno);
-    if ( ent.frag )
-      fprintf(idx_fp, " %s", ent.frag);
-    fprintf(idx_fp, "\n");
-  }
+  if ( ! _write_index(idx, idx->file_size, lineno, chunk_size) )
+    return false;
 
   if ( verbose ) {
     char * action = idx->status == INDEX_STATUS_STALE ? "updated" : "created";
@@ -660,157 +1331,3708 @@ bool index_file(struct hindex * idx, char * filename, char * index_filename, lon
     _error(buf);
   }
 
-  fclose(idx_fp);
-
   /* Update index fields fields */
   _get_file_size_mtime(index_filename, &idx->index_file_size,  &idx->index_mtime);
   idx->status = INDEX_STATUS_FRESH;
+  clock_gettime(CLOCK_MONOTONIC, &scan_t1);
+  idx->build_secs = _ts_secs(&scan_t0, &scan_t1);
+  idx->build_bytes = tot_bytes_read;
 
   return true;
 }
 
-/* Search the file for lines */
-bool search_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, bool line_number, bool verbose) {
+/* Start of the record ending at end, reading back from it in growing blocks */
+long long _verify_line_start(int fd, int delim, long long end, unsigned char * block) {
+  long long off = end - 1;   /* Skip the record's own delimiter */
+  long size = 4096;
+  while ( off > 0 ) {
+    long n = off < size ? off : size;
+    if ( pread(fd, block, n, off - n) != n )
+      return -1;
+    STATS_ADD(bytes_read, n);
+    unsigned char * nl = memrchr(block, delim, n);
+    if ( nl )
+      return off - n + (nl - block) + 1;
+    off -= n;
+    if ( size < VERIFY_BLOCK_SIZE )
+      size *= 2;
+  }
+  return 0;
+}
 
-  char buf[BUFSIZE], buf2[BUFSIZE], buf3[BUFSIZE];
+/* Check entry j of a verify job: count newlines since the previous
+   entry checked, find the line start at or after its offset and the
+   fragment of the line ending there */
+bool _verify_entry(struct verify_job * job, int j, unsigned char * block, unsigned char * frag) {
+  struct hindex * idx = job->idx;
+  struct verify_entry * ve = job->ents + j;
+  struct entry * ent = idx->entries + ve->index;
+  bool last = j == job->nent - 1;
+  long long pos = ent->filepos;
+  long long off = j ? idx->entries[job->ents[j-1].index].filepos : 0;
+  int delim = idx->rec.delim;
+  unsigned char before = delim;
 
-  /* Handle zero count case */
-  if ( count == 0 )
-    return true;
+  /* Delimiters in [previous offset, offset), noting the byte before offset */
+  while ( off < pos ) {
+    ssize_t n = pread(job->src_fd, block, pos - off < VERIFY_BLOCK_SIZE ? pos - off : VERIFY_BLOCK_SIZE, off);
+    if ( n <= 0 )
+      return false;
+    STATS_ADD(bytes_read, n);
+    unsigned char * p = block, * e = block + n;
+    while ( (p = memchr(p, delim, e - p)) ) {
+      ve->newlines++;
+      p++;
+    }
+    before = block[n-1];
+    off += n;
+  }
 
-  /* Check non-overlapping ranges */
-  if ( start > 0 && end > 0 && start > end )
-    return true;
-  if ( greater_than && less_than && strcmp(greater_than, less_than) > 0 )
-    return true;
+  /* Offset should follow a delimiter, but last may end a partial last record */
+  ve->fixed = pos;
+  if ( before != delim && last )
+    ve->extra = 1;
+  else if ( before != delim ) {
+    ve->fixed = job->size;
+    for ( off = pos; off < job->size; ) {
+      ssize_t n = pread(job->src_fd, block, job->size - off < VERIFY_BLOCK_SIZE ? job->size - off : VERIFY_BLOCK_SIZE, off);
+      if ( n <= 0 )
+        return false;
+      STATS_ADD(bytes_read, n);
+      unsigned char * nl = memchr(block, delim, n);
+      if ( nl ) {
+        ve->fixed = off + (nl - block) + 1;
+        ve->extra = 1;
+        break;
+      }
+      off += n;
+    }
+  }
 
-  /* Check if start is beyond the end of data */
-  if ( start > 0 && start > idx->file_lines && verbose ) {
-    strcpy(buf2, _out_size(start, 0));
-    strcpy(buf3, _out_size(idx->file_lines, 0));
-    sprintf(buf, "Start line %s > %s lines in file \"%s\" ... nothing will be output", buf2, buf3, idx->filename_full);
-    _error(buf);
+  /* Fragment is the leading part of the record ending at the entry, as
+     captured by _skip_line(), and the last entry may have none */
+  if ( idx->snaplen && ve->fixed > 0 && (ent->frag || ! last) ) {
+    long long start = _verify_line_start(job->src_fd, delim, ve->fixed, block);
+    if ( start < 0 )
+      return false;
+    long len = ve->fixed - start < idx->snaplen ? ve->fixed - start : idx->snaplen;
+    if ( pread(job->src_fd, frag, len, start) != len )
+      return false;
+    STATS_ADD(bytes_read, len);
+    if ( len && frag[len-1] == delim )
+      len--;
+    unsigned char * nl = memchr(frag, '\n', len);
+    frag[nl ? nl - frag : len] = '\0';
+    if ( ! ent->frag || strcmp(ent->frag, frag) )
+      ve->frag = strdup(frag);
   }
+  return true;
+}
 
-  /* Starting offset and current line */
-  long long line_start = 0;
-  long long lineno = 0;
+/* Thread verifying batches of entries until none are left */
+void * _verify_worker(void * arg) {
+  struct verify_job * job = arg;
+  char buf[BUFSIZE];
+  unsigned char * block = malloc(VERIFY_BLOCK_SIZE);
+  unsigned char * frag = malloc(job->idx->snaplen + 1);
+  while ( true ) {
+    pthread_mutex_lock(&job->lock);
+    int k = job->failed ? job->nent : job->next;
+    job->next = k + VERIFY_BATCH;
+    pthread_mutex_unlock(&job->lock);
+    if ( k >= job->nent )
+      break;
 
-  /* Seek to offset of start line number */
-  if ( start > 0 ) {
-    int i;
-    for ( i=0; i < idx->nentry; i++ ) {
-      struct entry ent = idx->entries[i];
-      if ( start <= ent.lineno )
+    int j, kend = _min_of(k + VERIFY_BATCH, job->nent);
+    for ( j = k; j < kend; j++ ) {
+      errno = 0;
+      if ( ! _verify_entry(job, j, block, frag) ) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = true;
+        snprintf(buf, BUFSIZE, "ERROR: Cannot read data file \"%s\" verifying entry %d: %s", job->idx->filename_full,
+                 job->ents[j].index + 1, errno ? strerror(errno) : "file shrank");
+        _error(buf);
+        pthread_mutex_unlock(&job->lock);
         break;
-      line_start = ent.filepos;
-      lineno = ent.lineno;
+      }
     }
   }
+  free(block);
+  free(frag);
+  return 0;
+}
 
-  /* Seek to offset of start of content range */
-  if ( greater_than ) {
-    int ngreater = strlen(greater_than);
-    int i;
+/* Verify entries of index against its data file with nthread threads:
+   each should be at a line start, with the number of lines before it
+   and the fragment of the line before it.  Entries out of order are
+   dropped.  Bad entries are reported and with repair fixed, rewriting
+   the index with its modification time kept for freshness checks.
+   Returns false if any are bad and not repaired.
+*/
+bool verify_index(struct hindex * idx, int nthread, bool repair, bool dryrun, bool quiet, bool verbose) {
+  char buf[BUFSIZE], what[BUFSIZE];
+
+  if ( idx->status == INDEX_STATUS_ABSENT || idx->status == INDEX_STATUS_INVALID ) {
+    sprintf(buf, "ERROR: Cannot verify index \"%s\" on \"%s\": %s ... build it with -f", idx->index_filename, idx->filename_full, INDEX_STATUS_NAME[idx->status]);
+    return _error(buf);
+  }
+  if ( idx->rec.start ) {
+    sprintf(buf, "ERROR: Cannot verify index \"%s\" on \"%s\", its records begin at lines matching -J \"%s\"", idx->index_filename, idx->filename_full, idx->rec.start);
+    return _error(buf);
+  }
+  /* Verify what an out of date index has, up to the size it was made on */
+  if ( idx->status == INDEX_STATUS_STALE )
+    _append_index_entry(idx, idx->last_file_size, idx->last_file_lines, 0);
+  long long size = idx->entries[idx->nentry-1].filepos;
+  struct stat statinfo;
+  if ( stat(idx->index_filename, &statinfo) ) {
+    sprintf(buf, "ERROR: Cannot stat index file \"%s\":", idx->index_filename);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Keep entries in order, dropping any out of order with neighbours */
+  struct verify_entry * ents = calloc(idx->nentry, sizeof *ents);
+  int nent = 0, i, j;
+  long long prev = 0;
+  for ( i = 0; i < idx->nentry; i++ ) {
+    long long pos = idx->entries[i].filepos;
+    bool last = i == idx->nentry - 1;
+    long long next = last ? size : idx->entries[i+1].filepos;
+    if ( last || (pos > prev && pos < size && (pos < next || next <= prev)) ) {
+      ents[nent++].index = i;
+      prev = pos;
+    }
+    else if ( verbose || i - nent < VERIFY_REPORT_MAX ) {
+      sprintf(buf, "Entry %d of index \"%s\": offset %lld out of order", i + 1, idx->index_filename, pos);
+      _error(buf);
+    }
+  }
+  int ndrop = idx->nentry - nent;
+
+  /* Check entries in parallel */
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  struct verify_job job = { idx, -1, size, ents, nent, 0, false };
+  pthread_mutex_init(&job.lock, 0);
+  job.src_fd = open(idx->filename_full, O_RDONLY);
+  bool success = job.src_fd >= 0;
+  if ( ! success ) {
+    sprintf(buf, "ERROR: Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    _error(strerror(errno));
+  }
+  else {
+    posix_fadvise(job.src_fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    if ( nthread > (nent + VERIFY_BATCH - 1) / VERIFY_BATCH )
+      nthread = (nent + VERIFY_BATCH - 1) / VERIFY_BATCH;
+    pthread_t * threads = malloc(nthread * sizeof *threads);
+    int t;
+    for ( t = 0; t < nthread; t++ )
+      pthread_create(threads + t, 0, _verify_worker, &job);
+    for ( t = 0; t < nthread; t++ )
+      pthread_join(threads[t], 0);
+    free(threads);
+    close(job.src_fd);
+    success = ! job.failed;
+  }
+  pthread_mutex_destroy(&job.lock);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  /* Line numbers from newline counts, and report bad entries */
+  int nbad = 0, nbad_pos = 0, nbad_lines = 0, nbad_frag = 0;
+  long long lines = 0;
+  for ( j = 0; j < nent && success; j++ ) {
+    struct verify_entry * ve = ents + j;
+    struct entry * ent = idx->entries + ve->index;
+    lines += ve->newlines;
+    ve->lineno = lines + ve->extra;
+    bool bad_pos = ve->fixed != ent->filepos;
+    bool bad_lines = ve->lineno != ent->lineno;
+    if ( ! bad_pos && ! bad_lines && ! ve->frag )
+      continue;
+    nbad++;
+    nbad_pos += bad_pos;
+    nbad_lines += bad_lines;
+    nbad_frag += ve->frag != 0;
+    if ( ! verbose && nbad + ndrop > VERIFY_REPORT_MAX )
+      continue;
+    what[0] = '\0';
+    if ( bad_pos )
+      sprintf(what + strlen(what), ", not at a line start");
+    if ( bad_lines )
+      sprintf(what + strlen(what), ", line number off by %+lld", ent->lineno - ve->lineno);
+    if ( ve->frag )
+      snprintf(what + strlen(what), BUFSIZE / 2, ", fragment \"%s\" should be \"%s\"", ent->frag ? (char *) ent->frag : "", ve->frag);
+    snprintf(buf, BUFSIZE, "Entry %d of index \"%s\": offset %lld line %lld%s; should be offset %lld line %lld",
+             ve->index + 1, idx->index_filename, ent->filepos, ent->lineno, what, ve->fixed, ve->lineno);
+    _error(buf);
+  }
+  if ( success && (! quiet || nbad || ndrop) ) {
+    char * status = idx->status == INDEX_STATUS_STALE ? " (out of date)" : "";
+    sprintf(buf, "Verified %d entries of index \"%s\"%s on \"%s\" %s bytes with %d threads in %.2f seconds: %d bad (%d offset, %d line number, %d fragment), %d out of order",
+            idx->nentry, idx->index_filename, status, idx->filename_full, _out_size(size, 0), nthread, _ts_secs(&t0, &t1), nbad, nbad_pos, nbad_lines, nbad_frag, ndrop);
+    _error(buf);
+  }
+
+  /* Rewrite index with entries fixed, dropping those that became duplicates */
+  bool repaired = ! nbad && ! ndrop;
+  if ( success && ! repaired && repair && dryrun ) {
+    sprintf(buf, "Would repair index \"%s\" with %d bad and %d out of order entries", idx->index_filename, nbad, ndrop);
+    _error(buf);
+  }
+  else if ( success && ! repaired && repair ) {
+    struct entry * fixed = malloc(nent * sizeof *fixed);
+    int nfixed = 0;
+    for ( j = 0; j < nent; j++ ) {
+      struct verify_entry * ve = ents + j;
+      struct entry * ent = idx->entries + ve->index;
+      bool last = j == nent - 1;
+      if ( ve->frag ) {
+        free(ent->frag);
+        ent->frag = ve->frag;
+        ve->frag = 0;
+      }
+      if ( ! last && (ve->fixed >= size || (nfixed && ve->fixed <= fixed[nfixed-1].filepos)) ) {
+        reset_entry(ent);
+        continue;
+      }
+      fixed[nfixed++] = (struct entry) { ve->fixed, ve->lineno, ent->frag };
+      ent->frag = 0;
+    }
+    _reset_entries(idx);
+    idx->entries = fixed;
+    idx->nentry = idx->maxentry = nfixed;
+
+    struct timespec times[2] = { { 0, UTIME_OMIT }, statinfo.st_mtim };
+    repaired = _write_index(idx, size, fixed[nfixed-1].lineno, idx->chunk_size);
+    if ( repaired && utimensat(AT_FDCWD, idx->index_filename, times, 0) ) {
+      sprintf(buf, "ERROR: Cannot keep modification time of index file \"%s\":", idx->index_filename);
+      _error(buf);
+      repaired = _error(strerror(errno));
+    }
+    if ( repaired && ! quiet ) {
+      sprintf(buf, "Repaired index \"%s\" on \"%s\", now %d entries", idx->index_filename, idx->filename_full, nfixed);
+      _error(buf);
+    }
+  }
+  else if ( success && ! repaired && ! quiet ) {
+    sprintf(buf, "Repair index \"%s\" with -A, or rebuild it with -f", idx->index_filename);
+    _error(buf);
+  }
+
+  for ( j = 0; j < nent; j++ )
+    free(ents[j].frag);
+  free(ents);
+  return success && repaired;
+}
+
+/* Order store entries for eviction: data file gone first, then by
+   descending score (cold and cheap to rebuild) */
+int _cmp_store_evict(const void * a, const void * b) {
+  const struct store_entry * ea = a, * eb = b;
+  if ( ea->data_gone != eb->data_gone )
+    return ea->data_gone ? -1 : 1;
+  return ea->score > eb->score ? -1 : ea->score < eb->score;
+}
+
+/* Find entry for index file name in store, or -1 */
+int _store_find(struct store_entry * ents, int nent, char * name) {
+  int i;
+  for ( i = 0; i < nent; i++ )
+    if ( ! strcmp(ents[i].name, name) )
+      return i;
+  return -1;
+}
+
+/* Update the manifest of the index store in index_dir with the indexes
+   used by this run (touched, whose build_secs are measured, or 0 to
+   keep the recorded cost) and any later use stamped by store_touch(),
+   add indexes found in the directory but not in the manifest, and
+   forget those gone.  Then if budget >= 0 and the indexes total more
+   bytes, delete indexes other than those touched until they fit.  The
+   manifest is locked throughout.
+*/
+bool store_update(char * index_dir, struct store_entry * touched, int ntouched, long long budget, bool dryrun, bool quiet, bool verbose) {
+  char buf[BUFSIZE], path[BUFSIZE], line[BUFSIZE];
+  snprintf(path, BUFSIZE, "%s/%s", index_dir, STORE_MANIFEST);
+  int fd = open(path, dryrun ? O_RDONLY : O_RDWR | O_CREAT, 0666);
+  if ( fd < 0 && dryrun && errno == ENOENT )
+    fd = open("/dev/null", O_RDONLY);
+  if ( fd < 0 || flock(fd, dryrun ? LOCK_SH : LOCK_EX) ) {
+    /* Only recording use, which is best effort, e.g., in a shared /tmp */
+    if ( budget < 0 && ! verbose ) {
+      if ( fd >= 0 )
+        close(fd);
+      return true;
+    }
+    sprintf(buf, "Cannot lock index store manifest \"%s\":", path);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Read manifest: "<index name> <last access> <build secs> <data file>" */
+  int nent = 0, maxent = 64, i;
+  struct store_entry * ents = malloc(maxent * sizeof *ents);
+  FILE * fp = fdopen(dup(fd), "r");
+  while ( fp && fgets(line, BUFSIZE, fp) ) {
+    char name[BUFSIZE];
+    double last_access, build_secs;
+    int ndata = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if ( sscanf(line, "%s %lf %lf %n", name, &last_access, &build_secs, &ndata) < 3 || ! ndata )
+      continue;
+    if ( nent == maxent )
+      ents = realloc(ents, (maxent *= 2) * sizeof *ents);
+    ents[nent++] = (struct store_entry) { strdup(name), strdup(line + ndata), last_access, build_secs };
+  }
+  if ( fp )
+    fclose(fp);
+
+  /* Record this run's indexes */
+  for ( i = 0; i < ntouched; i++ ) {
+    struct store_entry * t = touched + i;
+    int k = _store_find(ents, nent, t->name);
+    if ( k < 0 ) {
+      if ( nent == maxent )
+        ents = realloc(ents, (maxent *= 2) * sizeof *ents);
+      k = nent++;
+      ents[k] = (struct store_entry) { strdup(t->name), strdup(t->data), 0, 0 };
+    }
+    ents[k].last_access = t->last_access;
+    if ( t->build_secs > 0 )
+      ents[k].build_secs = t->build_secs;
+    ents[k].keep = true;
+  }
+
+  /* Adopt indexes not in the manifest, estimating their build cost from
+     the data size in their header, as of when they were last written */
+  DIR * dir = opendir(index_dir);
+  struct dirent * de;
+  while ( dir && (de = readdir(dir)) ) {
+    char * name = de->d_name;
+    int nname = strlen(name), nsuffix = strlen(INDEX_SUFFIX);
+    if ( nname <= nsuffix || strcmp(name + nname - nsuffix, INDEX_SUFFIX) || _store_find(ents, nent, name) >= 0 )
+      continue;
+    if ( strncmp(name, INDEX_HASH_PREFIX, strlen(INDEX_HASH_PREFIX)) && (name[0] != '.' || strncmp(name + 1, INDEX_HASH_PREFIX, strlen(INDEX_HASH_PREFIX))) )
+      continue;
+    snprintf(path, BUFSIZE, "%s/%s", index_dir, name);
+    struct stat st;
+    FILE * ifp = fopen(path, "r");
+    if ( ! ifp || fstat(fileno(ifp), &st) ) {
+      if ( ifp )
+        fclose(ifp);
+      continue;
+    }
+    char data[BUFSIZE] = "";
+    long double mtime = 0;
+    long long size = 0;
+    if ( fgets(data, BUFSIZE, ifp) && fgets(line, BUFSIZE, ifp) )
+      sscanf(line, "%Lf %lld", &mtime, &size);
+    fclose(ifp);
+    data[strcspn(data, "\n")] = '\0';
+    if ( nent == maxent )
+      ents = realloc(ents, (maxent *= 2) * sizeof *ents);
+    ents[nent++] = (struct store_entry) { strdup(name), strdup(data), st.st_mtime, size / STORE_BUILD_RATE };
+  }
+  if ( dir )
+    closedir(dir);
+
+  /* Size up indexes, forgetting those gone */
+  double now = time(0);
+  long long total = 0;
+  int n = 0;
+  for ( i = 0; i < nent; i++ ) {
+    struct stat st;
+    snprintf(path, BUFSIZE, "%s/%s", index_dir, ents[i].name);
+    if ( stat(path, &st) ) {
+      free(ents[i].name);
+      free(ents[i].data);
+      continue;
+    }
+    ents[i].size = st.st_size;
+    if ( st.st_atime > ents[i].last_access )
+      ents[i].last_access = st.st_atime;
+    strcat(path, OFFSET_CACHE_SUFFIX);
+    if ( ! stat(path, &st) )
+      ents[i].size += st.st_size;
+    ents[i].data_gone = access(ents[i].data, F_OK) != 0;
+    ents[i].score = (now - ents[i].last_access) / (ents[i].build_secs + 1);
+    total += ents[i].size;
+    ents[n++] = ents[i];
+  }
+  nent = n;
+
+  /* Evict down to the budget */
+  if ( budget >= 0 && total > budget ) {
+    qsort(ents, nent, sizeof *ents, _cmp_store_evict);
+    for ( i = 0, n = 0; i < nent; i++ ) {
+      if ( total > budget && ! ents[i].keep ) {
+        snprintf(path, BUFSIZE, "%s/%s", index_dir, ents[i].name);
+        if ( dryrun || ! unlink(path) ) {
+          if ( ! dryrun ) {
+            snprintf(line, BUFSIZE, "%s%s", path, OFFSET_CACHE_SUFFIX);
+            unlink(line);
+          }
+          total -= ents[i].size;
+          if ( verbose || (dryrun && ! quiet) ) {
+            sprintf(buf, "%s index \"%s\" on \"%s\" (%s bytes, %s, built in %.1f seconds, last used %.0f seconds ago)",
+                    dryrun ? "Would evict" : "Evicted", path, ents[i].data, _out_size(ents[i].size, 0),
+                    ents[i].data_gone ? "data gone" : "data present", ents[i].build_secs, now - ents[i].last_access);
+            _error(buf);
+          }
+          if ( ! dryrun ) {
+            free(ents[i].name);
+            free(ents[i].data);
+            continue;
+          }
+        }
+      }
+      ents[n++] = ents[i];
+    }
+    nent = n;
+    if ( total > budget && ! quiet ) {
+      sprintf(buf, "Warning: indexes in use total %s bytes, over the budget of -K %lld", _out_size(total, 0), budget);
+      _error(buf);
+    }
+  }
+
+  /* Rewrite manifest in place */
+  bool success = true;
+  if ( ! dryrun ) {
+    fp = fdopen(dup(fd), "w");
+    if ( fp && ! ftruncate(fd, 0) && ! lseek(fd, 0, SEEK_SET) ) {
+      for ( i = 0; i < nent; i++ )
+        fprintf(fp, "%s %.0f %.3f %s\n", ents[i].name, ents[i].last_access, ents[i].build_secs, ents[i].data);
+    }
+    if ( ! fp || fclose(fp) ) {
+      sprintf(buf, "Cannot write index store manifest \"%s/%s\":", index_dir, STORE_MANIFEST);
+      _error(buf);
+      success = _error(strerror(errno));
+    }
+  }
+  for ( i = 0; i < nent; i++ ) {
+    free(ents[i].name);
+    free(ents[i].data);
+  }
+  free(ents);
+  close(fd);
+  return success;
+}
+
+/* Record use of the indexes of the store in index_dir used by this run
+   (touched) without building any, as the access time of each index
+   file, leaving its modification time.  Unlike store_update() this
+   takes no lock and reads no manifest, so searches cost the same
+   however large the store; the next update folds the times in.  Best
+   effort, as for recording use there */
+void store_touch(char * index_dir, struct store_entry * touched, int ntouched, bool verbose) {
+  char buf[BUFSIZE], path[BUFSIZE];
+  struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+  int i;
+  for ( i = 0; i < ntouched; i++ ) {
+    snprintf(path, BUFSIZE, "%s/%s", index_dir, touched[i].name);
+    if ( utimensat(AT_FDCWD, path, times, 0) && verbose ) {
+      sprintf(buf, "Warning: cannot record use of index \"%s\": %s", path, strerror(errno));
+      _error(buf);
+    }
+  }
+}
+
+/* Name of the offset cache file of an index */
+void _offset_cache_name(struct hindex * idx, char * path) {
+  snprintf(path, BUFSIZE, "%s%s", idx->index_filename, OFFSET_CACHE_SUFFIX);
+}
+
+/* Stamp of the indexed data and the index itself offsets cached for
+   them are valid for: a change of either, or of records, changes it */
+void _offset_cache_stamp(struct hindex * idx, char * stamp) {
+  snprintf(stamp, BUFSIZE, "%.6Lf %lld %lld %.6Lf %lld %ld %d %d%s%s", idx->file_mtime, idx->file_size, idx->file_lines,
+           idx->index_mtime, idx->index_file_size, idx->chunk_size, idx->nentry, idx->rec.delim,
+           idx->rec.start ? " " : "", idx->rec.start ? idx->rec.start : "");
+}
+
+/* Attach offset cache to fresh index, with the hits saved for it as it
+   is now, if any */
+void offset_cache_load(struct hindex * idx) {
+  char path[BUFSIZE], stamp[BUFSIZE], line[BUFSIZE];
+  if ( idx->status != INDEX_STATUS_FRESH || idx->oc )
+    return;
+  struct offset_cache * oc = idx->oc = calloc(1, sizeof *oc);
+  _offset_cache_name(idx, path);
+  FILE * fp = fopen(path, "r");
+  if ( ! fp )
+    return;
+  _offset_cache_stamp(idx, stamp);
+  bool valid = false;
+  if ( fgets(line, BUFSIZE, fp) ) {
+    line[strcspn(line, "\n")] = '\0';
+    valid = ! strcmp(line, stamp);
+  }
+  while ( valid && oc->n < OFFSET_CACHE_MAX && fgets(line, BUFSIZE, fp) ) {
+    char kind;
+    long long lineno, filepos;
+    int nkey = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if ( sscanf(line, "%c %lld %lld%n", &kind, &lineno, &filepos, &nkey) < 3 || ! kind || ! strchr("SGL", kind) )
+      continue;
+    if ( kind != 'S' && line[nkey] != ' ' )
+      continue;
+    oc->hits[oc->n++] = (struct offset_hit) { kind, lineno, filepos, kind == 'S' ? 0 : (unsigned char *) strdup(line + nkey + 1) };
+  }
+  fclose(fp);
+}
+
+/* Find cached hit of kind for 1-origin line number lineno (S) or key
+   (G, L), or 0 if none */
+struct offset_hit * _offset_cached(struct hindex * idx, char kind, long long lineno, unsigned char * key) {
+  struct offset_cache * oc = idx->oc;
+  int i;
+  for ( i = 0; oc && i < oc->n; i++ ) {
+    struct offset_hit * h = oc->hits + i;
+    if ( h->kind != kind || (key ? strcmp(h->key, key) : h->lineno != lineno) )
+      continue;
+    if ( i < OFFSET_CACHE_MAX / 2 )
+      return h;
+    /* Keep hits in use from being dropped */
+    struct offset_hit hit = *h;
+    memmove(oc->hits + 1, oc->hits, i * sizeof *oc->hits);
+    oc->hits[0] = hit;
+    oc->dirty = true;
+    return oc->hits;
+  }
+  return 0;
+}
+
+/* Add hit of kind to the offset cache of the index, if attached */
+void _offset_cache_add(struct hindex * idx, char kind, long long lineno, long long filepos, unsigned char * key) {
+  struct offset_cache * oc = idx->oc;
+  if ( ! oc || (key && (strchr(key, '\n') || strlen(key) > BUFSIZE / 2)) || _offset_cached(idx, kind, lineno, key) )
+    return;
+  if ( oc->n == OFFSET_CACHE_MAX )
+    free(oc->hits[--oc->n].key);
+  memmove(oc->hits + 1, oc->hits, oc->n * sizeof *oc->hits);
+  oc->hits[0] = (struct offset_hit) { kind, lineno, filepos, key ? (unsigned char *) strdup(key) : 0 };
+  oc->n++;
+  oc->dirty = true;
+}
+
+/* Note where a search range starts, found by reading past lines: at
+   line lineno, offset pos */
+void _offset_cache_start(struct hindex * idx, long long start, unsigned char * greater_than, long long lineno, long long pos) {
+  if ( start > 0 && lineno == start )
+    _offset_cache_add(idx, 'S', lineno, pos, 0);
+  else if ( start <= 0 && greater_than )
+    _offset_cache_add(idx, 'G', lineno, pos, greater_than);
+}
+
+/* Save the offset cache of the index if changed, replacing the file
+   whole so readers never see part of it, and detach it.  Saving is
+   best effort: the cache only saves reading */
+void offset_cache_save(struct hindex * idx, bool verbose) {
+  char buf[BUFSIZE], path[BUFSIZE], tmp[BUFSIZE], stamp[BUFSIZE];
+  struct offset_cache * oc = idx->oc;
+  if ( ! oc )
+    return;
+  int i;
+  if ( oc->dirty ) {
+    _offset_cache_name(idx, path);
+    snprintf(tmp, BUFSIZE, "%s.%d", path, (int) getpid());
+    _offset_cache_stamp(idx, stamp);
+    FILE * fp = fopen(tmp, "w");
+    if ( fp ) {
+      fprintf(fp, "%s\n", stamp);
+      for ( i = 0; i < oc->n; i++ ) {
+        struct offset_hit * h = oc->hits + i;
+        fprintf(fp, "%c %lld %lld%s%s\n", h->kind, h->lineno, h->filepos, h->key ? " " : "", h->key ? (char *) h->key : "");
+      }
+    }
+    if ( ! fp || fclose(fp) || rename(tmp, path) ) {
+      if ( verbose ) {
+        sprintf(buf, "Warning: cannot save offset cache \"%s\": %s", path, strerror(errno));
+        _error(buf);
+      }
+      if ( fp )
+        unlink(tmp);
+    }
+  }
+  for ( i = 0; i < oc->n; i++ )
+    free(oc->hits[i].key);
+  free(oc);
+  idx->oc = 0;
+}
+
+/* Find offset and line number of the last index entry at or before
+   the start of the search range given by start line number or minimum
+   content value.  Stores (0, 0) if no entry precedes the range.
+*/
+bool _find_start_entry(struct hindex * idx, long long start, unsigned char * greater_than, long long * line_start_p, long long * lineno_p) {
+  char buf[BUFSIZE];
+  long long line_start = 0;
+  long long lineno = 0;
+
+  /* Seek to offset of start line number */
+  if ( start > 0 ) {
+    int i;
+    for ( i=0; i < idx->nentry; i++ ) {
+      struct entry ent = idx->entries[i];
+      if ( start <= ent.lineno )
+        break;
+      line_start = ent.filepos;
+      lineno = ent.lineno;
+    }
+  }
+
+  /* Seek to offset of start of content range */
+  if ( greater_than ) {
+    int ngreater = strlen(greater_than);
+    int i;
     for ( i=0; i < idx->nentry; i++ ) {
       struct entry ent = idx->entries[i];
       if ( i < (idx->nentry - 1) && ! ent.frag ) {
         sprintf(buf, "ERROR: -G/--greater-than given, but \"%s\" does not appear to have been indexed with -P/--snaplen", idx->index_filename);
-        return _error(buf);
+        return _error_as(HINDEX_ERR_SNAPLEN, buf);
+      }
+      int ncmp = ent.frag ? _min_of(ngreater, strlen(ent.frag)) : ngreater;
+      if ( ! ent.frag || strncmp(greater_than, ent.frag, ncmp) <= 0 )
+        break;
+      line_start = ent.filepos;
+      lineno = ent.lineno;
+    }
+  }
+
+  *line_start_p = line_start;
+  *lineno_p = lineno;
+  return true;
+}
+
+/* Find the first index entry at or after the end of the search range
+   given by end line number or maximum content value, i.e., the
+   offset past which no line can be output.  Stores its offset and
+   line number (the EOF entry if no other bounds the range) and
+   returns its entry number.
+*/
+int _find_end_entry(struct hindex * idx, long long end, unsigned char * less_than, long long * line_end_p, long long * lineno_p) {
+  int nless_than = less_than ? strlen(less_than) : 0;
+  if ( ! idx->nentry ) {
+    *line_end_p = idx->file_size;
+    *lineno_p = idx->file_lines;
+    return 0;
+  }
+  int i;
+  for ( i=0; i < idx->nentry - 1; i++ ) {
+    struct entry ent = idx->entries[i];
+    if ( end > 0 && ent.lineno >= end )
+      break;
+    if ( less_than && ent.frag && strncmp(ent.frag, less_than, nless_than) > 0 )
+      break;
+  }
+  *line_end_p = idx->entries[i].filepos;
+  *lineno_p = idx->entries[i].lineno;
+  return i;
+}
+
+/* Find the last index entry before 1-origin line number lineno, or -1
+   if the line is in the first chunk */
+int _find_line_entry(struct hindex * idx, long long lineno) {
+  int lo = 0, hi = idx->nentry - 1, found = -1;
+  while ( lo <= hi ) {
+    int mid = (lo + hi) / 2;
+    if ( idx->entries[mid].lineno < lineno ) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+  return found;
+}
+
+/* Get 1-origin line numbers of first line >= greater_than and last
+   line <= less_than, reading at most the two chunks where the
+   boundaries fall.  Either may be null for no bound.  If no line is
+   in range, *first_p will be greater than *last_p.  Bytes read are
+   added to *bytes_read_p.
+*/
+bool _content_line_bounds(struct hindex * idx, FILE * src_fp, unsigned char * greater_than, unsigned char * less_than, long long * first_p, long long * last_p, long long * bytes_read_p) {
+  char buf[BUFSIZE];
+  long long line_start = 0, lineno = 0;
+  *first_p = 1;
+  *last_p = idx->file_lines;
+
+  /* Bounds resolved by earlier searches need no reading */
+  struct offset_hit * hit = greater_than ? _offset_cached(idx, 'G', 0, greater_than) : 0;
+  if ( hit )
+    *first_p = hit->lineno;
+  else if ( greater_than ) {
+    if ( ! _find_start_entry(idx, 0, greater_than, &line_start, &lineno) )
+      return false;
+    STATS_ADD(seeks, 1);
+    if ( fseeko(src_fp, line_start, SEEK_SET) ) {
+      sprintf(buf, "Error seeking to position %lld in file \"%s\":", line_start, idx->filename_full);
+      _error(buf);
+      return _error(strerror(errno));
+    }
+    long long pos = line_start, ndiscarded = 0;
+    while ( true ) {
+      long nread = 0;
+      unsigned char * line = _skip_line(src_fp, &idx->rec, strlen(greater_than) + 1, 0, &nread);
+      *bytes_read_p += nread;
+      lineno += 1;
+      if ( ! nread || strcmp(line, greater_than) >= 0 )
+        break;
+      STATS_ADD(lines_discarded, 1);
+      pos += nread;
+      ndiscarded += 1;
+    }
+    if ( ndiscarded )
+      _offset_cache_add(idx, 'G', lineno, pos, greater_than);
+    *first_p = lineno;
+  }
+
+  hit = less_than ? _offset_cached(idx, 'L', 0, less_than) : 0;
+  if ( hit )
+    *last_p = hit->lineno;
+  else if ( less_than ) {
+    int nless_than = strlen(less_than);
+    long long line_end = 0, lineno_end = 0;
+    int ient = _find_end_entry(idx, 0, less_than, &line_end, &lineno_end);
+    line_start = ient > 0 ? idx->entries[ient-1].filepos : 0;
+    lineno = ient > 0 ? idx->entries[ient-1].lineno : 0;
+    STATS_ADD(seeks, 1);
+    if ( fseeko(src_fp, line_start, SEEK_SET) ) {
+      sprintf(buf, "Error seeking to position %lld in file \"%s\":", line_start, idx->filename_full);
+      _error(buf);
+      return _error(strerror(errno));
+    }
+    long long pos = line_start;
+    while ( lineno < lineno_end ) {
+      long nread = 0;
+      unsigned char * line = _skip_line(src_fp, &idx->rec, nless_than, 0, &nread);
+      *bytes_read_p += nread;
+      if ( ! nread || strncmp(line, less_than, nless_than) > 0 )
+        break;
+      pos += nread;
+      lineno += 1;
+    }
+    if ( pos > line_start )
+      _offset_cache_add(idx, 'L', lineno, pos, less_than);
+    *last_p = lineno;
+  }
+  return true;
+}
+
+/* Find the last index entry at or before file offset pos, or -1 if
+   pos is in the first chunk */
+int _find_pos_entry(struct hindex * idx, long long pos) {
+  int lo = 0, hi = idx->nentry - 1, found = -1;
+  while ( lo <= hi ) {
+    int mid = (lo + hi) / 2;
+    if ( idx->entries[mid].filepos <= pos ) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+  return found;
+}
+
+/* Get offset where 1-origin line lineno starts (the file size past
+   the last line), reading forward from the index entry before it */
+bool _line_offset(struct hindex * idx, FILE * src_fp, long long lineno, long long * pos_p) {
+  char buf[BUFSIZE];
+  int ient = _find_line_entry(idx, lineno);
+  long long pos = ient >= 0 ? idx->entries[ient].filepos : 0;
+  long long cur = ient >= 0 ? idx->entries[ient].lineno + 1 : 1;
+  struct offset_hit * hit = cur < lineno ? _offset_cached(idx, 'S', lineno, 0) : 0;
+  if ( hit ) {
+    *pos_p = hit->filepos;
+    return true;
+  }
+  if ( cur < lineno && fseeko(src_fp, pos, SEEK_SET) ) {
+    sprintf(buf, "Error seeking to position %lld in file \"%s\":", pos, idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+  if ( cur < lineno )
+    STATS_ADD(seeks, 1);
+  bool scanned = cur < lineno;
+  while ( cur < lineno ) {
+    long nread = 0;
+    _skip_line(src_fp, &idx->rec, 0, 0, &nread);
+    if ( ! nread )
+      break;
+    STATS_ADD(lines_discarded, 1);
+    pos += nread;
+    cur += 1;
+  }
+  if ( scanned && cur == lineno )
+    _offset_cache_add(idx, 'S', lineno, pos, 0);
+  *pos_p = pos;
+  return true;
+}
+
+/* Get offset and 1-origin number of the first line starting at or
+   after file offset target, reading forward from the index entry
+   before it */
+bool _offset_line(struct hindex * idx, FILE * src_fp, long long target, long long * pos_p, long long * lineno_p) {
+  char buf[BUFSIZE];
+  int ient = _find_pos_entry(idx, target);
+  long long pos = ient >= 0 ? idx->entries[ient].filepos : 0;
+  long long cur = ient >= 0 ? idx->entries[ient].lineno + 1 : 1;
+  if ( pos < target && fseeko(src_fp, pos, SEEK_SET) ) {
+    sprintf(buf, "Error seeking to position %lld in file \"%s\":", pos, idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+  if ( pos < target )
+    STATS_ADD(seeks, 1);
+  while ( pos < target ) {
+    long nread = 0;
+    _skip_line(src_fp, &idx->rec, 0, 0, &nread);
+    if ( ! nread )
+      break;
+    STATS_ADD(lines_discarded, 1);
+    pos += nread;
+    cur += 1;
+  }
+  *pos_p = pos;
+  *lineno_p = cur;
+  return true;
+}
+
+/* Output compression set from -z, applied by _open_output() */
+static int _compress_format = COMPRESS_NONE;
+static int _compress_level = 0;
+static int _compress_threads = 1;
+
+void set_output_compression(int format, int level, int nthread) {
+  _compress_format = format;
+  _compress_level = level;
+  _compress_threads = nthread > 0 ? nthread : 1;
+}
+
+/* Compress one block into an independent gzip member or zstd frame */
+bool _zblock_compress(struct zstream * zs, struct zblock * blk) {
+#ifdef HAVE_ZSTD
+  if ( zs->format == COMPRESS_ZSTD ) {
+    size_t bound = ZSTD_compressBound(blk->nin);
+    if ( blk->maxout < bound ) {
+      blk->out = realloc(blk->out, bound);
+      blk->maxout = bound;
+    }
+    size_t n = ZSTD_compress(blk->out, blk->maxout, blk->in, blk->nin, zs->level);
+    if ( ZSTD_isError(n) )
+      return false;
+    blk->nout = n;
+    return true;
+  }
+#endif
+  z_stream strm;
+  memset(&strm, 0, sizeof strm);
+  if ( deflateInit2(&strm, zs->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+    return false;
+  size_t bound = deflateBound(&strm, blk->nin);
+  if ( blk->maxout < bound ) {
+    blk->out = realloc(blk->out, bound);
+    blk->maxout = bound;
+  }
+  strm.next_in = blk->in;
+  strm.avail_in = blk->nin;
+  strm.next_out = blk->out;
+  strm.avail_out = blk->maxout;
+  int rc = deflate(&strm, Z_FINISH);
+  blk->nout = blk->maxout - strm.avail_out;
+  deflateEnd(&strm);
+  return rc == Z_STREAM_END;
+}
+
+/* Worker thread: compress filled blocks in turn */
+void * _zstream_worker(void * arg) {
+  struct zstream * zs = arg;
+  while ( true ) {
+    pthread_mutex_lock(&zs->lock);
+    while ( zs->seq_claim >= zs->seq_fill && ! zs->done )
+      pthread_cond_wait(&zs->cond, &zs->lock);
+    if ( zs->seq_claim >= zs->seq_fill ) {
+      pthread_mutex_unlock(&zs->lock);
+      return 0;
+    }
+    struct zblock * blk = zs->slots + zs->seq_claim++ % zs->nslot;
+    pthread_mutex_unlock(&zs->lock);
+
+    bool ok = _zblock_compress(zs, blk);
+
+    pthread_mutex_lock(&zs->lock);
+    blk->state = ZBLOCK_COMPRESSED;
+    if ( ! ok )
+      zs->failed = true;
+    pthread_cond_broadcast(&zs->cond);
+    pthread_mutex_unlock(&zs->lock);
+  }
+}
+
+/* Writer thread: write compressed blocks in order and free their slots */
+void * _zstream_writer(void * arg) {
+  struct zstream * zs = arg;
+  while ( true ) {
+    pthread_mutex_lock(&zs->lock);
+    struct zblock * blk = zs->slots + zs->seq_write % zs->nslot;
+    while ( blk->state != ZBLOCK_COMPRESSED && ! (zs->done && zs->seq_write >= zs->seq_fill) )
+      pthread_cond_wait(&zs->cond, &zs->lock);
+    if ( blk->state != ZBLOCK_COMPRESSED ) {
+      pthread_mutex_unlock(&zs->lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&zs->lock);
+
+    size_t off = 0;
+    bool ok = true;
+    while ( ok && off < blk->nout ) {
+      ssize_t n = write(zs->fd, blk->out + off, blk->nout - off);
+      ok = n > 0;
+      off += ok ? n : 0;
+    }
+
+    pthread_mutex_lock(&zs->lock);
+    blk->state = ZBLOCK_FREE;
+    blk->nin = 0;
+    zs->seq_write++;
+    if ( ! ok )
+      zs->failed = true;
+    pthread_cond_broadcast(&zs->cond);
+    pthread_mutex_unlock(&zs->lock);
+  }
+}
+
+/* Hand current block to the workers and wait for the next slot to be free */
+void _zstream_submit(struct zstream * zs) {
+  pthread_mutex_lock(&zs->lock);
+  zs->slots[zs->seq_fill % zs->nslot].state = ZBLOCK_FILLED;
+  zs->seq_fill++;
+  pthread_cond_broadcast(&zs->cond);
+  while ( zs->slots[zs->seq_fill % zs->nslot].state != ZBLOCK_FREE )
+    pthread_cond_wait(&zs->cond, &zs->lock);
+  pthread_mutex_unlock(&zs->lock);
+}
+
+/* fopencookie() write function: fill blocks, submitting full ones */
+ssize_t _zstream_write(void * cookie, const char * data, size_t size) {
+  struct zstream * zs = cookie;
+  size_t done = 0;
+  while ( done < size ) {
+    if ( zs->failed ) {
+      errno = EIO;
+      return done ? done : -1;
+    }
+    struct zblock * blk = zs->slots + zs->seq_fill % zs->nslot;
+    size_t room = COMPRESS_BLOCK_SIZE - blk->nin;
+    size_t n = size - done < room ? size - done : room;
+    memcpy(blk->in + blk->nin, data + done, n);
+    blk->nin += n;
+    done += n;
+    if ( blk->nin == COMPRESS_BLOCK_SIZE )
+      _zstream_submit(zs);
+  }
+  return done;
+}
+
+/* fopencookie() close function: submit last block, drain and clean up */
+int _zstream_close(void * cookie) {
+  struct zstream * zs = cookie;
+  if ( zs->slots[zs->seq_fill % zs->nslot].nin )
+    _zstream_submit(zs);
+  pthread_mutex_lock(&zs->lock);
+  zs->done = true;
+  pthread_cond_broadcast(&zs->cond);
+  pthread_mutex_unlock(&zs->lock);
+  int t;
+  for ( t = 0; t < zs->nthread; t++ )
+    pthread_join(zs->threads[t], 0);
+  pthread_join(zs->writer, 0);
+
+  bool failed = zs->failed;
+  if ( close(zs->fd) )
+    failed = true;
+  for ( t = 0; t < zs->nslot; t++ ) {
+    free(zs->slots[t].in);
+    free(zs->slots[t].out);
+  }
+  free(zs->slots);
+  free(zs->threads);
+  pthread_mutex_destroy(&zs->lock);
+  pthread_cond_destroy(&zs->cond);
+  free(zs);
+  if ( failed ) {
+    errno = EIO;
+    return EOF;
+  }
+  return 0;
+}
+
+/* Wrap fd in a FILE whose output is compressed by a pool of threads */
+FILE * _open_compressed(int fd) {
+  struct zstream * zs = calloc(1, sizeof *zs);
+  zs->fd = fd;
+  zs->format = _compress_format;
+  zs->level = _compress_level;
+  zs->nthread = _compress_threads;
+  zs->nslot = 2 * zs->nthread + 2;
+  zs->slots = calloc(zs->nslot, sizeof *zs->slots);
+  int t;
+  for ( t = 0; t < zs->nslot; t++ )
+    zs->slots[t].in = malloc(COMPRESS_BLOCK_SIZE);
+  pthread_mutex_init(&zs->lock, 0);
+  pthread_cond_init(&zs->cond, 0);
+  zs->threads = malloc(zs->nthread * sizeof *zs->threads);
+  for ( t = 0; t < zs->nthread; t++ )
+    pthread_create(zs->threads + t, 0, _zstream_worker, zs);
+  pthread_create(&zs->writer, 0, _zstream_writer, zs);
+
+  cookie_io_functions_t io = { 0, _zstream_write, 0, _zstream_close };
+  FILE * fp = fopencookie(zs, "w", io);
+  setvbuf(fp, 0, _IOFBF, BUFSIZE);
+  return fp;
+}
+
+/* Open output file, or use stdout if none or "-" */
+FILE * _open_output(char * output_file) {
+  char buf[BUFSIZE];
+  bool to_stdout = ! output_file || strcmp(output_file, "-") == 0;
+  if ( _compress_format != COMPRESS_NONE ) {
+    int fd = to_stdout ? dup(fileno(stdout)) : open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ( fd >= 0 )
+      return _open_compressed(fd);
+    sprintf(buf, "Cannot write output file \"%s\":", to_stdout ? "-" : output_file);
+    _error(buf);
+    _error(strerror(errno));
+    return 0;
+  }
+  if ( to_stdout )
+    return stdout;
+  FILE * out_fp = fopen(output_file, "wb");
+  if ( ! out_fp ) {
+    sprintf(buf, "Cannot write output file \"%s\":", output_file);
+    _error(buf);
+    _error(strerror(errno));
+  }
+  return out_fp;
+}
+
+/* Close output, reporting any error flushing it */
+bool _close_output(FILE * out_fp, char * output_file) {
+  char buf[BUFSIZE];
+  if ( ! fclose(out_fp) )
+    return true;
+  sprintf(buf, "Error writing output \"%s\":", output_file ? output_file : "-");
+  _error(buf);
+  return _error(strerror(errno));
+}
+
+/* Set up output buffer writing to out_fp.  Plain files and stdout are
+   written directly via their descriptor; compressed output goes
+   through the FILE. */
+void ob_init(struct outbuf * ob, FILE * out_fp) {
+  fflush(out_fp);
+  ob->fp = out_fp;
+  ob->fd = fileno(out_fp);
+  ob->buf = malloc(OUTBUF_SIZE);
+  ob->len = 0;
+  ob->failed = false;
+  ob->lineno = -1;
+  ob->lnstart = sizeof ob->lnbuf - 2;
+  ob->lnbuf[sizeof ob->lnbuf - 2] = ':';
+  ob->lnbuf[sizeof ob->lnbuf - 1] = ' ';
+}
+
+/* Write all of iov to fd, resuming after partial writes */
+bool _writev_all(int fd, struct iovec * iov, int niov) {
+  while ( niov > 0 ) {
+    ssize_t n = writev(fd, iov, niov);
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n <= 0 )
+      return false;
+    while ( niov > 0 && n >= iov->iov_len ) {
+      n -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if ( niov > 0 ) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+/* Write buffered data, then data (which may be null) */
+bool _ob_drain(struct outbuf * ob, const void * data, size_t n) {
+  if ( ob->failed )
+    return false;
+  STATS_ADD(bytes_output, ob->len + n);
+  if ( ob->fd < 0 ) {
+    ob->failed = fwrite(ob->buf, 1, ob->len, ob->fp) != ob->len || (n && fwrite(data, 1, n, ob->fp) != n);
+  }
+  else {
+    struct iovec iov[2] = { { ob->buf, ob->len }, { (void *) data, n } };
+    ob->failed = ! _writev_all(ob->fd, iov, n ? 2 : 1);
+  }
+  ob->len = 0;
+  return ! ob->failed;
+}
+
+bool ob_flush(struct outbuf * ob) {
+  return ob->len ? _ob_drain(ob, 0, 0) : ! ob->failed;
+}
+
+bool ob_write(struct outbuf * ob, const void * data, size_t n) {
+  if ( n <= OUTBUF_SIZE - ob->len ) {
+    memcpy(ob->buf + ob->len, data, n);
+    ob->len += n;
+    return true;
+  }
+  if ( n >= OUTBUF_SIZE / 2 )
+    return _ob_drain(ob, data, n);
+  if ( ! _ob_drain(ob, 0, 0) )
+    return false;
+  memcpy(ob->buf, data, n);
+  ob->len = n;
+  return true;
+}
+
+bool ob_putc(struct outbuf * ob, unsigned char c) {
+  if ( ob->len == OUTBUF_SIZE && ! _ob_drain(ob, 0, 0) )
+    return false;
+  ob->buf[ob->len++] = c;
+  return true;
+}
+
+/* Write "N,NNN: " prefix for line lineno.  The next line number is
+   made by incrementing the formatted digits in place, carrying past
+   commas and adding a leading digit (and comma) when all were 9s. */
+bool ob_lineno(struct outbuf * ob, long long lineno) {
+  int end = sizeof ob->lnbuf - 2;
+  if ( lineno == ob->lineno + 1 && ob->lineno >= 0 ) {
+    int i = end - 1;
+    while ( i >= ob->lnstart ) {
+      if ( ob->lnbuf[i] == ',' )
+        i--;
+      else if ( ob->lnbuf[i] == '9' )
+        ob->lnbuf[i--] = '0';
+      else
+        break;
+    }
+    if ( i >= ob->lnstart )
+      ob->lnbuf[i]++;
+    else {
+      int ndigit = end - ob->lnstart - (end - ob->lnstart) / 4;
+      if ( ndigit % 3 == 0 )
+        ob->lnbuf[--ob->lnstart] = ',';
+      ob->lnbuf[--ob->lnstart] = '1';
+    }
+  }
+  else {
+    char * digits = _out_size(lineno, 0);
+    int ndigits = strlen(digits);
+    ob->lnstart = end - ndigits;
+    memcpy(ob->lnbuf + ob->lnstart, digits, ndigits);
+  }
+  ob->lineno = lineno;
+  return ob_write(ob, ob->lnbuf + ob->lnstart, sizeof ob->lnbuf - ob->lnstart);
+}
+
+/* Flush and release output buffer, return false if any write failed */
+bool ob_finish(struct outbuf * ob) {
+  bool ok = ob_flush(ob);
+  free(ob->buf);
+  ob->buf = 0;
+  return ok;
+}
+
+/* Read the rest of a line or record after _read_head() set more, a
+   block at a time, copying it to ob or else out_fp if given and adding
+   its length to *pos_p.  Return false if it could not be written */
+bool _read_rest(FILE * fp, struct records * rec, bool more, struct outbuf * ob, FILE * out_fp, long long * pos_p) {
+  bool success = true;
+  while ( more ) {
+    long n = 0;
+    unsigned char * p = _read_more(fp, rec, &n, &more);
+    *pos_p += n;
+    if ( ob ) {
+      if ( ! ob_write(ob, p, n) )
+        success = false;
+    }
+    else if ( out_fp && fwrite(p, 1, n, out_fp) != n )
+      success = false;
+  }
+  return success;
+}
+
+/* Parse field list like "1,3,5-7" for -a into proj, return false if invalid */
+bool _parse_fields(char * spec, struct projection * proj) {
+  char * p = spec;
+  while ( *p ) {
+    char * next = 0;
+    long from = strtol(p, &next, 10), to = from;
+    if ( next == p || from <= 0 )
+      return false;
+    p = next;
+    if ( *p == '-' ) {
+      p++;
+      to = strtol(p, &next, 10);
+      if ( next == p || to < from )
+        return false;
+      p = next;
+    }
+    if ( *p == ',' )
+      p++;
+    else if ( *p )
+      return false;
+    for ( ; from <= to; from++ ) {
+      proj->fields = realloc(proj->fields, (proj->nfield + 1) * sizeof *proj->fields);
+      proj->fields[proj->nfield++] = from;
+      if ( from > proj->maxfield )
+        proj->maxfield = from;
+    }
+  }
+  return proj->nfield > 0;
+}
+
+/* Parse field predicate like "4>=500" for -w into proj, return false if invalid */
+bool _parse_predicate(char * spec, struct projection * proj) {
+  static char * OPS[] = { "=", "!=", "^", "<", "<=", ">", ">=" };
+  char * p = 0;
+  long field = strtol(spec, &p, 10);
+  if ( p == spec || field <= 0 )
+    return false;
+  int op = -1, i;
+  for ( i = 0; i < sizeof OPS / sizeof *OPS; i++ )
+    if ( ! strncmp(p, OPS[i], strlen(OPS[i])) && (op < 0 || strlen(OPS[i]) > strlen(OPS[op])) )
+      op = i;
+  if ( op < 0 )
+    return false;
+  struct predicate pred = { field, op, strdup(p + strlen(OPS[op])), 0, 0 };
+  pred.nvalue = strlen(pred.value);
+  if ( op >= PRED_LT ) {
+    char * endp = 0;
+    pred.number = strtod(pred.value, &endp);
+    if ( ! pred.nvalue || *endp )
+      return false;
+  }
+  proj->preds = realloc(proj->preds, (proj->npred + 1) * sizeof *proj->preds);
+  proj->preds[proj->npred++] = pred;
+  if ( field > proj->maxfield )
+    proj->maxfield = field;
+  return true;
+}
+
+/* Split line into fields on delimiter, up to the highest field used.
+   Field starts and lengths (never including the newline, or record
+   delimiter proj->eol) go in proj.
+   Returns number of fields found. */
+int _split_fields(struct projection * proj, unsigned char * line, long nread) {
+  if ( ! proj->starts ) {
+    proj->starts = malloc(proj->maxfield * sizeof *proj->starts);
+    proj->lens = malloc(proj->maxfield * sizeof *proj->lens);
+  }
+  long len = nread && line[nread-1] == proj->eol ? nread - 1 : nread;
+  long pos = 0;
+  int nfound = 0;
+  while ( nfound < proj->maxfield ) {
+    unsigned char * d = memchr(line + pos, proj->delim, len - pos);
+    long flen = d ? d - (line + pos) : len - pos;
+    proj->starts[nfound] = pos;
+    proj->lens[nfound] = flen;
+    nfound++;
+    if ( ! d )
+      break;
+    pos += flen + 1;
+  }
+  return nfound;
+}
+
+/* Check all -w predicates hold on split line; a missing field never matches */
+bool _match_predicates(struct projection * proj, unsigned char * line, int nfound) {
+  char numbuf[64];
+  int i;
+  for ( i = 0; i < proj->npred; i++ ) {
+    struct predicate * pred = proj->preds + i;
+    if ( pred->field > nfound )
+      return false;
+    unsigned char * f = line + proj->starts[pred->field - 1];
+    long flen = proj->lens[pred->field - 1];
+    bool ok;
+    if ( pred->op == PRED_EQ || pred->op == PRED_NE ) {
+      ok = flen == pred->nvalue && ! memcmp(f, pred->value, flen);
+      if ( pred->op == PRED_NE )
+        ok = ! ok;
+    }
+    else if ( pred->op == PRED_PREFIX )
+      ok = flen >= pred->nvalue && ! memcmp(f, pred->value, pred->nvalue);
+    else {
+      if ( ! flen || flen >= sizeof numbuf )
+        return false;
+      memcpy(numbuf, f, flen);
+      numbuf[flen] = '\0';
+      char * endp = 0;
+      double x = strtod(numbuf, &endp);
+      if ( *endp )
+        return false;
+      ok = pred->op == PRED_LT ? x < pred->number : pred->op == PRED_LE ? x <= pred->number :
+           pred->op == PRED_GT ? x > pred->number : x >= pred->number;
+    }
+    if ( ! ok )
+      return false;
+  }
+  return true;
+}
+
+/* Write projected fields of split line, delimited, ending with the
+   record delimiter (newline).
+   Fields beyond the end of the line are output empty.  Returns false
+   on error. */
+bool _write_projected(struct projection * proj, unsigned char * line, int nfound, struct outbuf * ob) {
+  int i;
+  for ( i = 0; i < proj->nfield; i++ ) {
+    int fld = proj->fields[i];
+    if ( i > 0 )
+      ob_putc(ob, proj->delim);
+    if ( fld <= nfound && proj->lens[fld - 1] )
+      ob_write(ob, line + proj->starts[fld - 1], proj->lens[fld - 1]);
+  }
+  return ob_putc(ob, proj->eol);
+}
+
+/* Copy bytes [start, end) of src_fd to out_fd, in kernel with
+   copy_file_range to files or sendfile to pipes and sockets where
+   possible, else through a buffer */
+bool _copy_range(int src_fd, int out_fd, long long start, long long end) {
+  loff_t off_in = start;
+  int method = 0;    /* 0: copy_file_range, 1: sendfile, 2: buffer */
+  char * cbuf = 0;
+  STATS_ADD(seeks, 1);
+  while ( off_in < end ) {
+    size_t want = end - off_in > (1 << 30) ? (1 << 30) : end - off_in;
+    ssize_t ncopy = -1;
+    if ( method < 2 ) {
+      if ( method == 0 )
+        ncopy = copy_file_range(src_fd, &off_in, out_fd, 0, want, 0);
+      else
+        ncopy = sendfile(out_fd, src_fd, &off_in, want);
+      /* copy_file_range() fails with EBADF when appending (O_APPEND) */
+      if ( ncopy < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP || (method == 0 && errno == EBADF)) ) {
+        method += 1;
+        continue;
+      }
+      if ( ncopy < 0 && errno == EINTR )
+        continue;
+    }
+    else {
+      if ( ! cbuf )
+        cbuf = malloc(BUFSIZE);
+      if ( want > BUFSIZE )
+        want = BUFSIZE;
+      ncopy = pread(src_fd, cbuf, want, off_in);
+      if ( ncopy > 0 && write(out_fd, cbuf, ncopy) != ncopy )
+        ncopy = -1;
+      if ( ncopy > 0 )
+        off_in += ncopy;
+    }
+    if ( ncopy <= 0 ) {
+      free(cbuf);
+      return false;
+    }
+    STATS_ADD(bytes_read, ncopy);
+    STATS_ADD(bytes_output, ncopy);
+  }
+  free(cbuf);
+  return true;
+}
+
+/* Resolve search range to 1-origin lines [*first_p, *last_p] and the
+   offsets [*pos_p, *end_p) of their bytes, from the index plus a scan
+   of the chunks where the boundaries fall.  An empty range has
+   *last_p < *first_p and *pos_p == *end_p.  Without an end bound the
+   range runs to the current end of file, as line output would.
+*/
+bool _range_offsets(struct hindex * idx, FILE * src_fp, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, long long * first_p, long long * last_p, long long * pos_p, long long * end_p) {
+  long long first = start > 0 ? start : 1;
+  long long last = end > 0 && end < idx->file_lines ? end : idx->file_lines;
+  long long bytes_read = 0;
+  *pos_p = *end_p = 0;
+  if ( greater_than || less_than ) {
+    long long cfirst, clast;
+    if ( ! _content_line_bounds(idx, src_fp, greater_than, less_than, &cfirst, &clast, &bytes_read) )
+      return false;
+    if ( cfirst > first )
+      first = cfirst;
+    if ( clast < last )
+      last = clast;
+  }
+  if ( count >= 0 && last > first + count - 1 )
+    last = first + count - 1;
+  *first_p = first;
+  *last_p = last < first ? first - 1 : last;
+  if ( last < first )
+    return true;
+
+  if ( ! _line_offset(idx, src_fp, first, pos_p) )
+    return false;
+  if ( end <= 0 && ! less_than && count < 0 ) {
+    struct stat st;
+    if ( fstat(fileno(src_fp), &st) )
+      return _error(strerror(errno));
+    *end_p = st.st_size;
+  }
+  else if ( ! _line_offset(idx, src_fp, last + 1, end_p) )
+    return false;
+  if ( *end_p < *pos_p )
+    *end_p = *pos_p;
+  return true;
+}
+
+/* Output range of whole lines unchanged, copying the bytes between
+   its resolved offsets with _copy_range() */
+bool _search_copy(struct hindex * idx, FILE * src_fp, int out_fd, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count) {
+  long long first, last, range_start, range_end;
+  if ( ! _range_offsets(idx, src_fp, start, end, greater_than, less_than, count, &first, &last, &range_start, &range_end) )
+    return false;
+  if ( range_end <= range_start )
+    return true;
+
+  stats_phase(STATS_OUTPUT);
+  if ( ! _copy_range(fileno(src_fp), out_fd, range_start, range_end) ) {
+    _error("Error copying range to output:");
+    return _error(strerror(errno));
+  }
+  return true;
+}
+
+/* Compare line of nread bytes, not NUL terminated, with key as
+   strcmp() would, or as strncmp() over the length of key if prefix */
+int _line_cmp(unsigned char * line, long nread, unsigned char * key, long nkey, bool prefix) {
+  int cmp = memcmp(line, key, _min_of(nread, nkey));
+  if ( cmp || nread == nkey )
+    return cmp;
+  if ( nread < nkey )
+    return -1;
+  return prefix ? 0 : 1;
+}
+
+/* Map window of size bytes (or to end of file) of the file from the
+   page containing pos, replacing any previous window, and prefetch
+   from pos up to prefetch_end */
+bool _map_window(int fd, long long file_size, long long pos, size_t size, long long prefetch_end, unsigned char ** base_p, long long * woff_p, size_t * wlen_p) {
+  if ( *base_p )
+    munmap(*base_p, *wlen_p);
+  *base_p = 0;
+  long page = sysconf(_SC_PAGESIZE);
+  long long woff = pos - pos % page;
+  size_t wlen = file_size - woff < size ? file_size - woff : size;
+  void * base = mmap(0, wlen, PROT_READ, MAP_PRIVATE, fd, woff);
+  if ( base == MAP_FAILED ) {
+    _error("Cannot map data file:");
+    return _error(strerror(errno));
+  }
+  madvise(base, wlen, MADV_SEQUENTIAL);
+  if ( prefetch_end > woff + wlen )
+    prefetch_end = woff + wlen;
+  if ( prefetch_end > pos )
+    madvise(base, prefetch_end - woff, MADV_WILLNEED);
+  *base_p = base;
+  *woff_p = woff;
+  *wlen_p = wlen;
+  return true;
+}
+
+/* Search lines from offset line_start (after line lineno) as
+   search_file() does, finding them with memchr in a mapping of the
+   file and comparing and writing them in place.  At most
+   MMAP_WINDOW_SIZE bytes are mapped at a time; the window slides
+   forward to the line that crosses its end.  A line longer than the
+   window is judged by its head and written or skipped window by window,
+   unless projected, when the window grows to hold it.  The span up to
+   the index entry bounding the range is prefetched with MADV_WILLNEED
+   as each window is mapped.
+*/
+bool _search_mmap(struct hindex * idx, int src_fd, struct outbuf * ob, long long line_start, long long lineno, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, bool line_number, struct projection * proj) {
+  struct stat st;
+  if ( fstat(src_fd, &st) )
+    return _error(strerror(errno));
+  long long file_size = st.st_size;
+  long long span_end = file_size, span_lineno = 0;
+  if ( end > 0 || less_than )
+    _find_end_entry(idx, end, less_than, &span_end, &span_lineno);
+
+  int nless_than = less_than ? strlen(less_than) : 0;
+  int ngreater_than = greater_than ? strlen(greater_than) : 0;
+  unsigned char * base = 0;
+  long long woff = 0;
+  size_t wlen = 0, wsize = MMAP_WINDOW_SIZE;
+  long long pos = line_start, noutput = 0;
+  bool success = true, skipped = false, rest = false, rest_out = false, in_line = false, ended = false;
+  stats_phase(STATS_SCAN);
+  while ( pos < file_size ) {
+    if ( ! rest && end > 0 && lineno >= end )
+      break;
+    if ( ! rest && count >= 0 && noutput >= count )
+      break;
+
+    /* Slide window to the current line, growing it if the line does
+       not fit and is projected */
+    if ( ! base || pos >= woff + wlen ) {
+      if ( ! (success = _map_window(src_fd, file_size, pos, wsize, span_end, &base, &woff, &wlen)) )
+        break;
+      STATS_ADD(seeks, 1);
+    }
+    unsigned char * line = base + (pos - woff);
+    long avail = woff + wlen - pos;
+    bool at_end = woff + wlen >= file_size;
+
+    /* Go on with the rest of a line longer than the window, sliding
+       the window to any line it ends before that is not seen whole */
+    if ( rest ) {
+      long n = _record_rest(&idx->rec, line, avail, at_end, &in_line, &ended);
+      STATS_ADD(bytes_read, n);
+      if ( rest_out && ! ob_write(ob, line, n) ) {
+        _error("Error writing output:");
+        success = _error(strerror(errno));
+        break;
+      }
+      pos += n;
+      rest = ! ended;
+      if ( rest && n < avail ) {
+        munmap(base, wlen);
+        base = 0;
+      }
+      continue;
+    }
+
+    long nread = _record_len(&idx->rec, line, avail, at_end);
+    if ( ! nread && (pos - woff >= sysconf(_SC_PAGESIZE) || proj) ) {
+      if ( pos - woff < sysconf(_SC_PAGESIZE) )
+        wsize *= 2;
+      munmap(base, wlen);
+      base = 0;
+      continue;
+    }
+    if ( ! nread ) {
+      /* Judge line longer than the window by the head in it */
+      rest = in_line = true;
+      if ( less_than && _line_cmp(line, avail, less_than, nless_than, true) > 0 )
+        break;
+      lineno += 1;
+      rest_out = ! ((start > 0 && lineno < start) || (greater_than && _line_cmp(line, avail, greater_than, ngreater_than, false) < 0));
+      if ( ! rest_out ) {
+        STATS_ADD(lines_discarded, 1);
+        skipped = true;
+        continue;
+      }
+      if ( skipped ) {
+        _offset_cache_start(idx, start, greater_than, lineno, pos);
+        skipped = false;
+      }
+      if ( ! noutput )
+        stats_phase(STATS_OUTPUT);
+      if ( line_number )
+        ob_lineno(ob, lineno);
+      noutput += 1;
+      continue;
+    }
+    STATS_ADD(bytes_read, nread);
+
+    if ( less_than && _line_cmp(line, nread, less_than, nless_than, true) > 0 )
+      break;
+    pos += nread;
+    lineno += 1;
+    if ( (start > 0 && lineno < start) || (greater_than && _line_cmp(line, nread, greater_than, ngreater_than, false) < 0) ) {
+      STATS_ADD(lines_discarded, 1);
+      skipped = true;
+      continue;
+    }
+    if ( skipped ) {
+      _offset_cache_start(idx, start, greater_than, lineno, pos - nread);
+      skipped = false;
+    }
+
+    int nfound = 0;
+    if ( proj ) {
+      nfound = _split_fields(proj, line, nread);
+      if ( ! _match_predicates(proj, line, nfound) ) {
+        STATS_ADD(lines_discarded, 1);
+        continue;
+      }
+    }
+    if ( ! noutput )
+      stats_phase(STATS_OUTPUT);
+    if ( line_number )
+      ob_lineno(ob, lineno);
+    bool wrote;
+    if ( proj && proj->nfield )
+      wrote = _write_projected(proj, line, nfound, ob);
+    else
+      wrote = ob_write(ob, line, nread);
+    if ( ! wrote ) {
+      _error("Error writing output:");
+      success = _error(strerror(errno));
+      break;
+    }
+    noutput += 1;
+  }
+  if ( base )
+    munmap(base, wlen);
+  return success;
+}
+
+/* Search the file for lines */
+bool search_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, bool line_number, struct projection * proj, bool use_mmap, bool verbose) {
+
+  char buf[BUFSIZE], buf2[BUFSIZE], buf3[BUFSIZE];
+
+  /* Projected records end as in the file */
+  if ( proj )
+    proj->eol = idx->rec.delim;
+
+  /* Handle zero count case */
+  if ( count == 0 )
+    return true;
+
+  /* Check non-overlapping ranges */
+  if ( start > 0 && end > 0 && start > end )
+    return true;
+  if ( greater_than && less_than && strcmp(greater_than, less_than) > 0 )
+    return true;
+
+  /* Check if start is beyond the end of data */
+  if ( start > 0 && start > idx->file_lines && verbose ) {
+    strcpy(buf2, _out_size(start, 0));
+    strcpy(buf3, _out_size(idx->file_lines, 0));
+    sprintf(buf, "Start line %s > %s lines in file \"%s\" ... nothing will be output", buf2, buf3, idx->filename_full);
+    _error(buf);
+  }
+
+  /* Starting offset and current line */
+  long long line_start = 0;
+  long long lineno = 0;
+  stats_phase(STATS_SEEK);
+  if ( ! _find_start_entry(idx, start, greater_than, &line_start, &lineno) )
+    return false;
+
+  /* Start right at a range start resolved by an earlier search */
+  struct offset_hit * hit = start > 0 ? _offset_cached(idx, 'S', start, 0) : 0;
+  if ( hit && hit->filepos > line_start ) {
+    line_start = hit->filepos;
+    lineno = hit->lineno - 1;
+  }
+  hit = greater_than ? _offset_cached(idx, 'G', 0, greater_than) : 0;
+  if ( hit && hit->filepos > line_start ) {
+    line_start = hit->filepos;
+    lineno = hit->lineno - 1;
+  }
+
+  /* Open source for read */
+  FILE * src_fp = fopen(idx->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Offset past which no line can be output, bounded by the index */
+  long long span_end = idx->file_size, span_lineno = 0;
+  long long end_line = end;
+  if ( count >= 0 && ! greater_than && ! (proj && proj->npred) ) {
+    long long last = (start > 0 ? start : 1) + count - 1;
+    if ( end_line <= 0 || last < end_line )
+      end_line = last;
+  }
+  if ( end_line > 0 || less_than )
+    _find_end_entry(idx, end_line, less_than, &span_end, &span_lineno);
+
+  /* Report how much of what will be read is cached */
+  long long cached = 0;
+  if ( verbose && span_end > line_start && cache_residency(fileno(src_fp), line_start, span_end, &cached) ) {
+    strcpy(buf2, _out_size(span_end - line_start, 0));
+    strcpy(buf3, _out_size(line_start, 0));
+    sprintf(buf, "%.1f%% of %s bytes to read from offset %s of \"%s\" is in the page cache", 100.0 * cached / (span_end - line_start), buf2, buf3, idx->filename_full);
+    _error(buf);
+  }
+
+  /* Read lines from file */
+  long long noutput = 0;
+  FILE * out_fp = _open_output(output_file);
+  if ( ! out_fp ) {
+    fclose(src_fp);
+    return false;
+  }
+  struct outbuf ob;
+  ob_init(&ob, out_fp);
+
+  /* Unchanged lines to an uncompressed output are copied as one byte
+     range, unless a small -N makes resolving its end not worth it */
+  long long chunk_lines = idx->nentry > 0 ? idx->file_lines / idx->nentry : 0;
+  if ( ! line_number && ! proj && ob.fd >= 0 && (count < 0 || count >= chunk_lines) ) {
+    bool success = _search_copy(idx, src_fp, ob.fd, start, end, greater_than, less_than, count);
+    fclose(src_fp);
+    ob_finish(&ob);
+    return _close_output(out_fp, output_file) && success;
+  }
+
+  /* Examine lines in place in a mapping of the file */
+  if ( use_mmap ) {
+    bool success = _search_mmap(idx, fileno(src_fp), &ob, line_start, lineno, start, end, greater_than, less_than, count, line_number, proj);
+    fclose(src_fp);
+    if ( ! ob_finish(&ob) && success ) {
+      sprintf(buf, "Error writing output \"%s\":", output_file ? output_file : "-");
+      _error(buf);
+      success = _error(strerror(errno));
+    }
+    return _close_output(out_fp, output_file) && success;
+  }
+
+  /* Go to initial position */
+  if ( line_start ) {
+    STATS_ADD(seeks, 1);
+    int seek_error = fseek(src_fp, line_start, SEEK_SET);
+    if ( seek_error ) {
+      sprintf(buf, "Error seeking to position %lld in file \"%s\":", line_start, idx->filename_full);
+      _error(buf);
+      fclose(src_fp);
+      ob_finish(&ob);
+      fclose(out_fp);
+      return false;
+    }
+  }
+
+  /* Copy out lines until limit reached, prefetching ahead.  Lines are
+     read whole only to project them, else their head is compared and
+     the rest copied out or skipped a block at a time */
+  int nless_than = less_than ? strlen(less_than) : 0;
+  long want = greater_than && strlen(greater_than) >= nless_than ? strlen(greater_than) + 1 : nless_than;
+  long long pos = line_start;
+  struct cache_cursor cc;
+  cache_cursor_init(&cc, fileno(src_fp), line_start, span_end, false);
+  bool skipped = false;
+  stats_phase(STATS_SCAN);
+  while ( true ) {
+
+    /* Truncate by end line */
+    if ( end > 0 && lineno >= end )
+      break;
+
+    /* Truncate based on count */
+    if ( count >= 0 && noutput >= count )
+      break;
+
+    /* Read and copy out line */
+    long nread = 0;
+    bool more = false;
+    unsigned char * line = proj ? _read_line(src_fp, &idx->rec, &nread) : _read_head(src_fp, &idx->rec, want, &nread, &more);
+    if ( ! nread )
+      break;
+    pos += nread;
+    if ( pos >= cc.due )
+      cache_cursor_advance(&cc, pos);
+
+    /* Truncate based on max content filter */
+    if ( less_than && strncmp(line, less_than, nless_than) > 0 )
+      break;
+
+    lineno += 1;
+
+    /* Skip if not yet reached start line */
+    if ( start > 0 && lineno < start ) {
+      _read_rest(src_fp, &idx->rec, more, 0, 0, &pos);
+      STATS_ADD(lines_discarded, 1);
+      skipped = true;
+      continue;
+    }
+
+    /* Skip if not yet reached the min content filter */
+    if ( greater_than && strcmp(line, greater_than) < 0 ) {
+      _read_rest(src_fp, &idx->rec, more, 0, 0, &pos);
+      STATS_ADD(lines_discarded, 1);
+      skipped = true;
+      continue;
+    }
+    if ( skipped ) {
+      _offset_cache_start(idx, start, greater_than, lineno, pos - nread);
+      skipped = false;
+    }
+
+    /* Apply field predicates and projection */
+    int nfound = 0;
+    if ( proj ) {
+      nfound = _split_fields(proj, line, nread);
+      if ( ! _match_predicates(proj, line, nfound) ) {
+        STATS_ADD(lines_discarded, 1);
+        continue;
+      }
+    }
+
+    /* Output line */
+    if ( ! noutput )
+      stats_phase(STATS_OUTPUT);
+    if ( line_number )
+      ob_lineno(&ob, lineno);
+
+    bool wrote;
+    if ( proj && proj->nfield )
+      wrote = _write_projected(proj, line, nfound, &ob);
+    else
+      wrote = ob_write(&ob, line, nread) && _read_rest(src_fp, &idx->rec, more, &ob, 0, &pos);
+    if ( ! wrote ) {
+      sprintf(buf, "Error writing %ld bytes to output \"%s\":", nread, output_file ? output_file : "-");
+      _error(buf);
+      _error(strerror(errno));
+      fclose(src_fp);
+      ob_finish(&ob);
+      fclose(out_fp);
+      return false;
+    }
+
+    noutput += 1;
+  }
+
+  fclose(src_fp);
+  if ( ! ob_finish(&ob) ) {
+    sprintf(buf, "Error writing output \"%s\":", output_file ? output_file : "-");
+    _error(buf);
+    _error(strerror(errno));
+    fclose(out_fp);
+    return false;
+  }
+  return _close_output(out_fp, output_file);
+}
+
+/* Write bytes [pos, end) of the file to ob: copied with _copy_range()
+   when ob writes to a descriptor, else read through block of size
+   bytes */
+bool _ob_copy_range(struct outbuf * ob, int src_fd, unsigned char * block, long size, long long pos, long long end) {
+  if ( ob->fd >= 0 )
+    return ob_flush(ob) && _copy_range(src_fd, ob->fd, pos, end);
+  while ( pos < end ) {
+    long n = end - pos < size ? end - pos : size;
+    ssize_t got = pread(src_fd, block, n, pos);
+    if ( got <= 0 )
+      return false;
+    STATS_ADD(bytes_read, got);
+    if ( ! ob_write(ob, block, got) )
+      return false;
+    pos += got;
+  }
+  return true;
+}
+
+/* Start of the record that goes on past pos, none beginning after it,
+   reading back from pos in blocks of size bytes but not before floor,
+   itself a record start.  For -J a line crossing the top of a block is
+   judged by its first LINE_BLOCK_SIZE bytes, read again.  Returns -1 if
+   the file cannot be read */
+long long _reverse_record_start(struct records * rec, int fd, unsigned char * block, long size, long long pos, long long floor) {
+  int delim = rec->start ? '\n' : rec->delim;
+  unsigned char * head = 0;
+  long long found = floor;
+  while ( pos > floor && found == floor ) {
+    long n = pos - floor < size ? pos - floor : size;
+    if ( pread(fd, block, n, pos - n) != n ) {
+      found = -1;
+      break;
+    }
+    STATS_ADD(bytes_read, n);
+    pos -= n;
+    unsigned char * nl = memrchr(block, delim, n);
+    while ( nl ) {
+      long long at = pos + (nl - block) + 1;
+      if ( ! rec->start ) {
+        found = at;
+        break;
+      }
+      unsigned char * line = nl + 1;
+      unsigned char * e = memchr(line, '\n', block + n - line);
+      if ( ! e ) {
+        if ( ! head )
+          head = malloc(LINE_BLOCK_SIZE);
+        ssize_t got = pread(fd, head, LINE_BLOCK_SIZE, at);
+        if ( got < 0 ) {
+          found = -1;
+          break;
+        }
+        STATS_ADD(bytes_read, got);
+        line = head;
+        e = memchr(head, '\n', got);
+        if ( ! e )
+          e = head + got;
+      }
+      if ( _record_starts(rec, line, e - line) ) {
+        found = at;
+        break;
+      }
+      nl = nl > block ? memrchr(block, delim, nl - block) : 0;
+    }
+    if ( found < 0 )
+      break;
+  }
+  free(head);
+  return found;
+}
+
+/* Search the file for lines, outputting them last to first.  The end
+   of the range is found from the index and the file is read backward
+   from there in blocks that never straddle an index entry, so lines
+   are known to start at each entry offset without reading further
+   back.  Reading stops once -S, -G or -N is satisfied.
+*/
+bool search_file_reverse(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, bool line_number, bool verbose) {
+
+  char buf[BUFSIZE];
+
+  /* Handle zero count case */
+  if ( count == 0 )
+    return true;
+
+  /* Check non-overlapping ranges */
+  if ( start > 0 && end > 0 && start > end )
+    return true;
+  if ( greater_than && less_than && strcmp(greater_than, less_than) > 0 )
+    return true;
+
+  /* Lowest offset to read back to, and highest offset to read from */
+  long long line_start = 0, line_end = 0;
+  long long lineno = 0, lineno_end = 0;
+  if ( ! _find_start_entry(idx, start, greater_than, &line_start, &lineno) )
+    return false;
+  int ient = _find_end_entry(idx, end, less_than, &line_end, &lineno_end);
+  if ( verbose ) {
+    char buf2[BUFSIZE];
+    strcpy(buf2, _out_size(line_start, 0));
+    sprintf(buf, "Reading \"%s\" backward from offset %s to %s", idx->filename_full, _out_size(line_end, 0), buf2);
+    _error(buf);
+  }
+
+  /* Open source for read */
+  int src_fd = open(idx->filename_full, O_RDONLY);
+  if ( src_fd < 0 ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+  FILE * out_fp = _open_output(output_file);
+  if ( ! out_fp ) {
+    close(src_fd);
+    return false;
+  }
+  struct outbuf ob;
+  ob_init(&ob, out_fp);
+
+  /* Data read so far is in rbuf from lo, at offset bufpos of the file,
+     with one spare byte past the end for a NUL.  Bytes in [lo, hi) of
+     rbuf are not yet output, and those in [top, hi) have been searched
+     for the start of the line ending at hi.  A line longer than rbuf is
+     judged by its head and written straight from the file. */
+  long cap = REVERSE_BLOCK_SIZE;
+  unsigned char * rbuf = malloc(cap + 1);
+  long lo = cap, hi = cap, top = cap;
+  long long bufpos = line_end;
+  long long noutput = 0;
+  bool success = true;
+  int nless_than = less_than ? strlen(less_than) : 0;
+
+  /* 1-origin number of line ending at hi */
+  lineno = lineno_end;
+
+  while ( hi > lo || bufpos > line_start ) {
+
+    /* Truncate based on count */
+    if ( count >= 0 && noutput >= count )
+      break;
+
+    /* Look for end of the previous line, which starts the current one,
+       and for -J records is followed by a line that begins a record */
+    if ( top > hi - 1 )
+      top = hi - 1;
+    unsigned char * nl = top > lo ? memrchr(rbuf + lo, idx->rec.delim, top - lo) : 0;
+    while ( nl && idx->rec.start ) {
+      unsigned char * e = memchr(nl + 1, '\n', rbuf + hi - nl - 1);
+      if ( _record_starts(&idx->rec, nl + 1, (e ? e : rbuf + hi) - nl - 1) )
+        break;
+      nl = nl > rbuf + lo ? memrchr(rbuf + lo, '\n', nl - rbuf - lo) : 0;
+    }
+    if ( ! nl )
+      top = lo;
+
+    /* Offset where current chunk starts, which is always a line start */
+    while ( ient > 0 && idx->entries[ient-1].filepos >= bufpos )
+      ient--;
+    long long chunk_start = ient > 0 ? idx->entries[ient-1].filepos : 0;
+    if ( chunk_start < line_start )
+      chunk_start = line_start;
+
+    if ( ! nl && bufpos > chunk_start ) {
+      /* Need more data: read the block before bufpos, within this chunk */
+      long want = bufpos - chunk_start < REVERSE_BLOCK_SIZE ? bufpos - chunk_start : REVERSE_BLOCK_SIZE;
+      if ( lo < want && hi < cap ) {
+        /* Move data not yet output to the end to make room */
+        long shift = cap - hi;
+        memmove(rbuf + lo + shift, rbuf + lo, hi - lo);
+        lo += shift;
+        hi += shift;
+        top += shift;
+      }
+      if ( ! lo ) {
+        /* Line fills rbuf: find its start further back and judge it by
+           its head, writing it from the file */
+        long long rec_end = bufpos + hi;
+        long long rec_start = _reverse_record_start(&idx->rec, src_fd, rbuf, cap, bufpos, chunk_start);
+        long nhead = rec_start < 0 ? -1 : rec_end - rec_start < cap ? rec_end - rec_start : cap;
+        if ( nhead < 0 || pread(src_fd, rbuf, nhead, rec_start) != nhead ) {
+          sprintf(buf, "Error reading line ending at position %lld in file \"%s\":", rec_end, idx->filename_full);
+          _error(buf);
+          success = _error(strerror(errno));
+          break;
+        }
+        STATS_ADD(bytes_read, nhead);
+        rbuf[nhead] = '\0';
+        bool in_range = ! ((end > 0 && lineno > end) || (less_than && strncmp(rbuf, less_than, nless_than) > 0));
+        bool past_start = (start > 0 && lineno < start) || (greater_than && strcmp(rbuf, greater_than) < 0);
+        if ( in_range && ! past_start ) {
+          if ( line_number )
+            ob_lineno(&ob, lineno);
+          if ( ! ob_write(&ob, rbuf, nhead) || ! _ob_copy_range(&ob, src_fd, rbuf, cap, rec_start + nhead, rec_end) ) {
+            sprintf(buf, "Error writing %lld bytes to output \"%s\":", rec_end - rec_start, output_file ? output_file : "-");
+            success = _error(buf);
+            break;
+          }
+          noutput += 1;
+        }
+        if ( past_start )
+          break;
+        lo = hi = top = cap;
+        bufpos = rec_start;
+        lineno -= 1;
+        continue;
+      }
+      if ( want > lo )
+        want = lo;
+      ssize_t got = pread(src_fd, rbuf + lo - want, want, bufpos - want);
+      if ( got != want ) {
+        sprintf(buf, "Error reading %ld bytes at position %lld in file \"%s\":", want, bufpos - want, idx->filename_full);
+        _error(buf);
+        success = _error(got < 0 ? strerror(errno) : "Short read");
+        break;
+      }
+      lo -= want;
+      bufpos -= want;
+      continue;
+    }
+
+    /* Current line is [line_lo, hi) */
+    long line_lo = nl ? nl + 1 - rbuf : lo;
+    long nread = hi - line_lo;
+    unsigned char * line = rbuf + line_lo;
+    unsigned char saved = rbuf[hi];
+    rbuf[hi] = '\0';
+    bool in_range = true, past_start = false;
+
+    /* Skip if beyond end line or max content filter */
+    if ( end > 0 && lineno > end )
+      in_range = false;
+    else if ( less_than && strncmp(line, less_than, nless_than) > 0 )
+      in_range = false;
+
+    /* Stop once before start line or min content filter */
+    if ( start > 0 && lineno < start )
+      past_start = true;
+    else if ( greater_than && strcmp(line, greater_than) < 0 )
+      past_start = true;
+
+    if ( in_range && ! past_start ) {
+      /* Output line */
+      if ( line_number )
+        ob_lineno(&ob, lineno);
+      if ( ! ob_write(&ob, line, nread) ) {
+        sprintf(buf, "Error writing %ld bytes to output \"%s\":", nread, output_file ? output_file : "-");
+        success = _error(buf);
+        break;
+      }
+      noutput += 1;
+    }
+    rbuf[hi] = saved;
+    if ( past_start )
+      break;
+
+    hi = line_lo;
+    lineno -= 1;
+  }
+
+  free(rbuf);
+  close(src_fd);
+  if ( ! ob_finish(&ob) && success )
+    success = _error("Error writing output:");
+  return _close_output(out_fp, output_file) && success;
+}
+
+/* Next value of splitmix64 generator, used so -R samples reproduce
+   on any platform */
+uint64_t _rand64(uint64_t * state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Uniform random value in [0, n) */
+uint64_t _rand_below(uint64_t * state, uint64_t n) {
+  uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+  uint64_t r;
+  do
+    r = _rand64(state);
+  while ( r >= limit );
+  return r % n;
+}
+
+int _cmp_ll(const void * a, const void * b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Output a uniform random sample of nsample distinct lines from the
+   range, in file order.  Sampled line numbers are drawn and sorted
+   first, then each is fetched by seeking to the index entry before it,
+   reading through rather than seeking when the next sample is close.
+   Cost is proportional to nsample, not the size of the range.
+*/
+bool sample_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long nsample, uint64_t seed, long long count, bool line_number, bool verbose) {
+
+  char buf[BUFSIZE], buf2[BUFSIZE];
+
+  /* Handle zero count case */
+  if ( nsample == 0 || count == 0 )
+    return true;
+
+  /* Open source for read */
+  FILE * src_fp = fopen(idx->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Resolve range as 1-origin line numbers [first, last] */
+  long long first = start > 0 ? start : 1;
+  long long last = end > 0 && end < idx->file_lines ? end : idx->file_lines;
+  long long bytes_read = 0;
+  if ( greater_than || less_than ) {
+    if ( ! _content_line_bounds(idx, src_fp, greater_than, less_than, &first, &last, &bytes_read) ) {
+      fclose(src_fp);
+      return false;
+    }
+  }
+  long long nrange = last >= first ? last - first + 1 : 0;
+  if ( nsample > nrange )
+    nsample = nrange;
+  if ( count >= 0 && nsample > count )
+    nsample = count;
+
+  /* Draw distinct line numbers: selection sampling when taking most of
+     the range, else draw, sort, drop duplicates and draw again */
+  long long * samples = malloc((nsample ? nsample : 1) * sizeof *samples);
+  long long nsampled = 0;
+  uint64_t rstate = seed;
+  if ( nsample > nrange / 2 ) {
+    long long l;
+    for ( l = first; l <= last && nsampled < nsample; l++ )
+      if ( _rand_below(&rstate, last - l + 1) < nsample - nsampled )
+        samples[nsampled++] = l;
+  }
+  else {
+    while ( nsampled < nsample ) {
+      while ( nsampled < nsample )
+        samples[nsampled++] = first + _rand_below(&rstate, nrange);
+      qsort(samples, nsampled, sizeof *samples, _cmp_ll);
+      long long i, ndistinct = 0;
+      for ( i = 0; i < nsampled; i++ )
+        if ( ! ndistinct || samples[i] != samples[ndistinct-1] )
+          samples[ndistinct++] = samples[i];
+      nsampled = ndistinct;
+    }
+  }
+
+  FILE * out_fp = _open_output(output_file);
+  if ( ! out_fp ) {
+    free(samples);
+    fclose(src_fp);
+    return false;
+  }
+  struct outbuf ob;
+  ob_init(&ob, out_fp);
+
+  /* Fetch sampled lines in order, seeking only to touched chunks */
+  long long cur_pos = -1, cur_lineno = 0, nseek = 0;
+  bool success = true;
+  long long i;
+  for ( i = 0; i < nsampled && success; i++ ) {
+    long long target = samples[i];
+    int ient = _find_line_entry(idx, target);
+    long long ent_pos = ient >= 0 ? idx->entries[ient].filepos : 0;
+    long long ent_lineno = ient >= 0 ? idx->entries[ient].lineno : 0;
+    if ( cur_pos < 0 || (cur_lineno < ent_lineno && ent_pos - cur_pos > SAMPLE_COALESCE_BYTES) ) {
+      if ( fseeko(src_fp, ent_pos, SEEK_SET) ) {
+        sprintf(buf, "Error seeking to position %lld in file \"%s\":", ent_pos, idx->filename_full);
+        _error(buf);
+        success = _error(strerror(errno));
+        break;
+      }
+      cur_pos = ent_pos;
+      cur_lineno = ent_lineno;
+      nseek += 1;
+    }
+
+    /* Read forward to sampled line */
+    long nread = 1;
+    while ( nread && cur_lineno < target - 1 ) {
+      _skip_line(src_fp, &idx->rec, 0, 0, &nread);
+      cur_lineno += nread ? 1 : 0;
+      cur_pos += nread;
+      bytes_read += nread;
+    }
+    bool more = false;
+    unsigned char * line = nread ? _read_head(src_fp, &idx->rec, 0, &nread, &more) : 0;
+    if ( ! nread )
+      break;
+    cur_lineno += 1;
+    cur_pos += nread;
+    bytes_read += nread;
+
+    /* Output line, the rest of a long one a block at a time */
+    if ( line_number )
+      ob_lineno(&ob, cur_lineno);
+    long long nrest = 0;
+    bool wrote = ob_write(&ob, line, nread) && _read_rest(src_fp, &idx->rec, more, &ob, 0, &nrest);
+    cur_pos += nrest;
+    bytes_read += nrest;
+    if ( ! wrote && success ) {
+      sprintf(buf, "Error writing %ld bytes to output \"%s\":", nread, output_file ? output_file : "-");
+      success = _error(buf);
+    }
+  }
+
+  if ( verbose ) {
+    strcpy(buf2, _out_size(nrange, 0));
+    sprintf(buf, "Sampled %lld of %s lines in \"%s\" with seed %llu: %lld seeks, ", nsampled, buf2, idx->filename_full, (unsigned long long) seed, nseek);
+    strcat(buf, _out_size(bytes_read, 0));
+    strcat(buf, " bytes read");
+    _error(buf);
+  }
+
+  free(samples);
+  fclose(src_fp);
+  if ( ! ob_finish(&ob) && success )
+    success = _error("Error writing output:");
+  return _close_output(out_fp, output_file) && success;
+}
+
+/* Report bytes read to answer a count against the bytes it covers */
+void _report_count_io(struct hindex * idx, char * what, long long bytes_read, long long span_start, long long span_end) {
+  char buf[BUFSIZE], buf2[BUFSIZE];
+  strcpy(buf2, _out_size(bytes_read, 0));
+  sprintf(buf, "%s \"%s\": read %s of %s bytes covered", what, idx->filename_full, buf2, _out_size(span_end - span_start, 0));
+  _error(buf);
+}
+
+/* Output number of lines in range.  Whole chunks are counted from
+   index entry line numbers; only the chunks holding -G and -L
+   boundaries are read, and nothing is read for -S/-E.
+*/
+bool count_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, bool verbose) {
+
+  char buf[BUFSIZE];
+
+  long long first = start > 0 ? start : 1;
+  long long last = end > 0 && end < idx->file_lines ? end : idx->file_lines;
+  long long bytes_read = 0;
+  if ( greater_than || less_than ) {
+    FILE * src_fp = fopen(idx->filename_full, "rb");
+    if ( ! src_fp ) {
+      sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+      _error(buf);
+      return _error(strerror(errno));
+    }
+    bool success = _content_line_bounds(idx, src_fp, greater_than, less_than, &first, &last, &bytes_read);
+    fclose(src_fp);
+    if ( ! success )
+      return false;
+  }
+  long long nlines = last >= first ? last - first + 1 : 0;
+  if ( count >= 0 && nlines > count )
+    nlines = count;
+
+  FILE * out_fp = _open_output(output_file);
+  if ( ! out_fp )
+    return false;
+  fprintf(out_fp, "%lld\n", nlines);
+  fclose(out_fp);
+
+  if ( verbose ) {
+    int ifirst = _find_line_entry(idx, first);
+    int ilast = _find_line_entry(idx, last + 1);
+    long long span_start = ifirst >= 0 ? idx->entries[ifirst].filepos : 0;
+    long long span_end = ilast + 1 < idx->nentry ? idx->entries[ilast + 1].filepos : idx->file_size;
+    _report_count_io(idx, "Counted lines in", bytes_read, span_start, span_end);
+  }
+  return true;
+}
+
+/* Output line counts per bucket of lines sharing the same leading
+   keylen bytes, in order, as "<count> <key>" like "uniq -c".  A chunk
+   whose first line and the next chunk's first line (per the index)
+   share a key is counted from entry line numbers without reading.
+*/
+bool histogram_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long keylen, bool verbose) {
+
+  char buf[BUFSIZE];
+
+  if ( idx->snaplen <= 0 || keylen > idx->snaplen ) {
+    sprintf(buf, "ERROR: -g %ld given, but \"%s\" was not indexed with -P/--snaplen of at least that", keylen, idx->index_filename);
+    return _error(buf);
+  }
+
+  FILE * src_fp = fopen(idx->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Resolve range as 1-origin line numbers [first, last] */
+  long long first = start > 0 ? start : 1;
+  long long last = end > 0 && end < idx->file_lines ? end : idx->file_lines;
+  long long bytes_read = 0;
+  if ( greater_than || less_than ) {
+    if ( ! _content_line_bounds(idx, src_fp, greater_than, less_than, &first, &last, &bytes_read) ) {
+      fclose(src_fp);
+      return false;
+    }
+  }
+
+  FILE * out_fp = _open_output(output_file);
+  if ( ! out_fp ) {
+    fclose(src_fp);
+    return false;
+  }
+
+  /* Current bucket key and count */
+  unsigned char * key = malloc(keylen + 1);
+  long nkey = -1;
+  long long nbucket = 0;
+
+  /* Walk chunks [chunk_lineno, next_lineno) overlapping the range */
+  long long cur_pos = -1, cur_lineno = 0;
+  long long span_start = -1, span_end = 0;
+  bool success = true;
+  int i;
+  for ( i = -1; i < idx->nentry - 1 && success; i++ ) {
+    long long chunk_pos = i >= 0 ? idx->entries[i].filepos : 0;
+    long long chunk_lineno = i >= 0 ? idx->entries[i].lineno : 0;
+    struct entry next = idx->entries[i+1];
+    if ( next.lineno < first )
+      continue;
+    if ( chunk_lineno + 1 > last )
+      break;
+    if ( span_start < 0 )
+      span_start = chunk_pos;
+    span_end = next.filepos;
+
+    /* Whole chunk in range and in a single bucket: count from index */
+    unsigned char * frag = i >= 0 ? idx->entries[i].frag : 0;
+    if ( frag && next.frag && chunk_lineno + 1 >= first && next.lineno <= last ) {
+      long nfrag = _min_of(keylen, strlen(frag));
+      if ( nfrag == _min_of(keylen, strlen(next.frag)) && ! memcmp(frag, next.frag, nfrag) ) {
+        if ( nkey != nfrag || memcmp(key, frag, nfrag) ) {
+          if ( nkey >= 0 )
+            fprintf(out_fp, "%lld %.*s\n", nbucket, (int) nkey, key);
+          memcpy(key, frag, nfrag);
+          nkey = nfrag;
+          nbucket = 0;
+        }
+        nbucket += next.lineno - chunk_lineno;
+        continue;
+      }
+    }
+
+    /* Otherwise read the chunk's lines in range */
+    if ( cur_pos != chunk_pos ) {
+      if ( fseeko(src_fp, chunk_pos, SEEK_SET) ) {
+        sprintf(buf, "Error seeking to position %lld in file \"%s\":", chunk_pos, idx->filename_full);
+        _error(buf);
+        success = _error(strerror(errno));
+        break;
+      }
+      cur_pos = chunk_pos;
+      cur_lineno = chunk_lineno;
+    }
+    while ( cur_lineno < next.lineno && cur_lineno < last ) {
+      long nread = 0;
+      bool more = false;
+      unsigned char * line = _read_head(src_fp, &idx->rec, keylen, &nread, &more);
+      if ( ! nread )
+        break;
+      long long nrest = 0;
+      _read_rest(src_fp, &idx->rec, more, 0, 0, &nrest);
+      cur_pos += nread + nrest;
+      cur_lineno += 1;
+      bytes_read += nread + nrest;
+      if ( cur_lineno < first )
+        continue;
+      long nline = _record_key_len(&idx->rec, line, nread);
+      if ( nline > keylen )
+        nline = keylen;
+      if ( nkey != nline || memcmp(key, line, nline) ) {
+        if ( nkey >= 0 )
+          fprintf(out_fp, "%lld %.*s\n", nbucket, (int) nkey, key);
+        memcpy(key, line, nline);
+        nkey = nline;
+        nbucket = 0;
+      }
+      nbucket += 1;
+    }
+  }
+  if ( success && nkey >= 0 )
+    fprintf(out_fp, "%lld %.*s\n", nbucket, (int) nkey, key);
+
+  if ( verbose && success )
+    _report_count_io(idx, "Histogram of", bytes_read, span_start < 0 ? 0 : span_start, span_end);
+
+  free(key);
+  fclose(src_fp);
+  fclose(out_fp);
+  return success;
+}
+
+/* Thread writing shard files until none are left */
+void * _shard_writer(void * arg) {
+  struct shard_job * job = arg;
+  char buf[BUFSIZE], shard_filename[BUFSIZE];
+  while ( true ) {
+    pthread_mutex_lock(&job->lock);
+    int k = job->failed ? job->nshard : job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if ( k >= job->nshard )
+      return 0;
+
+    struct shard * sh = job->shards + k;
+    snprintf(shard_filename, BUFSIZE, "%s.%04d", job->prefix, k + 1);
+    int out_fd = open(shard_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = out_fd >= 0 && _copy_range(job->src_fd, out_fd, sh->start, sh->end);
+    if ( ! ok ) {
+      pthread_mutex_lock(&job->lock);
+      job->failed = true;
+      snprintf(buf, BUFSIZE, "Error writing shard %d of \"%s\" to \"%s\": %s", k + 1, job->filename, shard_filename, strerror(errno));
+      _error(buf);
+      pthread_mutex_unlock(&job->lock);
+    }
+    if ( out_fd >= 0 && close(out_fd) && ok ) {
+      pthread_mutex_lock(&job->lock);
+      job->failed = true;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+}
+
+/* Split range into nshard line-aligned shards balanced by bytes (or by
+   lines) and output one "<shard> <start> <end> <first> <last>" line
+   per shard: byte offsets [start, end) and 1-origin lines [first,
+   last].  Each boundary is found from the index plus a read of at most
+   one chunk.  With a prefix, shards are also copied to files
+   PREFIX.NNNN by nthread threads using copy_file_range.
+*/
+bool shard_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, int nshard, bool by_lines, char * prefix, int nthread, bool verbose) {
+
+  char buf[BUFSIZE];
+
+  FILE * src_fp = fopen(idx->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Resolve range as 1-origin line numbers [first, last] and offsets */
+  long long first = start > 0 ? start : 1;
+  long long last = end > 0 && end < idx->file_lines ? end : idx->file_lines;
+  long long bytes_read = 0;
+  bool success = true;
+  if ( greater_than || less_than )
+    success = _content_line_bounds(idx, src_fp, greater_than, less_than, &first, &last, &bytes_read);
+  if ( last < first )
+    last = first - 1;
+  long long range_start = 0, range_end = 0;
+  success = success && _line_offset(idx, src_fp, first, &range_start);
+  success = success && _line_offset(idx, src_fp, last + 1, &range_end);
+
+  /* Shard boundaries */
+  struct shard * shards = calloc(nshard, sizeof *shards);
+  long long prev_pos = range_start, prev_lineno = first;
+  int k;
+  for ( k = 0; k < nshard && success; k++ ) {
+    long long pos = range_end, lineno = last + 1;
+    if ( k < nshard - 1 ) {
+      if ( by_lines ) {
+        lineno = first + (last - first + 1) * (k + 1) / nshard;
+        success = _line_offset(idx, src_fp, lineno, &pos);
+      }
+      else
+        success = _offset_line(idx, src_fp, range_start + (range_end - range_start) * (k + 1) / nshard, &pos, &lineno);
+      if ( pos > range_end ) {
+        pos = range_end;
+        lineno = last + 1;
+      }
+    }
+    shards[k] = (struct shard) { prev_pos, pos, prev_lineno, lineno - 1 };
+    prev_pos = pos;
+    prev_lineno = lineno;
+  }
+  fclose(src_fp);
+
+  /* Output plan */
+  FILE * out_fp = success ? _open_output(output_file) : 0;
+  if ( ! out_fp )
+    success = false;
+  for ( k = 0; k < nshard && success; k++ )
+    fprintf(out_fp, "%d %lld %lld %lld %lld\n", k + 1, shards[k].start, shards[k].end, shards[k].first, shards[k].last);
+  if ( out_fp )
+    fclose(out_fp);
+
+  /* Write shard files in parallel */
+  if ( success && prefix ) {
+    struct shard_job job = { idx->filename_full, -1, prefix, shards, nshard, 0, false };
+    pthread_mutex_init(&job.lock, 0);
+    job.src_fd = open(idx->filename_full, O_RDONLY);
+    if ( job.src_fd < 0 ) {
+      sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+      _error(buf);
+      success = _error(strerror(errno));
+    }
+    else {
+      if ( nthread > nshard )
+        nthread = nshard;
+      pthread_t * threads = malloc(nthread * sizeof *threads);
+      int t;
+      for ( t = 0; t < nthread; t++ )
+        pthread_create(threads + t, 0, _shard_writer, &job);
+      for ( t = 0; t < nthread; t++ )
+        pthread_join(threads[t], 0);
+      free(threads);
+      close(job.src_fd);
+      success = ! job.failed;
+      if ( success && verbose ) {
+        sprintf(buf, "Wrote %d shards of \"%s\" to \"%s.NNNN\" with %d threads", nshard, idx->filename_full, prefix, nthread);
+        _error(buf);
+      }
+    }
+    pthread_mutex_destroy(&job.lock);
+  }
+
+  free(shards);
+  return success;
+}
+
+int _cmp_str(const void * a, const void * b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Read partition boundary keys, one per line, from file fn.  Returns
+   them sorted without duplicates or empty lines, or null on error.
+*/
+char ** _read_bounds(char * fn, int * nbound_p) {
+  char buf[BUFSIZE];
+  FILE * fp = fopen(fn, "r");
+  if ( ! fp ) {
+    sprintf(buf, "Cannot read boundaries file \"%s\":", fn);
+    _error(buf);
+    _error(strerror(errno));
+    return 0;
+  }
+  char ** bounds = 0;
+  int nbound = 0, maxbound = 0;
+  char * line = 0;
+  size_t linecap = 0;
+  ssize_t nread;
+  while ( (nread = getline(&line, &linecap, fp)) > 0 ) {
+    if ( line[nread-1] == '\n' )
+      line[--nread] = '\0';
+    if ( ! nread )
+      continue;
+    if ( nbound == maxbound ) {
+      maxbound = maxbound ? maxbound * 2 : DEFAULT_INDEX_ENTRY_ALLOC;
+      bounds = realloc(bounds, maxbound * sizeof *bounds);
+    }
+    bounds[nbound++] = strdup(line);
+  }
+  free(line);
+  fclose(fp);
+  qsort(bounds, nbound, sizeof *bounds, _cmp_str);
+  int i, ndistinct = 0;
+  for ( i = 0; i < nbound; i++ ) {
+    if ( ndistinct && ! strcmp(bounds[i], bounds[ndistinct-1]) )
+      free(bounds[i]);
+    else
+      bounds[ndistinct++] = bounds[i];
+  }
+  *nbound_p = ndistinct;
+  return bounds ? bounds : calloc(1, sizeof *bounds);
+}
+
+/* Get label of partition holding line or fragment s of length n: its
+   leading keylen bytes, else the greatest boundary it is at or after
+   ("" if before all).  Lines are in the same partition exactly when
+   their labels are equal.
+*/
+long _partition_label(struct records * rec, long keylen, char ** bounds, int nbound, unsigned char * s, long n, unsigned char ** label_p) {
+  if ( keylen ) {
+    n = _record_key_len(rec, s, n);
+    *label_p = s;
+    return n < keylen ? n : keylen;
+  }
+  int lo = 0, hi = nbound - 1, found = -1;
+  while ( lo <= hi ) {
+    int mid = (lo + hi) / 2;
+    if ( strncmp(s, bounds[mid], strlen(bounds[mid])) >= 0 ) {
+      found = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+  *label_p = found >= 0 ? (unsigned char *) bounds[found] : (unsigned char *) "";
+  return found >= 0 ? strlen(bounds[found]) : 0;
+}
+
+/* Start a new partition with given label at offset pos and 1-origin
+   line lineno, closing any previous partition file and opening the
+   next if writing files */
+bool _partition_start(struct partition ** parts_p, int * nparts_p, int * maxparts_p, unsigned char * label, long nlabel, long long pos, long long lineno, char * prefix, FILE ** part_fp_p) {
+  char buf[BUFSIZE], part_filename[BUFSIZE];
+  if ( *nparts_p == *maxparts_p ) {
+    *maxparts_p = *maxparts_p ? *maxparts_p * 2 : DEFAULT_INDEX_ENTRY_ALLOC;
+    *parts_p = realloc(*parts_p, *maxparts_p * sizeof **parts_p);
+  }
+  unsigned char * copy = malloc(nlabel + 1);
+  memcpy(copy, label, nlabel);
+  copy[nlabel] = '\0';
+  (*parts_p)[(*nparts_p)++] = (struct partition) { pos, pos, lineno, lineno - 1, copy };
+
+  if ( ! prefix )
+    return true;
+  if ( *part_fp_p && fclose(*part_fp_p) ) {
+    *part_fp_p = 0;
+    return _error(strerror(errno));
+  }
+  snprintf(part_filename, BUFSIZE, "%s.%04d", prefix, *nparts_p);
+  *part_fp_p = fopen(part_filename, "wb");
+  if ( ! *part_fp_p ) {
+    sprintf(buf, "Cannot write partition file \"%s\":", part_filename);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+  return true;
+}
+
+/* Partition range by key (leading keylen bytes) or at sorted boundary
+   keys, in one sequential pass, outputting one line per partition:
+   "<partition> <start> <end> <first_line> <last_line> <key>".  Chunks
+   whose bounding index entries show them to lie in one partition are
+   not parsed, and with a prefix are copied whole to partition files
+   PREFIX.NNNN.
+*/
+bool partition_file(struct hindex * idx, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long keylen, char ** bounds, int nbound, char * prefix, bool verbose) {
+
+  char buf[BUFSIZE];
+
+  /* Partitions must be resolvable from index fragments */
+  long need_snaplen = keylen;
+  int i;
+  for ( i = 0; i < nbound; i++ )
+    if ( strlen(bounds[i]) > need_snaplen )
+      need_snaplen = strlen(bounds[i]);
+  if ( idx->snaplen <= 0 || need_snaplen > idx->snaplen ) {
+    sprintf(buf, "ERROR: Partition key of %ld bytes, but \"%s\" was not indexed with -P/--snaplen of at least that", need_snaplen, idx->index_filename);
+    return _error(buf);
+  }
+
+  FILE * src_fp = fopen(idx->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+
+  /* Resolve range as 1-origin line numbers [first, last] and offsets */
+  long long first = start > 0 ? start : 1;
+  long long last = end > 0 && end < idx->file_lines ? end : idx->file_lines;
+  long long bytes_read = 0;
+  bool success = true;
+  if ( greater_than || less_than )
+    success = _content_line_bounds(idx, src_fp, greater_than, less_than, &first, &last, &bytes_read);
+  if ( last < first )
+    last = first - 1;
+  long long range_start = 0, range_end = 0;
+  success = success && _line_offset(idx, src_fp, first, &range_start);
+  success = success && _line_offset(idx, src_fp, last + 1, &range_end);
+
+  /* Walk chunks from start to end of range */
+  struct partition * parts = 0;
+  int nparts = 0, maxparts = 0;
+  FILE * part_fp = 0;
+  long long pos = range_start, lineno = first, fp_pos = -1, bytes_copied = 0;
+  while ( success && pos < range_end ) {
+    int ient = _find_pos_entry(idx, pos);
+    struct entry next = idx->entries[ient + 1];
+    unsigned char * frag = ient >= 0 ? idx->entries[ient].frag : 0;
+    unsigned char * label;
+    long nlabel;
+    struct partition * part = nparts ? parts + nparts - 1 : 0;
+
+    /* Whole chunk in one partition: copy without parsing lines */
+    if ( frag && next.frag && next.filepos <= range_end ) {
+      unsigned char * next_label;
+      nlabel = _partition_label(&idx->rec, keylen, bounds, nbound, frag, strlen(frag), &label);
+      long nnext = _partition_label(&idx->rec, keylen, bounds, nbound, next.frag, strlen(next.frag), &next_label);
+      if ( nlabel == nnext && ! memcmp(label, next_label, nlabel) ) {
+        if ( ! part || strlen(part->label) != nlabel || memcmp(part->label, label, nlabel) ) {
+          success = _partition_start(&parts, &nparts, &maxparts, label, nlabel, pos, lineno, prefix, &part_fp);
+          part = parts + nparts - 1;
+        }
+        if ( success && part_fp ) {
+          success = ! fflush(part_fp) && _copy_range(fileno(src_fp), fileno(part_fp), pos, next.filepos);
+          if ( ! success )
+            _error(strerror(errno));
+        }
+        bytes_copied += next.filepos - pos;
+        pos = part->end = next.filepos;
+        lineno = next.lineno + 1;
+        part->last = next.lineno;
+        fp_pos = -1;
+        continue;
+      }
+    }
+
+    /* Else read lines of the chunk in range */
+    long long chunk_end = next.filepos < range_end ? next.filepos : range_end;
+    if ( fp_pos != pos && fseeko(src_fp, pos, SEEK_SET) ) {
+      sprintf(buf, "Error seeking to position %lld in file \"%s\":", pos, idx->filename_full);
+      _error(buf);
+      success = _error(strerror(errno));
+      break;
+    }
+    while ( success && pos < chunk_end ) {
+      long nread = 0;
+      bool more = false;
+      unsigned char * line = _read_head(src_fp, &idx->rec, need_snaplen, &nread, &more);
+      if ( ! nread )
+        break;
+      nlabel = _partition_label(&idx->rec, keylen, bounds, nbound, line, nread, &label);
+      if ( ! part || strlen(part->label) != nlabel || memcmp(part->label, label, nlabel) ) {
+        success = _partition_start(&parts, &nparts, &maxparts, label, nlabel, pos, lineno, prefix, &part_fp);
+        part = parts + nparts - 1;
+      }
+      long long nrest = 0;
+      FILE * copy_fp = success ? part_fp : 0;
+      bool wrote = ! copy_fp || fwrite(line, 1, nread, copy_fp) == nread;
+      wrote = _read_rest(src_fp, &idx->rec, more, 0, copy_fp, &nrest) && wrote;
+      if ( ! wrote ) {
+        sprintf(buf, "Error writing partition %d of \"%s\":", nparts, idx->filename_full);
+        _error(buf);
+        success = _error(strerror(errno));
+      }
+      bytes_read += nread + nrest;
+      pos += nread + nrest;
+      part->end = pos;
+      part->last = lineno;
+      lineno += 1;
+    }
+    fp_pos = pos;
+  }
+  if ( part_fp && fclose(part_fp) && success ) {
+    sprintf(buf, "Error writing partition %d of \"%s\":", nparts, idx->filename_full);
+    _error(buf);
+    success = _error(strerror(errno));
+  }
+  fclose(src_fp);
+
+  /* Output plan */
+  FILE * out_fp = success ? _open_output(output_file) : 0;
+  if ( ! out_fp )
+    success = false;
+  for ( i = 0; i < nparts && success; i++ )
+    fprintf(out_fp, "%d %lld %lld %lld %lld %s\n", i + 1, parts[i].start, parts[i].end, parts[i].first, parts[i].last, parts[i].label);
+  if ( out_fp )
+    fclose(out_fp);
+
+  if ( success && verbose ) {
+    char buf2[BUFSIZE];
+    strcpy(buf2, _out_size(bytes_read, 0));
+    sprintf(buf, "Partitioned \"%s\" into %d parts, parsed %s bytes and copied %s bytes in whole chunks", idx->filename_full, nparts, buf2, _out_size(bytes_copied, 0));
+    _error(buf);
+  }
+
+  for ( i = 0; i < nparts; i++ )
+    free(parts[i].label);
+  free(parts);
+  return success;
+}
+
+/* Compare current lines of two merge inputs on leading keylen bytes
+   (never including the newline or record delimiter).  Ties go to the earlier input so
+   equal keys keep command line order of files.
+*/
+int _merge_cmp(struct merge_input * ins, int a, int b, long keylen) {
+  struct merge_input * in_a = ins + a;
+  struct merge_input * in_b = ins + b;
+  long len_a = _record_key_len(&in_a->idx->rec, in_a->line, in_a->linelen < keylen ? in_a->linelen : keylen);
+  long len_b = _record_key_len(&in_b->idx->rec, in_b->line, in_b->linelen < keylen ? in_b->linelen : keylen);
+  int cmp = memcmp(in_a->line, in_b->line, len_a < len_b ? len_a : len_b);
+  if ( ! cmp )
+    cmp = len_a < len_b ? -1 : len_a > len_b ? 1 : 0;
+  if ( ! cmp )
+    cmp = a < b ? -1 : a > b ? 1 : 0;
+  return cmp;
+}
+
+/* Restore heap order of merge inputs downward from heap position i */
+void _merge_sift_down(int * heap, int nheap, int i, struct merge_input * ins, long keylen) {
+  while ( true ) {
+    int least = i;
+    int left = 2*i + 1, right = 2*i + 2;
+    if ( left < nheap && _merge_cmp(ins, heap[left], heap[least], keylen) < 0 )
+      least = left;
+    if ( right < nheap && _merge_cmp(ins, heap[right], heap[least], keylen) < 0 )
+      least = right;
+    if ( least == i )
+      return;
+    int tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+/* Advance merge input to its next line in the content range.  Return
+   false when input is exhausted (EOF or past the max content filter).
+*/
+bool _merge_next(struct merge_input * in, unsigned char * greater_than, unsigned char * less_than) {
+  int nless_than = less_than ? strlen(less_than) : 0;
+  long long pos = 0;
+  while ( true ) {
+    long nread = 0;
+    bool more = false;
+    unsigned char * head = _read_head(in->fp, &in->idx->rec, 0, &nread, &more);
+    if ( nread <= 0 )
+      return false;
+    /* Keep the head, as the next input read reuses the buffer */
+    if ( ! in->line )
+      in->line = malloc(LINE_BLOCK_SIZE + 1);
+    memcpy(in->line, head, nread + 1);
+    in->linelen = nread;
+    in->more = more;
+    in->lineno += 1;
+
+    /* Input is sorted, so nothing further is in range */
+    if ( less_than && strncmp(in->line, less_than, nless_than) > 0 )
+      return false;
+
+    /* Skip if not yet reached the min content filter */
+    if ( greater_than && strcmp(in->line, greater_than) < 0 ) {
+      _read_rest(in->fp, &in->idx->rec, more, 0, 0, &pos);
+      continue;
+    }
+    return true;
+  }
+}
+
+/* Merge content range of several sorted, indexed files into a single
+   ordered output.  Each input seeks via its own index to the -G value,
+   then a heap of inputs ordered on their current line's leading key
+   (the smallest snap len among the indexes) is drained until -L or -N.
+*/
+bool merge_files(struct hindex * idxs, int nidx, char * output_file, unsigned char * greater_than, unsigned char * less_than, long long count, bool line_number, bool verbose) {
+  char buf[BUFSIZE];
+
+  /* Handle zero count and empty input cases */
+  if ( count == 0 || nidx <= 0 )
+    return true;
+  if ( greater_than && less_than && strcmp(greater_than, less_than) > 0 )
+    return true;
+
+  /* Merge key is the leading portion of lines all files are sorted on */
+  long keylen = 0;
+  int i;
+  for ( i=0; i < nidx; i++ ) {
+    if ( idxs[i].snaplen <= 0 ) {
+      sprintf(buf, "ERROR: -M/--merge given, but \"%s\" does not appear to have been indexed with -P/--snaplen", idxs[i].index_filename);
+      return _error(buf);
+    }
+    if ( ! keylen || idxs[i].snaplen < keylen )
+      keylen = idxs[i].snaplen;
+    if ( idxs[i].rec.start ) {
+      sprintf(buf, "ERROR: Cannot merge \"%s\" with -M, its records begin at lines matching -J \"%s\"", idxs[i].filename_full, idxs[i].rec.start);
+      return _error(buf);
+    }
+  }
+
+  /* Open each input at its starting offset, with its own readahead buffer */
+  struct merge_input * ins = calloc(nidx, sizeof *ins);
+  int * heap = malloc(nidx * sizeof *heap);
+  int nheap = 0;
+  bool success = true;
+  for ( i=0; i < nidx && success; i++ ) {
+    struct merge_input * in = ins + i;
+    in->idx = idxs + i;
+    long long line_start = 0;
+    if ( ! _find_start_entry(in->idx, 0, greater_than, &line_start, &in->lineno) ) {
+      success = false;
+      break;
+    }
+    in->fp = fopen(in->idx->filename_full, "rb");
+    if ( ! in->fp ) {
+      sprintf(buf, "Cannot read data file \"%s\":", in->idx->filename_full);
+      _error(buf);
+      success = _error(strerror(errno));
+      break;
+    }
+    in->iobuf = malloc(MERGE_READAHEAD_SIZE);
+    setvbuf(in->fp, in->iobuf, _IOFBF, MERGE_READAHEAD_SIZE);
+    posix_fadvise(fileno(in->fp), line_start, 0, POSIX_FADV_SEQUENTIAL);
+    if ( line_start && fseeko(in->fp, line_start, SEEK_SET) ) {
+      sprintf(buf, "Error seeking to position %lld in file \"%s\":", line_start, in->idx->filename_full);
+      _error(buf);
+      success = _error(strerror(errno));
+      break;
+    }
+    if ( verbose ) {
+      sprintf(buf, "Merging \"%s\" from line %s", in->idx->filename_full, _out_size(in->lineno + 1, 0));
+      _error(buf);
+    }
+
+    /* Prime heap with first line in range */
+    if ( _merge_next(in, greater_than, less_than) )
+      heap[nheap++] = i;
+  }
+
+  FILE * out_fp = success ? _open_output(output_file) : 0;
+  if ( ! out_fp )
+    success = false;
+  struct outbuf ob;
+  if ( out_fp )
+    ob_init(&ob, out_fp);
+
+  /* Heapify, then repeatedly emit least line and advance its input */
+  int h;
+  for ( h = nheap/2 - 1; success && h >= 0; h-- )
+    _merge_sift_down(heap, nheap, h, ins, keylen);
+  long long noutput = 0;
+  while ( success && nheap > 0 ) {
+    if ( count >= 0 && noutput >= count )
+      break;
+    struct merge_input * in = ins + heap[0];
+
+    /* Output line */
+    if ( line_number )
+      ob_lineno(&ob, in->lineno);
+    long long nrest = 0;
+    if ( ! ob_write(&ob, in->line, in->linelen) || ! _read_rest(in->fp, &in->idx->rec, in->more, &ob, 0, &nrest) ) {
+      sprintf(buf, "Error writing %lld bytes to output \"%s\":", in->linelen + nrest, output_file ? output_file : "-");
+      success = _error(buf);
+      break;
+    }
+    noutput += 1;
+
+    if ( ! _merge_next(in, greater_than, less_than) )
+      heap[0] = heap[--nheap];
+    _merge_sift_down(heap, nheap, 0, ins, keylen);
+  }
+
+  for ( i=0; i < nidx; i++ ) {
+    if ( ins[i].fp )
+      fclose(ins[i].fp);
+    free(ins[i].iobuf);
+    free(ins[i].line);
+  }
+  free(ins);
+  free(heap);
+  if ( out_fp && ! ob_finish(&ob) && success )
+    success = _error("Error writing output:");
+  if ( out_fp && ! _close_output(out_fp, output_file) )
+    success = false;
+  return success;
+}
+
+/* Parse one -I batch line into r: "START [END]" line numbers, or
+   "MINVAL<tab>MAXVAL" content bounds, either of which may be empty */
+bool _parse_batch_line(char * line, struct batch_range * r) {
+  memset(r, 0, sizeof *r);
+  r->spec = strdup(line);
+  char * tab = strchr(line, '\t');
+  if ( tab ) {
+    *tab = '\0';
+    if ( *line )
+      r->greater_than = strdup(line);
+    if ( tab[1] )
+      r->less_than = strdup(tab + 1);
+    return true;
+  }
+  char * endp = 0;
+  r->start = strtoll(line, &endp, 10);
+  if ( endp == line || r->start <= 0 )
+    return false;
+  while ( *endp == ' ' )
+    endp++;
+  if ( *endp ) {
+    char * p = endp;
+    r->end = strtoll(p, &endp, 10);
+    if ( endp == p || r->end <= 0 )
+      return false;
+    while ( *endp == ' ' )
+      endp++;
+  }
+  return ! *endp;
+}
+
+/* Read -I batch of ranges from file fn ("-" for stdin), skipping
+   empty lines and # comments */
+struct batch_range * read_batch(char * fn, int * nrange_p) {
+  char buf[BUFSIZE];
+  FILE * fp = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+  if ( ! fp ) {
+    sprintf(buf, "Cannot read batch file \"%s\":", fn);
+    _error(buf);
+    _error(strerror(errno));
+    return 0;
+  }
+  struct batch_range * ranges = 0;
+  int nrange = 0, maxrange = 0, nline = 0;
+  char * line = 0;
+  size_t linecap = 0;
+  ssize_t nread;
+  bool ok = true;
+  while ( ok && (nread = getline(&line, &linecap, fp)) > 0 ) {
+    nline++;
+    if ( line[nread-1] == '\n' )
+      line[--nread] = '\0';
+    if ( ! nread || line[0] == '#' )
+      continue;
+    if ( nrange == maxrange ) {
+      maxrange = maxrange ? maxrange * 2 : 64;
+      ranges = realloc(ranges, maxrange * sizeof *ranges);
+    }
+    if ( ! (ok = _parse_batch_line(line, ranges + nrange++)) ) {
+      sprintf(buf, "Invalid range \"%s\" on line %d of batch file \"%s\", expected START [END] or MINVAL<tab>MAXVAL", ranges[nrange-1].spec, nline, fn);
+      _error(buf);
+    }
+  }
+  free(line);
+  if ( fp != stdin )
+    fclose(fp);
+  if ( ! ok )
+    return 0;
+  *nrange_p = nrange;
+  return ranges ? ranges : calloc(1, sizeof *ranges);
+}
+
+/* Order indexes of batch ranges (given as arg) by starting offset */
+int _cmp_batch_pos(const void * a, const void * b, void * arg) {
+  struct batch_range * ranges = arg;
+  long long pa = ranges[*(int *) a].pos, pb = ranges[*(int *) b].pos;
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* Write lines of data, len bytes holding whole lines numbered from
+   *lineno_p on, with -n numbers and -a/-w projection, advancing
+   *lineno_p past them.  At most *left_p lines are written unless it is
+   negative, and it is decreased by those written */
+bool _emit_lines(struct outbuf * ob, struct records * rec, unsigned char * data, long long len, long long * lineno_p, long long * left_p, bool line_number, struct projection * proj) {
+  if ( ! line_number && ! proj && *left_p < 0 )
+    return ob_write(ob, data, len);
+  unsigned char * p = data, * data_end = data + len;
+  while ( p < data_end && *left_p ) {
+    long nread = _record_len(rec, p, data_end - p, true);
+    unsigned char * line = p;
+    long long lineno = (*lineno_p)++;
+    p += nread;
+    int nfound = 0;
+    if ( proj ) {
+      nfound = _split_fields(proj, line, nread);
+      if ( ! _match_predicates(proj, line, nfound) )
+        continue;
+    }
+    if ( *left_p > 0 )
+      (*left_p)--;
+    if ( line_number )
+      ob_lineno(ob, lineno);
+    if ( ! (proj && proj->nfield ? _write_projected(proj, line, nfound, ob) : ob_write(ob, line, nread)) )
+      return false;
+  }
+  return true;
+}
+
+/* Output one resolved batch range, at most count lines of it unless
+   count is negative: from memory if read by the coalesced pass, else
+   copied whole or read in blocks of whole lines.  A line or record
+   longer than a block is written as it is read, block by block, unless
+   projected, when it is read on into a growing buffer */
+bool _emit_batch_range(struct outbuf * ob, struct records * rec, int src_fd, struct batch_range * r, long long count, bool line_number, struct projection * proj) {
+  long long lineno = r->first;
+  if ( r->data )
+    return _emit_lines(ob, rec, r->data, r->endpos - r->pos, &lineno, &count, line_number, proj);
+  if ( ! line_number && ! proj && count < 0 && ob->fd >= 0 )
+    return ob_flush(ob) && _copy_range(src_fd, ob->fd, r->pos, r->endpos);
+  size_t cap = LINE_BLOCK_SIZE, have = 0;
+  unsigned char * cbuf = malloc(cap);
+  long long pos = r->pos;
+  bool ok = true, rest = false, in_line = false, ended = false;
+  STATS_ADD(seeks, 1);
+  while ( ok && pos < r->endpos && (count || rest) ) {
+    /* Read on after the bytes left over from the last block */
+    size_t want = r->endpos - pos < cap ? r->endpos - pos : cap;
+    if ( have < want ) {
+      ssize_t got = pread(src_fd, cbuf + have, want - have, pos + have);
+      if ( got <= 0 ) {
+        ok = false;
+        break;
+      }
+      STATS_ADD(bytes_read, got);
+      have += got;
+    }
+    long n = have;
+    bool at_end = pos + n >= r->endpos;
+    if ( ! rest && ! at_end ) {
+      long whole = _records_whole(rec, cbuf, n);
+      if ( ! whole && proj ) {
+        cap *= 2;
+        cbuf = realloc(cbuf, cap);
+        continue;
+      }
+      if ( whole )
+        n = whole;
+      else {
+        if ( line_number )
+          ok = ob_lineno(ob, lineno);
+        lineno++;
+        if ( count > 0 )
+          count--;
+        rest = in_line = true;
+      }
+    }
+    if ( rest ) {
+      n = _record_rest(rec, cbuf, n, at_end, &in_line, &ended);
+      ok = ok && ob_write(ob, cbuf, n);
+      rest = ! ended;
+    }
+    else
+      ok = _emit_lines(ob, rec, cbuf, n, &lineno, &count, line_number, proj);
+    memmove(cbuf, cbuf + n, have - n);
+    have -= n;
+    pos += n;
+  }
+  free(cbuf);
+  return ok;
+}
+
+/* Output a batch of ranges of the file in request order, each preceded
+   by a "==> N: RANGE <==" line, or each to its own file PREFIX.NNNN.
+   All ranges are resolved against the index up front.  Sorted by
+   offset, overlapping and adjacent ranges are merged into spans, and
+   if the spans total at most BATCH_BUFFER_SIZE bytes they are read
+   once in file order and the ranges output from memory.
+*/
+bool batch_file(struct hindex * idx, char * output_file, struct batch_range * ranges, int nrange, long long count, bool line_number, struct projection * proj, char * prefix, bool verbose) {
+
+  char buf[BUFSIZE], range_filename[BUFSIZE];
+
+  /* Projected records end as in the file */
+  if ( proj )
+    proj->eol = idx->rec.delim;
+
+  /* With -w predicates the count limits lines output, not the range,
+     so ranges are read only as far as needed, never coalesced */
+  long long range_count = proj && proj->npred ? -1 : count;
+  long long emit_count = proj && proj->npred ? count : -1;
+
+  FILE * src_fp = fopen(idx->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
+    _error(buf);
+    return _error(strerror(errno));
+  }
+  int src_fd = fileno(src_fp);
+
+  /* Resolve ranges to offsets */
+  bool success = true;
+  int i;
+  stats_phase(STATS_SEEK);
+  for ( i = 0; i < nrange && success; i++ ) {
+    struct batch_range * r = ranges + i;
+    r->data = 0;
+    if ( (r->greater_than || r->less_than) && idx->snaplen <= 0 && idx->nentry > 1 ) {
+      sprintf(buf, "ERROR: batch range \"%s\" is by content, but \"%s\" does not appear to have been indexed with -P/--snaplen", r->spec, idx->index_filename);
+      success = _error(buf);
+      break;
+    }
+    success = _range_offsets(idx, src_fp, r->start, r->end, r->greater_than, r->less_than, range_count, &r->first, &r->last, &r->pos, &r->endpos);
+  }
+
+  /* Merge into spans in file order and read them if they fit */
+  int * order = malloc((nrange + 1) * sizeof *order);
+  for ( i = 0; i < nrange; i++ )
+    order[i] = i;
+  qsort_r(order, nrange, sizeof *order, _cmp_batch_pos, ranges);
+  long long total = 0, span_start = -1, span_end = -1;
+  int nspan = 0;
+  for ( i = 0; i < nrange; i++ ) {
+    struct batch_range * r = ranges + order[i];
+    if ( r->endpos <= r->pos )
+      continue;
+    if ( r->pos > span_end ) {
+      total += span_end - span_start;
+      span_start = r->pos;
+      span_end = r->endpos;
+      nspan++;
+    }
+    else if ( r->endpos > span_end )
+      span_end = r->endpos;
+  }
+  if ( nspan )
+    total += span_end - span_start;
+  unsigned char * data = 0;
+  stats_phase(STATS_SCAN);
+  if ( success && nspan && total <= BATCH_BUFFER_SIZE && emit_count < 0 ) {
+    data = malloc(total);
+    long long used = 0;
+    span_end = -1;
+    for ( i = 0; i < nrange && success; i++ ) {
+      struct batch_range * r = ranges + order[i];
+      if ( r->endpos <= r->pos )
+        continue;
+      if ( r->pos > span_end ) {
+        span_start = r->pos;
+        span_end = r->pos;
+        STATS_ADD(seeks, 1);
+      }
+      if ( r->endpos > span_end ) {
+        long long n = r->endpos - span_end;
+        if ( pread(src_fd, data + used, n, span_end) != n ) {
+          sprintf(buf, "Error reading %lld bytes at offset %lld of \"%s\":", n, span_end, idx->filename_full);
+          _error(buf);
+          success = _error(strerror(errno));
+        }
+        STATS_ADD(bytes_read, n);
+        used += n;
+        span_end = r->endpos;
+      }
+      r->data = data + used - (span_end - r->pos);
+    }
+  }
+
+  /* Output in request order */
+  FILE * out_fp = 0;
+  struct outbuf ob;
+  stats_phase(STATS_OUTPUT);
+  if ( success && ! prefix ) {
+    if ( (out_fp = _open_output(output_file)) )
+      ob_init(&ob, out_fp);
+    else
+      success = false;
+  }
+  for ( i = 0; i < nrange && success; i++ ) {
+    struct batch_range * r = ranges + i;
+    if ( prefix ) {
+      snprintf(range_filename, BUFSIZE, "%s.%04d", prefix, i + 1);
+      if ( ! (out_fp = _open_output(range_filename)) ) {
+        success = false;
+        break;
+      }
+      ob_init(&ob, out_fp);
+    }
+    else {
+      snprintf(buf, BUFSIZE, "==> %d: %s <==\n", i + 1, r->spec);
+      ob_write(&ob, buf, strlen(buf));
+    }
+    if ( ! _emit_batch_range(&ob, &idx->rec, src_fd, r, emit_count, line_number, proj) ) {
+      sprintf(buf, "Error writing range %d \"%s\" of \"%s\" to output:", i + 1, r->spec, idx->filename_full);
+      _error(buf);
+      success = _error(strerror(errno));
+    }
+    if ( prefix ) {
+      success = ob_finish(&ob) && success;
+      success = _close_output(out_fp, range_filename) && success;
+      out_fp = 0;
+    }
+  }
+  if ( out_fp ) {
+    success = ob_finish(&ob) && success;
+    success = _close_output(out_fp, output_file) && success;
+  }
+
+  if ( verbose ) {
+    sprintf(buf, "Batch of %d ranges in \"%s\": %d spans, ", nrange, idx->filename_full, nspan);
+    strcat(buf, _out_size(total, 0));
+    strcat(buf, data ? " bytes read once in file order" : " bytes read per range");
+    _error(buf);
+  }
+
+  free(data);
+  free(order);
+  fclose(src_fp);
+  return success;
+}
+
+/* Free entries and records of idx, leaving it to be loaded again */
+void clear_hindex(struct hindex * idx) {
+  _reset_entries(idx);
+  records_free(&idx->rec);
+}
+
+/* Free index loaded or built into heap-allocated idx */
+void free_hindex(struct hindex * idx) {
+  clear_hindex(idx);
+  free(idx);
+}
+
+/* Replace the published index snapshot of f with snap, RCU style:
+   readers load the pointer without locking after recording the epoch
+   they started in, so once the epoch is advanced past the swap the old
+   snapshot is freed as soon as no reader from an earlier epoch is
+   still active. */
+void _daemon_publish(struct daemon * d, struct daemon_file * f, struct hindex * snap) {
+  struct hindex * old = atomic_exchange(&f->snap, snap);
+  unsigned long epoch = atomic_fetch_add(&d->epoch, 1) + 1;
+  int i;
+  for ( i = 0; i < d->nworker; i++ ) {
+    while ( true ) {
+      unsigned long active = atomic_load(&d->reader_epoch[i]);
+      if ( ! active || active >= epoch )
+        break;
+      struct timespec ts = { 0, 1000000 };
+      nanosleep(&ts, 0);
+    }
+  }
+  if ( old )
+    free_hindex(old);
+}
+
+/* Thread refreshing indexes of served files that changed */
+void * _daemon_refresher(void * arg) {
+  struct daemon * d = arg;
+  char buf[BUFSIZE];
+  while ( true ) {
+    sleep(DAEMON_REFRESH_SECONDS);
+    int i;
+    for ( i = 0; i < d->nfile; i++ ) {
+      struct daemon_file * f = d->files + i;
+      struct hindex * cur = atomic_load(&f->snap);
+      long long size = -1;
+      long double mtime = 0;
+      _get_file_size_mtime(f->filename_full, &size, &mtime);
+      if ( size == cur->file_size && mtime == cur->file_mtime )
+        continue;
+      if ( size == f->failed_size && mtime == f->failed_mtime )
+        continue;
+      struct hindex * snap = malloc(sizeof *snap);
+      if ( index_file(snap, f->filename_full, f->index_filename, d->chunk_size, 0, 0, true, false, false, false, false) ) {
+        _daemon_publish(d, f, snap);
+        if ( d->verbose ) {
+          sprintf(buf, "Refreshed index on \"%s\", %s lines", f->filename_full, _out_size(snap->file_lines, 0));
+          _error(buf);
+        }
+      }
+      else {
+        /* Keep serving the last good snapshot until the file changes */
+        free_hindex(snap);
+        f->failed_size = size;
+        f->failed_mtime = mtime;
       }
-      int ncmp = ent.frag ? _min_of(ngreater, strlen(ent.frag)) : ngreater;
-      if ( ! ent.frag || strncmp(greater_than, ent.frag, ncmp) <= 0 )
-        break;
-      line_start = ent.filepos;
-      lineno = ent.lineno;
     }
   }
+  return 0;
+}
 
-  /* Open source for read */
-  FILE * src_fp = fopen(idx->filename_full, "rb");
-  if ( ! src_fp ) {
-    sprintf(buf, "Cannot read data file \"%s\":", idx->filename_full);
-    _error(buf);
-    return _error(strerror(errno));
+/* Send "ERROR message" reply to client, returning false */
+bool _daemon_reply_error(int fd, char * msg) {
+  char buf[BUFSIZE];
+  snprintf(buf, BUFSIZE, "ERROR %s\n", msg);
+  ssize_t nwrote = write(fd, buf, strlen(buf));
+  (void) nwrote;
+  return false;
+}
+
+/* Answer one query on connection fd, reading from the current index
+   snapshot of the file asked for.  The request is lines "KEY VALUE"
+   ending with an empty line, keys being the letters of the search
+   options: F (file, required), S, E, G, L, N, and n (no value). */
+bool _daemon_serve(struct daemon * d, int slot, int fd) {
+  char req[BUFSIZE], buf[BUFSIZE];
+  size_t nreq = 0;
+  while ( nreq < BUFSIZE - 1 ) {
+    ssize_t n = read(fd, req + nreq, BUFSIZE - 1 - nreq);
+    if ( n <= 0 )
+      break;
+    nreq += n;
+    req[nreq] = '\0';
+    if ( strstr(req, "\n\n") )
+      break;
   }
+  req[nreq] = '\0';
+  if ( ! strstr(req, "\n\n") )
+    return _daemon_reply_error(fd, "Incomplete request");
 
-  /* Read lines from file */
-  long long noutput = 0;
-  FILE * out_fp = 0;
-  if ( output_file && strcmp(output_file, "-") != 0 ) {
-    out_fp = fopen(output_file, "wb");
-    if ( ! out_fp ) {
-      sprintf(buf, "Cannot write output file \"%s\":", output_file);
-      _error(buf);
-      return _error(strerror(errno));
+  struct batch_range r;
+  memset(&r, 0, sizeof r);
+  char * filename = 0;
+  long long count = -1;
+  bool line_number = false, valid = true;
+  char * line = req, * nl;
+  errno = 0;
+  while ( valid && (nl = strchr(line, '\n')) && nl != line ) {
+    *nl = '\0';
+    char * value = line[1] == ' ' ? line + 2 : "";
+    switch ( line[0] ) {
+    case 'F': filename = value; break;
+    case 'S': r.start = _convert_ll(value, &valid); break;
+    case 'E': r.end = _convert_ll(value, &valid); break;
+    case 'G': r.greater_than = value; break;
+    case 'L': r.less_than = value; break;
+    case 'N': count = _convert_ll(value, &valid); break;
+    case 'n': line_number = true; break;
+    default: valid = false;
     }
+    line = nl + 1;
+  }
+  if ( ! valid || ! filename )
+    return _daemon_reply_error(fd, "Malformed request");
+  struct daemon_file * f = 0;
+  int i;
+  for ( i = 0; i < d->nfile && ! f; i++ )
+    if ( ! strcmp(d->files[i].filename_full, filename) )
+      f = d->files + i;
+  if ( ! f ) {
+    snprintf(buf, BUFSIZE, "File \"%s\" not served", filename);
+    return _daemon_reply_error(fd, buf);
   }
-  else
-    out_fp = stdout;
 
-  /* Go to initial position */
-  if ( line_start ) {
-    int seek_error = fseek(src_fp, line_start, SEEK_SET);
-    if ( seek_error ) {
-      sprintf(buf, "Error seeking to position %lld in file \"%s\":", line_start, idx->filename_full);
-      _error(buf);
-      fclose(src_fp);
-      fclose(out_fp);
-      return false;
-    }
+  FILE * src_fp = fopen(f->filename_full, "rb");
+  if ( ! src_fp ) {
+    snprintf(buf, BUFSIZE, "Cannot read data file \"%s\": %s", f->filename_full, strerror(errno));
+    return _daemon_reply_error(fd, buf);
   }
 
-  /* Copy out lines until limit reached */
-  int nless_than = less_than ? strlen(less_than) : 0;
-  while ( true ) {
+  /* Read side: never blocks, pins the snapshot until epoch is cleared */
+  atomic_store(&d->reader_epoch[slot], atomic_load(&d->epoch));
+  struct hindex * snap = atomic_load(&f->snap);
+  bool success = true;
+  if ( (r.greater_than || r.less_than) && snap->snaplen <= 0 && snap->nentry > 1 ) {
+    snprintf(buf, BUFSIZE, "Content search, but \"%s\" was not indexed with -P", f->filename_full);
+    success = _daemon_reply_error(fd, buf);
+  }
+  else if ( count != 0 && ! (r.start > 0 && r.end > 0 && r.start > r.end) ) {
+    success = _range_offsets(snap, src_fp, r.start, r.end, r.greater_than, r.less_than, count, &r.first, &r.last, &r.pos, &r.endpos);
+    if ( ! success )
+      _daemon_reply_error(fd, "Cannot resolve range");
+  }
+  atomic_store(&d->reader_epoch[slot], 0);
 
-    /* Truncate by end line */
-    if ( end > 0 && lineno >= end )
-      break;
+  if ( success ) {
+    FILE * out_fp = fdopen(dup(fd), "w");
+    struct outbuf ob;
+    ob_init(&ob, out_fp);
+    ob_write(&ob, "OK\n", 3);
+    success = _emit_batch_range(&ob, &snap->rec, fileno(src_fp), &r, -1, line_number, 0);
+    success = ob_finish(&ob) && success;
+    fclose(out_fp);
+  }
+  fclose(src_fp);
+  return success;
+}
 
-    /* Truncate based on count */
-    if ( count >= 0 && noutput >= count )
-      break;
+/* Worker thread answering queued connections */
+void * _daemon_worker(void * arg) {
+  struct daemon_worker * w = arg;
+  struct daemon * d = w->daemon;
+  while ( true ) {
+    pthread_mutex_lock(&d->lock);
+    while ( d->qhead == d->qtail )
+      pthread_cond_wait(&d->ready, &d->lock);
+    int fd = d->queue[d->qhead++ % DAEMON_QUEUE_SIZE];
+    pthread_cond_signal(&d->space);
+    pthread_mutex_unlock(&d->lock);
+    _daemon_serve(d, w->slot, fd);
+    close(fd);
+  }
+  return 0;
+}
 
-    /* Read and copy out line */
-    long nread = 0;
-    unsigned char * line = _read_line(src_fp, 0, 0, &nread);
-    if ( ! line || ! nread )
-      break;
+static volatile sig_atomic_t _daemon_stop = 0;
+void _daemon_signal(int sig) {
+  _daemon_stop = 1;
+}
 
-    /* Truncate based on max content filter */
-    if ( less_than && strncmp(line, less_than, nless_than) > 0 )
-      break;
+/* Serve queries on the indexed files over Unix domain socket
+   socket_path with nworker threads until interrupted, refreshing the
+   indexes of files that change in the background */
+bool serve_files(struct hindex * idxs, int nidx, char * socket_path, long chunk_size, int nworker, bool quiet, bool verbose) {
+  char buf[BUFSIZE];
+  struct sockaddr_un addr = { AF_UNIX };
+  if ( strlen(socket_path) >= sizeof addr.sun_path ) {
+    sprintf(buf, "Socket path \"%s\" too long", socket_path);
+    return _error(buf);
+  }
+  strcpy(addr.sun_path, socket_path);
 
-    lineno += 1;
+  /* Replace a stale socket, but not one a daemon still answers on */
+  int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ( sfd >= 0 && ! connect(sfd, (struct sockaddr *) &addr, sizeof addr) ) {
+    close(sfd);
+    sprintf(buf, "A daemon is already serving on socket \"%s\"", socket_path);
+    return _error(buf);
+  }
+  if ( sfd >= 0 )
+    close(sfd);
+  unlink(socket_path);
+  sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ( sfd < 0 || bind(sfd, (struct sockaddr *) &addr, sizeof addr) || listen(sfd, 128) ) {
+    sprintf(buf, "Cannot listen on socket \"%s\":", socket_path);
+    _error(buf);
+    return _error(strerror(errno));
+  }
 
-    /* Skip if not yet reached start line */
-    if ( start > 0 && lineno < start )
-      continue;
+  struct daemon * d = calloc(1, sizeof *d);
+  d->nfile = nidx;
+  d->files = calloc(nidx, sizeof *d->files);
+  d->nworker = nworker;
+  d->chunk_size = chunk_size;
+  d->verbose = verbose;
+  d->reader_epoch = calloc(nworker, sizeof *d->reader_epoch);
+  atomic_init(&d->epoch, 1);
+  pthread_mutex_init(&d->lock, 0);
+  pthread_cond_init(&d->ready, 0);
+  pthread_cond_init(&d->space, 0);
+  int i;
+  for ( i = 0; i < nidx; i++ ) {
+    struct hindex * snap = malloc(sizeof *snap);
+    *snap = idxs[i];
+    d->files[i].filename_full = idxs[i].filename_full;
+    d->files[i].index_filename = idxs[i].index_filename;
+    atomic_init(&d->files[i].snap, snap);
+  }
 
-    /* Skip if not yet reached the min content filter */
-    if ( greater_than && strcmp(line, greater_than) < 0 )
-      continue;
+  pthread_t thread;
+  struct daemon_worker * workers = calloc(nworker, sizeof *workers);
+  for ( i = 0; i < nworker; i++ ) {
+    workers[i] = (struct daemon_worker) { d, i };
+    pthread_create(&thread, 0, _daemon_worker, workers + i);
+    pthread_detach(thread);
+  }
+  pthread_create(&thread, 0, _daemon_refresher, d);
+  pthread_detach(thread);
 
-    /* Output line */
-    if ( line_number )
-      fprintf(out_fp, "%s: ", _out_size(lineno, 0));
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = _daemon_signal;
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  signal(SIGPIPE, SIG_IGN);
+  if ( ! quiet ) {
+    sprintf(buf, "Serving %d file(s) on socket \"%s\" with %d threads", nidx, socket_path, nworker);
+    _error(buf);
+  }
 
-    long nwrote = fwrite(line, 1, nread, out_fp);
-    if ( nwrote != nread ) {
-      sprintf(buf, "Error: wrote %ld != %ld bytes to output \"%s\":", nwrote, nread, output_file);
-      _error(buf);
-      fclose(src_fp);
-      fclose(out_fp);
-      return false;
+  while ( ! _daemon_stop ) {
+    int cfd = accept(sfd, 0, 0);
+    if ( cfd < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      _error("Error accepting connection:");
+      _error(strerror(errno));
+      break;
     }
+    pthread_mutex_lock(&d->lock);
+    while ( d->qtail - d->qhead >= DAEMON_QUEUE_SIZE )
+      pthread_cond_wait(&d->space, &d->lock);
+    d->queue[d->qtail++ % DAEMON_QUEUE_SIZE] = cfd;
+    pthread_cond_signal(&d->ready);
+    pthread_mutex_unlock(&d->lock);
+  }
+  close(sfd);
+  unlink(socket_path);
+  if ( ! quiet )
+    _error("Daemon stopped");
+  return true;
+}
 
-    noutput += 1;
+/* Send query for file to the daemon on socket_path and copy the lines
+   it answers with to output_file */
+bool query_daemon(char * socket_path, char * filename_full, char * output_file, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, bool line_number) {
+  char buf[BUFSIZE], req[BUFSIZE];
+  struct sockaddr_un addr = { AF_UNIX };
+  if ( strlen(socket_path) >= sizeof addr.sun_path ) {
+    sprintf(buf, "Socket path \"%s\" too long", socket_path);
+    return _error(buf);
+  }
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ( fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof addr) ) {
+    sprintf(buf, "Cannot connect to daemon on socket \"%s\":", socket_path);
+    _error(buf);
+    if ( fd >= 0 )
+      close(fd);
+    return _error(strerror(errno));
   }
 
-  fclose(src_fp);
-  fclose(out_fp);
-  return true;
+  int n = snprintf(req, BUFSIZE, "F %s\n", filename_full);
+  if ( start > 0 )
+    n += snprintf(req + n, BUFSIZE - n, "S %lld\n", start);
+  if ( end > 0 )
+    n += snprintf(req + n, BUFSIZE - n, "E %lld\n", end);
+  if ( greater_than )
+    n += snprintf(req + n, BUFSIZE - n, "G %s\n", greater_than);
+  if ( less_than )
+    n += snprintf(req + n, BUFSIZE - n, "L %s\n", less_than);
+  if ( count >= 0 )
+    n += snprintf(req + n, BUFSIZE - n, "N %lld\n", count);
+  if ( line_number )
+    n += snprintf(req + n, BUFSIZE - n, "n\n");
+  n += snprintf(req + n, BUFSIZE - n, "\n");
+  if ( n >= BUFSIZE || write(fd, req, n) != n ) {
+    close(fd);
+    return _error("Error sending query to daemon");
+  }
+
+  /* Status line, then the lines */
+  FILE * in_fp = fdopen(fd, "r");
+  if ( ! fgets(buf, BUFSIZE, in_fp) || strncmp(buf, "OK\n", 3) ) {
+    _strip_nl(buf);
+    if ( ! strncmp(buf, "ERROR ", 6) )
+      _error(buf + 6);
+    else
+      _error("No answer from daemon");
+    fclose(in_fp);
+    return false;
+  }
+  FILE * out_fp = _open_output(output_file);
+  if ( ! out_fp ) {
+    fclose(in_fp);
+    return false;
+  }
+  struct outbuf ob;
+  ob_init(&ob, out_fp);
+  bool success = true;
+  size_t nread;
+  while ( success && (nread = fread(buf, 1, BUFSIZE, in_fp)) > 0 )
+    success = ob_write(&ob, buf, nread);
+  fclose(in_fp);
+  success = ob_finish(&ob) && success;
+  return _close_output(out_fp, output_file) && success;
 }
 
 /* Show index info */
@@ -830,6 +5052,12 @@ void print_index_info(struct hindex * idx, bool verbose) {
     _out_line("Index chunk size", _out_size(idx->chunk_size, LEN));
   if( idx->snaplen > 0 )
     _out_line("Index snap len", _out_size(idx->snaplen, LEN));
+  if ( idx->rec.start )
+    _out_line("Records begin", idx->rec.start);
+  else if ( idx->rec.delim != '\n' ) {
+    sprintf(pos_buf, "byte %d", idx->rec.delim);
+    _out_line("Records end", pos_buf);
+  }
   if( idx->file_lines >= 0 )
     _out_line("File lines", _out_size(idx->file_lines, LEN));
 
@@ -865,6 +5093,115 @@ void print_index_info(struct hindex * idx, bool verbose) {
   }
 }
 
+/* Show how a search would be resolved against the index, and what it
+   would cost, without reading any data.  Line counts are exact when
+   the range is by line number, else bounded by the entries around the
+   content range.
+*/
+bool explain_search(struct hindex * idx, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count) {
+  int LEN = 15;
+  char buf[BUFSIZE], buf2[BUFSIZE];
+
+  _out_line("Data file", idx->filename_full);
+  _out_line("Index file", idx->index_filename);
+  _out_line("Index status", INDEX_STATUS_NAME[idx->status]);
+
+  /* Data the index does not cover must be scanned first */
+  long long indexed = idx->status == INDEX_STATUS_STALE ? idx->last_file_size : idx->status == INDEX_STATUS_FRESH ? idx->file_size : 0;
+  if ( idx->status != INDEX_STATUS_FRESH )
+    _out_line("Bytes to index", _out_size(idx->file_size - indexed, LEN));
+  if ( ! idx->nentry )
+    return true;
+
+  /* Resolve entries bounding the range */
+  long long line_start = 0, lineno_start = 0, line_end = 0, lineno_end = 0;
+  if ( ! _find_start_entry(idx, start, greater_than, &line_start, &lineno_start) )
+    return false;
+  int iend = _find_end_entry(idx, end, less_than, &line_end, &lineno_end);
+  int istart = -1;
+  while ( istart + 1 < iend && idx->entries[istart + 1].filepos <= line_start )
+    istart++;
+  if ( line_start == 0 )
+    istart = -1;
+
+  printf(" Entry   File position     Line number%s\n", idx->snaplen ? "  Content" : "");
+  printf("------  --------------  --------------%s\n", idx->snaplen ? "  ----------" : "");
+  int sel[2] = { istart, iend };
+  int j;
+  for ( j = 0; j < 2 && (j == 0 || iend != istart); j++ ) {
+    int i = sel[j];
+    long long pos = i >= 0 ? idx->entries[i].filepos : 0;
+    long long lno = i >= 0 ? idx->entries[i].lineno : 0;
+    strcpy(buf, _out_size(pos, LEN));
+    strcpy(buf2, _out_size(lno + 1, LEN));
+    printf("%s %s %s", i >= 0 ? _out_size(i+1, 6) : "  BOF ", buf, buf2);
+    if ( i >= 0 && idx->entries[i].frag )
+      printf("  %s", idx->entries[i].frag);
+    printf("\n");
+  }
+
+  /* Lines in range: exact by line number, else bounded by entries */
+  long long span_bytes = line_end - line_start;
+  long long span_lines = lineno_end - lineno_start;
+  long long lines_min = 0, lines_max = span_lines;
+  long long discard_max = 0, discard_est = 0;
+  long long first_chunk_bytes = (istart + 1 < idx->nentry ? idx->entries[istart + 1].filepos : idx->file_size) - line_start;
+  long long first_chunk_lines = (istart + 1 < idx->nentry ? idx->entries[istart + 1].lineno : idx->file_lines) - lineno_start;
+  if ( greater_than || less_than ) {
+    long long inner_first = istart + 1 < iend ? idx->entries[istart + 1].lineno : lineno_end;
+    long long inner_last = iend > 0 ? idx->entries[iend - 1].lineno : 0;
+    lines_min = inner_last > inner_first ? inner_last - inner_first : 0;
+    if ( greater_than ) {
+      discard_max = first_chunk_bytes;
+      discard_est = first_chunk_bytes / 2;
+    }
+  }
+  else {
+    long long first = start > 0 ? start : 1;
+    long long last = end > 0 && end < lineno_end ? end : lineno_end;
+    lines_min = lines_max = last >= first ? last - first + 1 : 0;
+    if ( first_chunk_lines > 0 ) {
+      discard_est = (first - 1 - lineno_start) * first_chunk_bytes / first_chunk_lines;
+      if ( discard_est > first_chunk_bytes )
+        discard_est = first_chunk_bytes;
+    }
+    discard_max = discard_est;
+  }
+  if ( count >= 0 ) {
+    if ( lines_min > count )
+      lines_min = count;
+    if ( lines_max > count )
+      lines_max = count;
+  }
+
+  /* Output bytes estimated from average line length over the span */
+  double avg_line = span_lines > 0 ? (double) span_bytes / span_lines : 0;
+  long long out_min = lines_min * avg_line, out_max = lines_max * avg_line;
+  if ( out_max > span_bytes - discard_est )
+    out_max = span_bytes - discard_est;
+  if ( out_min > out_max )
+    out_min = out_max;
+
+  if ( lines_min == lines_max )
+    _out_line("Lines (exact)", _out_size(lines_max, LEN));
+  else {
+    _out_line("Lines (min)", _out_size(lines_min, LEN));
+    _out_line("Lines (max)", _out_size(lines_max, LEN));
+  }
+  _out_line("Span bytes", _out_size(span_bytes, LEN));
+  if ( out_min == out_max )
+    _out_line("Output bytes (est)", _out_size(out_max, LEN));
+  else {
+    _out_line("Output bytes (min)", _out_size(out_min, LEN));
+    _out_line("Output bytes (max)", _out_size(out_max, LEN));
+  }
+  _out_line("Seeks", _out_size(line_start > 0 ? 1 : 0, LEN));
+  _out_line("Discarded (est)", _out_size(discard_est, LEN));
+  if ( discard_max != discard_est )
+    _out_line("Discarded (max)", _out_size(discard_max, LEN));
+  return true;
+}
+
 /* Main driver */
 int main2(int argc, char *argv[]) {
 
@@ -876,6 +5213,10 @@ int main2(int argc, char *argv[]) {
   bool            arg_list         = false;
   bool            arg_delete       = false;
   bool            arg_dry_run      = false;
+  bool            arg_explain      = false;
+  bool            arg_verify       = false;
+  bool            arg_repair       = false;
+  bool            arg_merge        = false;
   long long       arg_start        = 0;
   long long       arg_end          = 0;
   unsigned char * arg_greater_than = 0;
@@ -883,10 +5224,36 @@ int main2(int argc, char *argv[]) {
   long long       arg_count        = -1;
   char *          arg_output       = 0;
   bool            arg_line_number  = false;
+  bool            arg_reverse      = false;
+  bool            arg_mmap         = false;
+  char *          arg_batch_file   = 0;
+  char *          arg_serve        = 0;
+  char *          arg_query        = 0;
+  long long       arg_sample       = -1;
+  uint64_t        arg_seed         = 0;
+  bool            arg_seed_given   = false;
+  bool            arg_count_only   = false;
+  long            arg_histogram    = 0;
+  int             arg_shards       = 0;
+  bool            arg_shard_lines  = false;
+  char *          arg_prefix       = 0;
+  long            arg_partition    = 0;
+  char *          arg_bounds_file  = 0;
+  int             arg_threads      = 0;
+  struct projection arg_proj       = { '\t', 0, 0, 0, 0, 0, 0, 0, '\n' };
+  bool            arg_delim_given  = false;
+  int             arg_compress     = COMPRESS_NONE;
+  int             arg_compress_level = -1;
   bool            arg_quiet        = false;
   bool            arg_verbose      = false;
   bool            arg_force        = false;
+  bool            arg_drop_cache   = false;
+  double          arg_throttle_mb  = 0;
+  double          arg_throttle_reads = 0;
+  long long       arg_budget       = -1;
   long            arg_snaplen      = 0;
+  int             arg_rec_delim    = -1;
+  char *          arg_rec_start    = 0;
   long            arg_chunk_size   = DEFAULT_CHUNK_SIZE;
   char *          arg_index_file   = 0;
   char *          arg_index_dir    = 0;
@@ -894,9 +5261,10 @@ int main2(int argc, char *argv[]) {
   bool            arg_fullname     = false;
 
   /* Parse options */
-  char * OPTS = "hblxdS:E:G:L:N:o:nqvfP:C:i:D:HF";
+  char * OPTS = "hblxdeVAMZ:Q:cg:S:E:G:L:N:I:rs:R:mk:up:B:o:O:j:nz:t:a:w:qvT:fP:C:X:J:UW:K:i:D:HF";
   int c = 0;
   bool valid = false;
+  char * endp = 0;
   while ((c = getopt(argc, argv, OPTS)) != -1) {
     switch(c) {
     case '?':  /* Bad option char (will print message to stderr) */
@@ -915,6 +5283,34 @@ int main2(int argc, char *argv[]) {
     case 'd':  /* -d          Dry run: only show what would do */
       arg_dry_run = true;
       break;
+    case 'e':  /* -e          Explain how search would use index and its cost, read no data */
+      arg_explain = true;
+      break;
+    case 'V':  /* -V          Verify index entries against FILE(s) with -j threads */
+      arg_verify = true;
+      break;
+    case 'A':  /* -A          Repair bad entries found by -V, rewriting only the index */
+      arg_repair = true;
+      break;
+    case 'M':  /* -M          Merge -G/-L range of sorted FILE(s) into one ordered output */
+      arg_merge = true;
+      break;
+    case 'Z':  /* -Z SOCKET   Serve queries on FILE(s) over Unix socket SOCKET with -j threads */
+      arg_serve = strdup(optarg);
+      break;
+    case 'Q':  /* -Q SOCKET   Send search of FILE to daemon on SOCKET instead of reading it */
+      arg_query = strdup(optarg);
+      break;
+    case 'c':  /* -c          Only output number of lines in range */
+      arg_count_only = true;
+      break;
+    case 'g':  /* -g BYTES    Output line counts per leading BYTES bytes (key) in range */
+      arg_histogram = atol(optarg);
+      if (arg_histogram <= 0) {
+        sprintf(buf, "Value %ld for -g (histogram key length) should be positive integer", arg_histogram);
+        return usage_error(buf);
+      }
+      break;
     case 'S':  /* -S LINENO   Line-number search: start at source line LINENO */
       arg_start = atoll(optarg);
       if ( arg_start < 1 ) {
@@ -946,18 +5342,120 @@ int main2(int argc, char *argv[]) {
         return usage_error(buf);
       }
       break;
+    case 'I':  /* -I FILE     Output each range listed in FILE ("-" for stdin) in turn */
+      arg_batch_file = strdup(optarg);
+      break;
+    case 'r':  /* -r          Output lines in reverse order, last line of range first */
+      arg_reverse = true;
+      break;
+    case 'm':  /* -m          Read lines to extract from a sliding mmap window, not stdio */
+      arg_mmap = true;
+      break;
+    case 's':  /* -s K        Output K uniformly random lines from range, in file order */
+      arg_sample = _convert_ll(optarg, &valid);
+      if (! valid || arg_sample < 0) {
+        sprintf(buf, "Invalid arg for -s (sample size): \"%s\" ... should be non-negative integer", optarg);
+        return usage_error(buf);
+      }
+      break;
+    case 'R':  /* -R SEED     Random seed for -s, to reproduce a sample */
+      arg_seed = _convert_ll(optarg, &valid);
+      if (! valid) {
+        sprintf(buf, "Invalid arg for -R (random seed): \"%s\" ... should be integer", optarg);
+        return usage_error(buf);
+      }
+      arg_seed_given = true;
+      break;
+    case 'k':  /* -k SHARDS   Only output plan splitting range into SHARDS line-aligned shards */
+      arg_shards = atoi(optarg);
+      if (arg_shards <= 0) {
+        sprintf(buf, "Value %d for -k (number of shards) should be positive integer", arg_shards);
+        return usage_error(buf);
+      }
+      break;
+    case 'u':  /* -u          Balance -k shards by line count instead of bytes */
+      arg_shard_lines = true;
+      break;
+    case 'p':  /* -p BYTES    Only output plan partitioning range by leading BYTES bytes */
+      arg_partition = atol(optarg);
+      if (arg_partition <= 0) {
+        sprintf(buf, "Value %ld for -p (partition key length) should be positive integer", arg_partition);
+        return usage_error(buf);
+      }
+      break;
+    case 'B':  /* -B FILE     Only output plan partitioning range at sorted keys in FILE */
+      arg_bounds_file = strdup(optarg);
+      break;
+    case 'O':  /* -O PREFIX   Write each -k shard, -p/-B partition or -I range to file PREFIX.NNNN */
+      arg_prefix = strdup(optarg);
+      break;
+    case 'j':  /* -j THREADS  Use up to THREADS threads writing files */
+      arg_threads = atoi(optarg);
+      if (arg_threads <= 0) {
+        sprintf(buf, "Value %d for -j (threads) should be positive integer", arg_threads);
+        return usage_error(buf);
+      }
+      break;
     case 'o':  /* -o FILE     Output to FILE instead of default stdout [stdout] */
       arg_output = strdup(optarg);
       break;
     case 'n':  /* -n          Include original line number in output */
       arg_line_number = true;
       break;
+    case 'z':  /* -z FORMAT   Compress output as gzip or zstd, optionally :LEVEL, using -j threads */
+      if (0 == strncmp(optarg, "gzip", 4) && (! optarg[4] || optarg[4] == ':'))
+        arg_compress = COMPRESS_GZIP;
+      else if (0 == strncmp(optarg, "zstd", 4) && (! optarg[4] || optarg[4] == ':'))
+        arg_compress = COMPRESS_ZSTD;
+      else {
+        sprintf(buf, "Invalid arg for -z (compression): \"%s\" ... should be gzip or zstd, optionally followed by :LEVEL", optarg);
+        return usage_error(buf);
+      }
+#ifndef HAVE_ZSTD
+      if (arg_compress == COMPRESS_ZSTD)
+        return usage_error("Not built with zstd support for -z zstd (see Makefile)");
+#endif
+      if (optarg[4] == ':') {
+        arg_compress_level = _convert_ll(optarg + 5, &valid);
+        if (! valid || arg_compress_level < 1 || arg_compress_level > (arg_compress == COMPRESS_GZIP ? 9 : 19)) {
+          sprintf(buf, "Invalid compression level in -z \"%s\" ... should be 1-9 for gzip, 1-19 for zstd", optarg);
+          return usage_error(buf);
+        }
+      }
+      break;
+    case 't':  /* -t DELIM    Fields of lines are separated by single character DELIM */
+      if (0 == strcmp(optarg, "\\t"))
+        optarg = "\t";
+      if (strlen(optarg) != 1) {
+        sprintf(buf, "Invalid arg for -t (field delimiter): \"%s\" ... should be single character", optarg);
+        return usage_error(buf);
+      }
+      arg_proj.delim = optarg[0];
+      arg_delim_given = true;
+      break;
+    case 'a':  /* -a FIELDS   Output only fields FIELDS, e.g. 1,3,5-7, of each line */
+      if (! _parse_fields(optarg, &arg_proj)) {
+        sprintf(buf, "Invalid arg for -a (fields): \"%s\" ... should be list of field numbers and ranges, e.g. 1,3,5-7", optarg);
+        return usage_error(buf);
+      }
+      break;
+    case 'w':  /* -w PRED     Output only lines where field predicate PRED holds */
+      if (! _parse_predicate(optarg, &arg_proj)) {
+        sprintf(buf, "Invalid arg for -w (field predicate): \"%s\" ... should be FIELD followed by one of = != ^ < <= > >= and value", optarg);
+        return usage_error(buf);
+      }
+      break;
     case 'q':  /* -q          Limit messages to a minium */
       arg_quiet = true;
       break;
     case 'v':  /* -v          More verbose output when indexing, listing or searching */
       arg_verbose = true;
       break;
+    case 'T':  /* -T FORMAT   Report time per phase, I/O and resource use as text or json */
+      if ( strcmp(optarg, "text") && strcmp(optarg, "json") )
+        return usage_error("-T must be text or json");
+      stats_start(! strcmp(optarg, "json"));
+      break;
     case 'f':  /* -f          Force (re-)build of index */
       arg_force = true;
       break;
@@ -975,6 +5473,41 @@ int main2(int argc, char *argv[]) {
         return usage_error(buf);
       }
       break;
+    case 'X':  /* -X BYTE     Records end with BYTE (\0 for NUL) instead of newline */
+      if (0 == strcmp(optarg, "\\t"))
+        optarg = "\t";
+      if (0 == strcmp(optarg, "\\0"))
+        arg_rec_delim = '\0';
+      else if (strlen(optarg) == 1)
+        arg_rec_delim = (unsigned char) optarg[0];
+      else {
+        sprintf(buf, "Invalid arg for -X (record delimiter): \"%s\" ... should be single character or \\0", optarg);
+        return usage_error(buf);
+      }
+      break;
+    case 'J':  /* -J REGEX    Records begin at lines matching REGEX, e.g. "^From " */
+      arg_rec_start = strdup(optarg);
+      break;
+    case 'U':  /* -U          Drop data not cached before from the page cache as it is indexed */
+      arg_drop_cache = true;
+      break;
+    case 'W':  /* -W MB[,N]   Throttle -b and -Z builds to MB MB/s and N reads/s, less if reads slow */
+      arg_throttle_mb = strtod(optarg, &endp);
+      if ( *endp == ',' )
+        arg_throttle_reads = strtod(endp + 1, &endp);
+      if ( endp == optarg || *endp || arg_throttle_mb <= 0 || arg_throttle_reads < 0 ) {
+        sprintf(buf, "Invalid arg for -W (throttle): \"%s\" ... should be positive MB/s, optionally followed by ,READS/s", optarg);
+        return usage_error(buf);
+      }
+      break;
+    case 'K':  /* -K BYTES    Evict least valuable indexes in -D DIR beyond BYTES in all */
+      errno = 0;
+      arg_budget = _convert_ll(optarg, &valid);
+      if (! valid || arg_budget < 0) {
+        sprintf(buf, "Invalid arg for -K (index store budget): \"%s\" ... should be bytes, 0 or more", optarg);
+        return usage_error(buf);
+      }
+      break;
     case 'i':  /* -i INDEX    Use explicit index file INDEX (else generate) */
       arg_index_file = strdup(optarg);
       break;
@@ -995,7 +5528,7 @@ int main2(int argc, char *argv[]) {
   }
 
   int nfile = argc <= optind ? 0 : argc - optind;
-  if (! nfile)
+  if (! nfile && (arg_budget < 0 || arg_serve || arg_merge || arg_query))
     return usage_error("Must supply at least one file name");
   if (nfile > 1 && arg_index_file) {
     sprintf(buf, "Can only specify explicit index file with -i when indexing a single file, not %d", nfile);
@@ -1003,7 +5536,7 @@ int main2(int argc, char *argv[]) {
   }
 
   /* Can't both search and list */
-  bool search_opt_given = arg_start > 0 || arg_end > 0 || arg_greater_than || arg_less_than || arg_count >= 0;
+  bool search_opt_given = arg_start > 0 || arg_end > 0 || arg_greater_than || arg_less_than || arg_count >= 0 || arg_sample >= 0;
   if ( arg_list && search_opt_given )
     return usage_error("Cannot list with -l and also use search option(s) -SEGLN");
   /* Can't search, list or build with delete */
@@ -1014,9 +5547,169 @@ int main2(int argc, char *argv[]) {
       return usage_error("Cannot mix -x (delete) with -l (list) or -b (build only)");
   }
 
+  /* Explain only describes a plain search */
+  if ( arg_explain ) {
+    if (arg_list || arg_build_only || arg_delete || arg_merge || arg_reverse || arg_sample >= 0 || arg_count_only || arg_histogram)
+      return usage_error("Cannot mix -e (explain) with other modes of operation");
+    if (nfile > 1)
+      return usage_error("Can only explain search of a single file with -e");
+  }
+
+  /* Merge only applies to content range search */
+  if ( arg_merge ) {
+    if (arg_list || arg_build_only || arg_delete)
+      return usage_error("Cannot mix -M (merge) with -l (list), -b (build only) or -x (delete)");
+    if (arg_start > 0 || arg_end > 0)
+      return usage_error("Cannot merge with -M by line number (-SE), only by content (-GL)");
+    if (arg_reverse)
+      return usage_error("Cannot output merged lines in reverse with -r");
+  }
+
+  /* Sampling picks its own lines from the range */
+  if ( arg_sample >= 0 ) {
+    if (arg_merge || arg_reverse)
+      return usage_error("Cannot sample lines with -s when merging with -M or reversing with -r");
+  }
+  else if ( arg_seed_given )
+    return usage_error("Random seed -R only applies to sampling with -s");
+  if ( ! arg_seed_given )
+    arg_seed = (uint64_t) time(0) ^ ((uint64_t) getpid() << 32);
+
+  /* Count and histogram only report on the range */
+  if ( arg_count_only || arg_histogram ) {
+    if (arg_count_only && arg_histogram)
+      return usage_error("Cannot both count with -c and make histogram with -g");
+    if (arg_merge || arg_reverse || arg_sample >= 0)
+      return usage_error("Cannot count with -c or -g when merging (-M), reversing (-r) or sampling (-s)");
+    if (arg_histogram && arg_count >= 0)
+      return usage_error("Cannot limit histogram from -g with -N");
+    if (arg_line_number)
+      return usage_error("Cannot output line numbers (-n) with -c or -g");
+    if (arg_list || arg_delete)
+      return usage_error("Cannot mix -c or -g with -l (list) or -x (delete)");
+  }
+  search_opt_given = search_opt_given || arg_count_only || arg_histogram;
+
+  /* Shard planning splits the range */
+  if ( arg_shards ) {
+    if (arg_count_only || arg_histogram || arg_merge || arg_reverse || arg_sample >= 0 || arg_explain)
+      return usage_error("Cannot plan shards with -k in other modes of operation (-cgMrse)");
+    if (arg_count >= 0 || arg_line_number)
+      return usage_error("Cannot limit (-N) or number (-n) lines when planning shards with -k");
+    if (arg_list || arg_delete)
+      return usage_error("Cannot mix -k with -l (list) or -x (delete)");
+  }
+  else if ( arg_shard_lines )
+    return usage_error("Option -u only applies to planning shards with -k");
+
+  /* Partitioning splits the range by key */
+  bool partition = arg_partition || arg_bounds_file;
+  if ( partition ) {
+    if (arg_partition && arg_bounds_file)
+      return usage_error("Cannot partition both by key length with -p and at keys from file with -B");
+    if (arg_shards || arg_count_only || arg_histogram || arg_merge || arg_reverse || arg_sample >= 0 || arg_explain)
+      return usage_error("Cannot partition with -p or -B in other modes of operation (-kcgMrse)");
+    if (arg_count >= 0 || arg_line_number)
+      return usage_error("Cannot limit (-N) or number (-n) lines when partitioning with -p or -B");
+    if (arg_list || arg_delete)
+      return usage_error("Cannot mix -p or -B with -l (list) or -x (delete)");
+  }
+
+  /* Batch lists its own ranges */
+  if ( arg_batch_file ) {
+    if (arg_start > 0 || arg_end > 0 || arg_greater_than || arg_less_than)
+      return usage_error("Cannot give a search range (-SEGL) with a batch of ranges from -I");
+    if (partition || arg_shards || arg_count_only || arg_histogram || arg_merge || arg_reverse || arg_sample >= 0 || arg_explain)
+      return usage_error("Cannot output a batch with -I in other modes of operation (-pBkcgMrse)");
+    if (arg_list || arg_delete || arg_build_only)
+      return usage_error("Cannot mix -I with -l (list), -x (delete) or -b (build only)");
+  }
+  else if ( arg_prefix && ! arg_shards && ! partition )
+    return usage_error("Option -O only applies to writing shards (-k), partitions (-p or -B) or batch ranges (-I)");
+  char ** bounds = 0;
+  int nbound = 0;
+  if ( arg_bounds_file ) {
+    bounds = _read_bounds(arg_bounds_file, &nbound);
+    if ( ! bounds )
+      return false;
+  }
+  struct batch_range * batch = 0;
+  int nbatch = 0;
+  if ( arg_batch_file ) {
+    batch = read_batch(arg_batch_file, &nbatch);
+    if ( ! batch )
+      return false;
+  }
+  search_opt_given = search_opt_given || arg_shards || partition || batch;
+
+  /* Field projection and predicates apply to plain search output */
+  bool project = arg_proj.nfield || arg_proj.npred;
+  if ( project ) {
+    if (partition || arg_shards || arg_count_only || arg_histogram || arg_merge || arg_reverse || arg_sample >= 0 || arg_explain)
+      return usage_error("Cannot use -a or -w in other modes of operation (-pBkcgMrse)");
+    if (arg_list || arg_delete || arg_build_only)
+      return usage_error("Cannot mix -a or -w with -l (list), -x (delete) or -b (build only)");
+  }
+  else if ( arg_delim_given )
+    return usage_error("Option -t only applies with fields given by -a or -w");
+  search_opt_given = search_opt_given || project;
+
+  /* The mmap reader only replaces stdio for forward extraction */
+  if ( arg_mmap ) {
+    if (partition || arg_shards || arg_count_only || arg_histogram || arg_merge || arg_reverse || arg_sample >= 0 || arg_explain || arg_batch_file)
+      return usage_error("Cannot read with -m in other modes of operation (-pBkcgMrseI)");
+    if (arg_list || arg_delete || arg_build_only)
+      return usage_error("Cannot mix -m with -l (list), -x (delete) or -b (build only)");
+  }
+
+  /* Threads default to one per CPU */
+  if ( ! arg_threads ) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    arg_threads = ncpu > 0 ? ncpu : 1;
+  }
+
+  /* Compression applies to extracted lines */
+  if ( arg_compress != COMPRESS_NONE ) {
+    if (partition || arg_shards || arg_count_only || arg_histogram || arg_explain)
+      return usage_error("Cannot compress output with -z in other modes of operation (-pBkcge)");
+    if (arg_list || arg_delete || arg_build_only)
+      return usage_error("Cannot mix -z with -l (list), -x (delete) or -b (build only)");
+    if (arg_compress_level < 0)
+      arg_compress_level = arg_compress == COMPRESS_GZIP ? 6 : 3;
+    set_output_compression(arg_compress, arg_compress_level, arg_threads);
+  }
+  set_build_drop_cache(arg_drop_cache);
+
+  /* Daemon answers queries itself, client only asks for one search */
+  bool other_mode = partition || arg_shards || arg_count_only || arg_histogram || arg_merge || arg_reverse || arg_sample >= 0 || arg_explain || batch || project || arg_mmap;
+  if ( arg_serve ) {
+    if (search_opt_given || other_mode || arg_line_number || arg_output || arg_compress != COMPRESS_NONE || arg_query)
+      return usage_error("Cannot mix -Z (serve) with search, output or other mode options; clients give those with -Q");
+    if (arg_list || arg_delete || arg_build_only || arg_dry_run)
+      return usage_error("Cannot mix -Z (serve) with -l (list), -x (delete), -b (build only) or -d (dry run)");
+  }
+  if ( arg_query ) {
+    if (other_mode)
+      return usage_error("Can only query the daemon with -Q for a search by -SEGLN, not other modes (-pBkcgMrseIawm)");
+    if (arg_list || arg_delete || arg_build_only || arg_dry_run || arg_force)
+      return usage_error("Cannot mix -Q (query) with -l (list), -x (delete), -b (build only), -d (dry run) or -f (force)");
+    if (nfile > 1)
+      return usage_error("Can only query the daemon with -Q for a single file");
+  }
+
+  /* Verify checks indexes as they are */
+  if ( arg_repair && ! arg_verify )
+    return usage_error("Can only repair index entries with -A when verifying with -V");
+  if ( arg_verify ) {
+    if (search_opt_given || other_mode || arg_line_number || arg_output || arg_query)
+      return usage_error("Cannot mix -V (verify) with search, output or other mode options");
+    if (arg_list || arg_delete || arg_build_only || arg_serve || arg_force)
+      return usage_error("Cannot mix -V (verify) with -l (list), -x (delete), -b (build only), -Z (serve) or -f (force)");
+  }
+
   /* Imply build_only if multiple files and no search options given */
   bool build_only = arg_build_only;
-  if (nfile > 1) {
+  if (nfile > 1 && ! arg_merge && ! arg_serve && ! arg_verify) {
     if (search_opt_given) {
       sprintf(buf, "Search options -SEGLN not compatible with multiple files (%d)", nfile);
       return usage_error(buf);
@@ -1031,6 +5724,10 @@ int main2(int argc, char *argv[]) {
     }
   }
 
+  /* Throttle builds no one waits on, searches refresh at full speed */
+  if ( arg_throttle_mb > 0 && (build_only || arg_serve) )
+    set_build_throttle(arg_throttle_mb * 1e6, arg_throttle_reads);
+
   /* Check content search options */
   if ((arg_greater_than || arg_less_than) && arg_snaplen > 0 && arg_verbose) {
     if (arg_greater_than && strlen(arg_greater_than) > arg_snaplen) {
@@ -1082,6 +5779,16 @@ int main2(int argc, char *argv[]) {
     return usage_error(buf);
   }
 
+  /* Records other than lines, else as indexes have them */
+  struct records rec;
+  if ( arg_rec_delim >= 0 && arg_rec_start )
+    return usage_error("Records can end with -X (delimiter) or begin with -J (pattern), not both");
+  if ( ! records_init(&rec, arg_rec_delim >= 0 ? arg_rec_delim : '\n', arg_rec_start) ) {
+    sprintf(buf, "Invalid regular expression \"%s\" for -J (record start)", arg_rec_start);
+    return usage_error(buf);
+  }
+  bool rec_given = arg_rec_delim >= 0 || arg_rec_start;
+
   /* Check search range options are sensible and warn if not */
   if (!arg_quiet) {
     if (arg_count == 0)
@@ -1102,6 +5809,14 @@ int main2(int argc, char *argv[]) {
     _error("DRY RUN MODE ... will not touch any files");
 
   bool success = true;
+  struct hindex * merge_idx = arg_merge || arg_serve ? calloc(nfile, sizeof *merge_idx) : 0;
+  int nmerge = 0;
+
+  /* Indexes of the store in the index directory used by this run */
+  bool store = ! arg_index_file && ! arg_fullname && strcmp(index_dir, ".");
+  struct store_entry * touched = store ? calloc(nfile + 1, sizeof *touched) : 0;
+  int ntouched = 0;
+  bool verified = true;
   for( ; optind < argc ; optind++) {
 
     char * filename = argv[optind];
@@ -1143,6 +5858,8 @@ int main2(int argc, char *argv[]) {
           }
           else
             action = "Deleted";
+          snprintf(buf, BUFSIZE, "%s%s", index_filename, OFFSET_CACHE_SUFFIX);
+          unlink(buf);
         }
         if (!arg_quiet) {
           sprintf(buf, "%s index \"%s\" on \"%s\" (Use -q to suppress this message)", action, index_filename, filename_full);
@@ -1166,27 +5883,111 @@ int main2(int argc, char *argv[]) {
       continue;
     }
 
+    /* Explain search using index as is */
+    if (arg_explain) {
+      struct hindex idx;
+      bool success = get_index_info(filename_full, index_filename, &idx);
+      if ( !success || !explain_search(&idx, arg_start, arg_end, arg_greater_than, arg_less_than, arg_count) )
+        break;
+      continue;
+    }
+
+    /* Verify index as is, repairing it with -A */
+    if (arg_verify) {
+      struct hindex idx;
+      if ( ! get_index_info(filename_full, index_filename, &idx) || ! verify_index(&idx, arg_threads, arg_repair, arg_dry_run, arg_quiet, arg_verbose) )
+        verified = false;
+      continue;
+    }
+
+    /* Ask the daemon, which holds the index */
+    if (arg_query) {
+      if ( ! query_daemon(arg_query, filename_full, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_count, arg_line_number) )
+        return false;
+      continue;
+    }
+
     /* Check or create the index */
     struct hindex idx;
-    bool for_content_search = arg_greater_than || arg_less_than;
-    bool success = index_file(&idx, filename_full, index_filename, arg_chunk_size, arg_snaplen, arg_quiet, arg_verbose, arg_force, arg_dry_run, for_content_search);
+    bool for_content_search = arg_greater_than || arg_less_than || arg_merge || arg_histogram || partition;
+    int b;
+    for ( b = 0; b < nbatch; b++ )
+      for_content_search = for_content_search || batch[b].greater_than || batch[b].less_than;
+    bool success = index_file(&idx, filename_full, index_filename, arg_chunk_size, arg_snaplen, rec_given ? &rec : 0, arg_quiet, arg_verbose, arg_force, arg_dry_run, for_content_search);
+    stats_phase(STATS_OTHER);
     if (!success)
       break;
 
+    /* Note use, and the cost of a full build as extrapolated from any scan */
+    if ( store && ! arg_dry_run ) {
+      struct store_entry * t = touched + ntouched++;
+      t->name = strrchr(index_filename, '/') + 1;
+      t->data = filename_full;
+      t->last_access = time(0);
+      t->build_secs = idx.build_bytes > 0 ? idx.build_secs * idx.file_size / idx.build_bytes : 0;
+    }
+
     /* Nothing to do if just indexing or dry run */
     if ( build_only || arg_dry_run )
       continue;
 
-    /* Search the file for lines */
-    success = search_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_count, arg_line_number, arg_verbose);
+    /* Collect indexes for merge or serving once all are built */
+    if ( arg_merge || arg_serve ) {
+      merge_idx[nmerge++] = idx;
+      continue;
+    }
+
+    /* Search the file for lines, starting at boundaries found before */
+    offset_cache_load(&idx);
+    if ( partition )
+      success = partition_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_partition, bounds, nbound, arg_prefix, arg_verbose);
+    else if ( arg_shards )
+      success = shard_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_shards, arg_shard_lines, arg_prefix, arg_threads, arg_verbose);
+    else if ( batch )
+      success = batch_file(&idx, arg_output, batch, nbatch, arg_count, arg_line_number, project ? &arg_proj : 0, arg_prefix, arg_verbose);
+    else if ( arg_count_only )
+      success = count_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_count, arg_verbose);
+    else if ( arg_histogram )
+      success = histogram_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_histogram, arg_verbose);
+    else if ( arg_sample >= 0 )
+      success = sample_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_sample, arg_seed, arg_count, arg_line_number, arg_verbose);
+    else if ( arg_reverse )
+      success = search_file_reverse(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_count, arg_line_number, arg_verbose);
+    else
+      success = search_file(&idx, arg_output, arg_start, arg_end, arg_greater_than, arg_less_than, arg_count, arg_line_number, project ? &arg_proj : 0, arg_mmap, arg_verbose);
+    offset_cache_save(&idx, arg_verbose);
     if ( ! success )
       break;
   }
 
-  return true;
+  /* Record use in the store's manifest and keep it within budget when
+     building or given -K, else just stamp use of the indexes searched */
+  bool stored = true, built = false;
+  int t;
+  for ( t = 0; t < ntouched; t++ )
+    built = built || touched[t].build_secs > 0;
+  if ( store && (built || arg_budget >= 0) )
+    stored = store_update(index_dir, touched, ntouched, arg_budget, arg_dry_run, arg_quiet, arg_verbose);
+  else if ( store && ntouched )
+    store_touch(index_dir, touched, ntouched, arg_verbose);
+  free(touched);
+
+  /* Serve all files' indexes */
+  if ( arg_serve )
+    return nmerge == nfile && serve_files(merge_idx, nmerge, arg_serve, arg_chunk_size, arg_threads, arg_quiet, arg_verbose);
+
+  /* Merge all files' ranges into one output */
+  if ( arg_merge && ! arg_dry_run )
+    return nmerge == nfile && merge_files(merge_idx, nmerge, arg_output, arg_greater_than, arg_less_than, arg_count, arg_line_number, arg_verbose);
+
+  return stored && verified;
 }
 
+#ifndef HINDEX_LIBRARY
 int main(int argc, char *argv[]) {
-  return main2(argc, argv) ? 0 : 1;
+  bool success = main2(argc, argv);
+  stats_report();
+  return success ? 0 : 1;
 }
+#endif
 
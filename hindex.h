@@ -1,11 +1,13 @@
 /* hindex.h */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <getopt.h>
 #include <string.h>
@@ -14,6 +16,24 @@
 #include <openssl/sha.h>
 #include <math.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <regex.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "libhindex.h"
 
 /* Defaults */
 /* Following value must agree with USAGE below */
@@ -41,6 +61,67 @@ char * INDEX_STATUS_NAME[] = {
 long int INDEX_PROGRESS_INTERVAL = 100 * 1000 * 1000;
 #define DEFAULT_INDEX_ENTRY_ALLOC 100
 
+/* Per-input stdio buffer when merging (-M) many files */
+#define MERGE_READAHEAD_SIZE (256 * 1024)
+
+/* Block size for reading backward with -r */
+#define REVERSE_BLOCK_SIZE (1024 * 1024)
+
+/* Lines and records are read in blocks of this size (or more, for a
+   longer key or -P), so memory stays bounded however long they are */
+#define LINE_BLOCK_SIZE (512 * 1024)
+
+/* Read through gaps up to this many bytes between sampled lines (-s) rather than seek */
+#define SAMPLE_COALESCE_BYTES (256 * 1024)
+
+/* Records of a data file, by default lines.  Records end with byte
+   delim (-X), or begin at each line matching pattern start (-J),
+   compared as a literal prefix when it is "^" and plain characters,
+   else as an extended regex. */
+struct records {
+  int       delim;
+  char *    start;
+  regex_t * re;
+  char *    prefix;
+  long      nprefix;
+};
+
+/* Data file read with pread() in blocks of LINE_BLOCK_SIZE, to index
+   records ending with a byte other than newline (-X) by scanning for it
+   with memchr: bytes lo to hi of buf are yet to be scanned, and buf[hi]
+   is at file position pos */
+struct record_block {
+  int             fd;
+  unsigned char * buf;
+  long            lo;
+  long            hi;
+  long long       pos;
+};
+
+/* Offset cache of an index: exact offsets of range boundaries that
+   searches had to find by reading past lines, so repeating them reads
+   none.  Kept next to the index in "<index file>.offsets", a line
+   "<file mtime> <file size> <file lines> <delim> [<start>]" of the
+   index it is valid for, then a line per hit, newest first, of
+   "<kind> <line number> <file position> [<key>]", kind S for the
+   start of line number, G for the first line >= key, L for the last
+   line <= key (position after it).  Hits in the older half are moved
+   to the front when used, and the oldest dropped past
+   OFFSET_CACHE_MAX. */
+#define OFFSET_CACHE_SUFFIX ".offsets"
+#define OFFSET_CACHE_MAX 256
+struct offset_hit {
+  char            kind;
+  long long       lineno;
+  long long       filepos;
+  unsigned char * key;
+};
+struct offset_cache {
+  int               n;
+  bool              dirty;
+  struct offset_hit hits[OFFSET_CACHE_MAX];
+};
+
 /* Index entry */
 struct entry {
   long long       filepos;
@@ -61,18 +142,344 @@ struct hindex {
   long double    index_mtime;
   long           chunk_size;
   long           snaplen;
+  struct records rec;
   int            nentry;
   int            maxentry;
   struct entry * entries;
+  double         build_secs;    /* Time and bytes of scan by index_file(), 0 if none */
+  long long      build_bytes;
+  struct offset_cache * oc;     /* Offset cache if attached, by single threaded searches */
+};
+
+/* Field predicate operators for -w */
+#define PRED_EQ     0
+#define PRED_NE     1
+#define PRED_PREFIX 2
+#define PRED_LT     3
+#define PRED_LE     4
+#define PRED_GT     5
+#define PRED_GE     6
+
+/* Field predicate given with -w, e.g. "3>=100" */
+struct predicate {
+  int             field;
+  int             op;
+  unsigned char * value;
+  long            nvalue;
+  double          number;
+};
+
+/* Field projection (-t, -a) and predicates (-w) on delimited lines */
+struct projection {
+  unsigned char      delim;
+  int                nfield;
+  int *              fields;
+  int                npred;
+  struct predicate * preds;
+  int                maxfield;
+  long *             starts;
+  long *             lens;
+  unsigned char      eol;     /* Record delimiter, set by the search */
+};
+
+/* Input file being merged with -M, positioned at its current line */
+struct merge_input {
+  struct hindex * idx;
+  FILE *          fp;
+  char *          iobuf;
+  char *          line;     /* First block of the current line */
+  long            linelen;
+  bool            more;     /* Line goes on past its first block */
+  long long       lineno;
+};
+
+/* Most bytes of the file mapped at once by -m, grown for longer lines */
+#define MMAP_WINDOW_SIZE (256L * 1024 * 1024)
+
+/* Index store in an index directory (-D): indexes made there with
+   derived names are listed in its manifest, one per line as
+   "<index file name> <last access> <build seconds> <data file>".
+   Indexes found without an entry are assumed to have been built at
+   STORE_BUILD_RATE bytes/s. */
+#define STORE_MANIFEST "hindex.manifest"
+#define STORE_BUILD_RATE 1e9
+struct store_entry {
+  char *     name;
+  char *     data;
+  double     last_access;
+  double     build_secs;    /* Seconds to build the whole index */
+  long long  size;
+  bool       data_gone;
+  bool       keep;          /* Used by this run, never evicted */
+  double     score;         /* Idle seconds per build second, highest evicted first */
+};
+
+/* Page cache hints while reading a file forward: windows of
+   CACHE_WINDOW_SIZE bytes are advised WILLNEED up to one ahead of the
+   cursor and, if dropping, advised DONTNEED once wholly behind it,
+   sparing pages that were cached when probed with mincore() up to
+   CACHE_PROBE_WINDOWS - 1 windows ahead, beyond kernel readahead */
+#define CACHE_WINDOW_SIZE (8L * 1024 * 1024)
+#define CACHE_PROBE_WINDOWS 4
+struct cache_cursor {
+  int              fd;
+  bool             drop;
+  long long        end;           /* Offset past the last byte to be read */
+  long long        next;          /* Start of next window to advise */
+  long long        probed;        /* Start of next window to probe */
+  long long        done;          /* Start of first window not dropped */
+  long long        due;           /* Cursor position of next action */
+  unsigned char *  resident[CACHE_PROBE_WINDOWS];  /* Residency of pending windows by number */
+};
+
+/* Throttle of index build reads (-W): token buckets for bytes and for
+   reads of THROTTLE_READ_SIZE, refilled at the given rates times scale.
+   Scale is halved while the time a read stalls the build runs above
+   twice its baseline, and recovers by THROTTLE_STEP per read otherwise.
+   The baseline drifts up by THROTTLE_DRIFT of the excess per read. */
+#define THROTTLE_READ_SIZE (1024 * 1024)
+#define THROTTLE_BURST_SECS 0.1
+#define THROTTLE_MIN_STALL 0.0005
+#define THROTTLE_MIN_SCALE (1.0 / 64)
+#define THROTTLE_STEP (1.0 / 16)
+#define THROTTLE_DRIFT 0.02
+struct throttle {
+  double           bytes_per_sec;  /* 0 when not throttling */
+  double           reads_per_sec;  /* 0 for no limit on reads */
+  double           scale;
+  double           byte_tokens;
+  double           read_tokens;
+  double           stall_avg;      /* Moving average of seconds stalled per read */
+  double           stall_base;
+  double           slept;          /* Total seconds slept */
+  long long        pos;            /* Cursor at last accounting */
+  long long        due;            /* Cursor position of next accounting */
+  struct timespec  wall0;
+  struct timespec  cpu0;
+};
+
+/* Most bytes of -I batch spans read into memory in file order */
+#define BATCH_BUFFER_SIZE (64 * 1024 * 1024)
+
+/* One range of a -I batch, in request order */
+struct batch_range {
+  char *          spec;
+  long long       start;
+  long long       end;
+  unsigned char * greater_than;
+  unsigned char * less_than;
+  long long       first;    /* Resolved 1-origin lines [first, last] */
+  long long       last;
+  long long       pos;      /* Resolved offsets [pos, endpos) */
+  long long       endpos;
+  unsigned char * data;     /* Bytes read by coalesced pass, or null */
+};
+
+/* Daemon (-Z) checks served files for changes this often */
+#define DAEMON_REFRESH_SECONDS 1
+/* Most accepted connections waiting for a daemon worker thread */
+#define DAEMON_QUEUE_SIZE 1024
+
+/* File served by the daemon, with its current index snapshot */
+struct daemon_file {
+  char *                   filename_full;
+  char *                   index_filename;
+  _Atomic(struct hindex *) snap;
+  long long                failed_size;    /* File state refresh last failed on */
+  long double              failed_mtime;
+};
+
+/* Daemon state shared by the accept loop, workers and refresher.
+   reader_epoch[i] is the epoch worker i started reading a snapshot in,
+   or 0 when it holds none. */
+struct daemon {
+  int                 nfile;
+  struct daemon_file * files;
+  int                 nworker;
+  long                chunk_size;
+  bool                verbose;
+  atomic_ulong        epoch;
+  atomic_ulong *      reader_epoch;
+  int                 queue[DAEMON_QUEUE_SIZE];
+  unsigned long       qhead;
+  unsigned long       qtail;
+  pthread_mutex_t     lock;
+  pthread_cond_t      ready;
+  pthread_cond_t      space;
+};
+
+struct daemon_worker {
+  struct daemon * daemon;
+  int             slot;
+};
+
+/* Phases timed for statistics (-T) */
+#define STATS_LOAD    0
+#define STATS_REFRESH 1
+#define STATS_SEEK    2
+#define STATS_SCAN    3
+#define STATS_OUTPUT  4
+#define STATS_OTHER   5
+#define STATS_NPHASE  6
+char * STATS_PHASE_NAME[] = {
+ "index_load",
+ "index_refresh",
+ "seek",
+ "scan",
+ "output",
+ "other"
+};
+
+/* Statistics of run for -T.  Wall and CPU time is charged to the
+   current phase at each phase change.  Counters may be updated by
+   threads writing -k shards. */
+struct stats {
+  bool               on;
+  bool               json;
+  int                phase;
+  struct timespec    wall0;
+  struct timespec    cpu0;
+  double             wall[STATS_NPHASE];
+  double             cpu[STATS_NPHASE];
+  _Atomic long long  bytes_read;
+  _Atomic long long  index_bytes_read;
+  _Atomic long long  bytes_output;
+  _Atomic long long  lines_discarded;
+  _Atomic long long  seeks;
+};
+
+/* Output buffer size; writes at least half this size bypass the copy */
+#define OUTBUF_SIZE (1024 * 1024)
+
+/* Buffered output of extracted lines.  Data is collected in a large
+   buffer and written with write(), or writev() together with a large
+   line to avoid copying it.  The "N,NNN: " line number prefix for -n
+   is kept formatted and incremented in place for consecutive lines.
+*/
+struct outbuf {
+  FILE *          fp;
+  int             fd;
+  unsigned char * buf;
+  size_t          len;
+  bool            failed;
+  long long       lineno;
+  char            lnbuf[48];
+  int             lnstart;
+};
+
+/* Output compression formats for -z */
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+
+/* Uncompressed bytes per independently compressed block (gzip member
+   or zstd frame) with -z */
+#define COMPRESS_BLOCK_SIZE (1024 * 1024)
+
+/* Block of output being compressed, slot in ring of a zstream */
+#define ZBLOCK_FREE       0
+#define ZBLOCK_FILLED     1
+#define ZBLOCK_COMPRESSED 2
+struct zblock {
+  int             state;
+  unsigned char * in;
+  size_t          nin;
+  unsigned char * out;
+  size_t          nout;
+  size_t          maxout;
+};
+
+/* Compressed output stream behind a FILE from fopencookie(): blocks
+   are filled by the writer, compressed by worker threads and written
+   in order by a writer thread */
+struct zstream {
+  int             fd;
+  int             format;
+  int             level;
+  int             nthread;
+  pthread_t *     threads;
+  pthread_t       writer;
+  int             nslot;
+  struct zblock * slots;
+  long long       seq_fill;
+  long long       seq_claim;
+  long long       seq_write;
+  bool            done;
+  bool            failed;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+};
+
+/* Line-aligned slice of a file planned with -k: byte offsets
+   [start, end) holding 1-origin lines [first, last] */
+struct shard {
+  long long start;
+  long long end;
+  long long first;
+  long long last;
+};
+
+/* Partition of a range planned with -p or -B, like a shard, for
+   lines with the same key or between the same boundaries */
+struct partition {
+  long long       start;
+  long long       end;
+  long long       first;
+  long long       last;
+  unsigned char * label;
+};
+
+/* Shared state of threads writing shard files with -k and -O */
+struct shard_job {
+  char *         filename;
+  int            src_fd;
+  char *         prefix;
+  struct shard * shards;
+  int            nshard;
+  int            next;
+  bool           failed;
+  pthread_mutex_t lock;
+};
+
+/* Index entries verified by -V in parallel, VERIFY_BATCH at a time,
+   reading up to VERIFY_BLOCK_SIZE bytes at once.  Without -v only the
+   first VERIFY_REPORT_MAX bad entries are reported. */
+#define VERIFY_BATCH 16
+#define VERIFY_BLOCK_SIZE (1024 * 1024)
+#define VERIFY_REPORT_MAX 10
+
+/* Index entry checked by -V against the data file */
+struct verify_entry {
+  int             index;      /* In entries of index */
+  long long       newlines;   /* In data from offset of previous entry checked */
+  long long       fixed;      /* Offset of line start at or after entry's offset */
+  int             extra;      /* Lines counted beyond newlines before offset: moved to next line, or partial last line */
+  long long       lineno;     /* Lines before fixed offset */
+  unsigned char * frag;       /* Fragment entry should have, if its own differs */
+};
+
+/* Shared state of threads verifying index entries with -V */
+struct verify_job {
+  struct hindex *       idx;
+  int                   src_fd;
+  long long             size;     /* Bytes indexed, offset of last entry */
+  struct verify_entry * ents;
+  int                   nent;
+  int                   next;
+  bool                  failed;
+  pthread_mutex_t       lock;
 };
 
 /* Usage string, contains program version */
 static char * USAGE =
-"Usage: hindex [-h] [-b] [-l] [-x] [-d]\n"
-"              [-S LINENO] [-E LINENO] [-G MINVAL] [-L MAXVAL] [-N LINES]\n"
-"              [-n] [-q] [-v]\n"
-"              [-f] [-P BYTES] [-C BYTES] [-i INDEX] [-D DIR] [-H] [-F]\n"
-"              FILE [FILE ...]\n"
+"Usage: hindex [-h] [-b] [-l] [-x] [-d] [-e] [-V] [-A] [-M] [-c] [-g BYTES]\n"
+"              [-S LINENO] [-E LINENO] [-G MINVAL] [-L MAXVAL] [-N LINES] [-I FILE]\n"
+"              [-r] [-s K] [-R SEED] [-m]\n"
+"              [-k SHARDS] [-u] [-p BYTES] [-B FILE] [-O PREFIX] [-j THREADS]\n"
+"              [-n] [-z FORMAT] [-t DELIM] [-a FIELDS] [-w PRED ...] [-q] [-v]\n"
+"              [-f] [-P BYTES] [-C BYTES] [-X BYTE] [-J REGEX] [-U] [-W MB[,N]]\n"
+"              [-K BYTES] [-i INDEX] [-D DIR] [-H] [-F] [-Z SOCKET] [-Q SOCKET]\n"
+"              [-T FORMAT] FILE [FILE ...]\n"
 "\n"
 "hindex - Huge file INDEXer, version 0.9\n"
 "\n"
@@ -84,6 +491,14 @@ static char * USAGE =
 "  -l          Just list info for FILE(s), more with -v [False]\n"
 "  -x          Delete index file if it exists [False]\n"
 "  -d          Dry run: only show what would do [False]\n"
+"  -e          Explain how search would use index and its cost, read no data [False]\n"
+"  -V          Verify index entries against FILE(s) with -j threads [False]\n"
+"  -A          Repair bad entries found by -V, rewriting only the index [False]\n"
+"  -M          Merge -G/-L range of sorted FILE(s) into one ordered output [False]\n"
+"  -c          Only output number of lines in range [False]\n"
+"  -g BYTES    Only output line counts per leading BYTES bytes in range (see -P) [None]\n"
+"  -Z SOCKET   Serve queries on FILE(s) over Unix socket SOCKET with -j threads [None]\n"
+"  -Q SOCKET   Send search of FILE to daemon on SOCKET instead of reading it [None]\n"
 "  -h          Show this help message and exit [False]\n"
 "\n"
 "Search options:\n"
@@ -92,17 +507,39 @@ static char * USAGE =
 "  -G MINVAL   Content search for lines >= MINVAL in sorted file (see -P) [None]\n"
 "  -L MAXVAL   Content search for lines <= MAXVAL in sorted file (see -P) [None]\n"
 "  -N LINES    Limit output to at most LINES lines [None]\n"
+"  -I FILE     Output each range listed in FILE (\"-\" for stdin) in turn [None]\n"
+"  -r          Output lines in reverse order, last line of range first [False]\n"
+"  -s K        Output K uniformly random lines from range, in file order [None]\n"
+"  -R SEED     Random seed for -s, to reproduce a sample [None]\n"
+"  -m          Read lines to extract from a sliding mmap window, not stdio [False]\n"
+"  -k SHARDS   Only output plan splitting range into SHARDS line-aligned shards [None]\n"
+"  -u          Balance -k shards by line count instead of bytes [False]\n"
+"  -p BYTES    Only output plan partitioning range by leading BYTES bytes [None]\n"
+"  -B FILE     Only output plan partitioning range at sorted keys in FILE [None]\n"
 "\n"
 "Output options:\n"
 "  -o FILE     Output to FILE instead of default stdout [stdout]\n"
 "  -n          Include original line number in output [False]\n"
+"  -z FORMAT   Compress output as gzip or zstd, optionally :LEVEL, using -j threads [None]\n"
+"  -t DELIM    Fields of lines are separated by single character DELIM [tab]\n"
+"  -a FIELDS   Output only fields FIELDS, e.g. 1,3,5-7, of each line [None]\n"
+"  -w PRED     Output only lines where field predicate PRED holds, e.g. 2=GET,\n"
+"              2!=GET, 3^/api (prefix), 4>=500 (numeric: < <= > >=); repeatable [None]\n"
+"  -O PREFIX   Write each -k shard, -p/-B partition or -I range to file PREFIX.NNNN [None]\n"
+"  -j THREADS  Use up to THREADS threads writing, compressing or verifying [No. of CPUs]\n"
 "  -q          Limit messages to a minimum [False]\n"
 "  -v          More verbose output when indexing, listing or searching [False]\n"
+"  -T FORMAT   Report time per phase, I/O and resource use to stderr as text or json [None]\n"
 "\n"
 "Index build options:\n"
 "  -f          Force (re-)build of index [False]\n"
 "  -P BYTES    Capture leading BYTES bytes of each line for content search [None]\n"
 "  -C BYTES    Create index entries every BYTES bytes [1000000]\n"
+"  -X BYTE     Records end with BYTE (\\0 for NUL) instead of newline [newline]\n"
+"  -J REGEX    Records begin at lines matching REGEX, e.g. \"^From \" [None]\n"
+"  -U          Drop data not cached before from the page cache as it is indexed [False]\n"
+"  -W MB[,N]   Throttle -b and -Z builds to MB MB/s and N reads/s, less if reads slow [None]\n"
+"  -K BYTES    Evict least valuable indexes in -D DIR beyond BYTES in all [None]\n"
 "\n"
 "Index file name and location options:\n"
 "  -i INDEX    Use explicit index file INDEX (else generate) [None]\n"
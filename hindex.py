@@ -50,6 +50,15 @@ import time
 from dataclasses import dataclass, field
 from typing import Optional
 
+# C engine (hindexmodule.c, built with "make python"), used when found
+# unless HINDEX_PURE_PYTHON is set.  Falls back to pure Python.
+try:
+    if os.environ.get('HINDEX_PURE_PYTHON'):
+        raise ImportError('HINDEX_PURE_PYTHON set')
+    import _hindex
+except ImportError:
+    _hindex = None
+
 VERSION = '0.9'
 
 # Defaults
@@ -296,6 +305,8 @@ def get_index_info(filename, index_filename):
         if h_filename != filename:
             raise ValueError('Name mismatch: index "{}" has "{}" for file "{}"'.format(index_filename, h_filename, filename))
         h_mslcse_flds = _b2s(index_fp.readline()).strip().split()
+        if len(h_mslcse_flds) > 6:
+            raise ValueError('Index "{}" has records other than lines (-X/-J), not supported here'.format(index_filename))
         _h_file_mtime = float(h_mslcse_flds[0])
         _h_file_size, _h_file_lines, info.chunk_size, info.snaplen, h_nentry = [int(x) for x in h_mslcse_flds[1:]]
 
@@ -556,6 +567,13 @@ def main():
             print_index_info(filename_full, index_filename, info, args.verbose)
             continue
 
+        # Check or create the index and search with the C engine if available
+        if _hindex and not args.dry_run and not args.verbose:
+            success = native_index_search(filename_full, index_filename, idx_opts, srch_opts, build_only)
+            if not success:
+                break
+            continue
+
         # Check or create the index
         i_success, i_result = index_file(filename_full, index_filename, idx_opts)
         if not i_success:
@@ -684,6 +702,53 @@ def search_file(filename_full, index_filename, file_lines, entries, opts):
     return True
 
 
+def native_index_search(filename_full, index_filename, idx_opts, opts, build_only):
+    """
+    Check or create the index, and search file for lines and output, with
+    the C engine (_hindex).  Reports as index_file() and search_file() when
+    not verbose, without an object per line.
+    """
+
+    # Report newly indexed file
+    if not os.path.exists(index_filename):
+        if idx_opts.for_content_search and not idx_opts.snaplen:
+            return _error('ERROR: Need to specify -P/--snaplen <snaplen> for new index when using -G/--greater-than or -L/--less-than')
+        if not idx_opts.quiet:
+            fmt = 'Creating new index "{}" on "{}" {:,d} bytes ... please wait ... (-q/--quiet to suppress)'
+            _error(fmt.format(index_filename, filename_full, os.path.getsize(filename_full)))
+    elif idx_opts.force and not idx_opts.quiet:
+        fmt = 'Option -f/--force given, forcing rebuild of index "{}" on "{}" {:,d} bytes (-q/--quiet to suppress)'
+        _error(fmt.format(index_filename, filename_full, os.path.getsize(filename_full)))
+
+    try:
+        with _hindex.Index(filename_full, index_file=index_filename, chunk_size=idx_opts.chunk_size,
+                           snaplen=idx_opts.snaplen or 0, force=idx_opts.force) as index:
+            if build_only or opts.count == 0:
+                return True
+            count = opts.count if opts.count is not None else -1
+            if opts.greater_than is not None or opts.less_than is not None:
+                rng = index.content(opts.greater_than, opts.less_than, count)
+            else:
+                rng = index.lines(opts.start or 0, opts.end or 0, count)
+
+            # Output to file, or stdout
+            if opts.output_file and opts.output_file != '-':
+                try:
+                    with open(opts.output_file, 'wb') as out_fp:
+                        index.write(rng, out_fp.fileno(), opts.line_number)
+                except OSError as exc:
+                    if isinstance(exc, _hindex.Error):
+                        raise
+                    return _error('Cannot write output "{}": {}'.format(opts.output_file, exc))
+            else:
+                sys.stdout.flush()
+                index.write(rng, sys.stdout.fileno(), opts.line_number)
+    except _hindex.Error as exc:
+        msg = str(exc)
+        return _error(msg if msg.startswith('ERROR') else 'ERROR: ' + msg)
+    return True
+
+
 def print_index_info(filename_full, index_filename, info, verbose):
     """
     Output info for file and its index
@@ -0,0 +1,325 @@
+/*
+
+hindexmodule.c - CPython extension _hindex on libhindex, used by hindex.py
+
+Build with "make python".  Ranges are (first_line, last_line, start,
+end) tuples as struct hindex_range, and are read whole into bytes or a
+caller's buffer, or written to a file descriptor, without an object per
+line.  The GIL is released while indexing, looking up and reading.
+
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "libhindex.h"
+
+static PyObject * HindexError;
+
+/* Index object: handle, with lookups sharing and refresh/close
+   excluding it, as libhindex.h requires */
+typedef struct {
+  PyObject_HEAD
+  hindex_t *        h;
+  pthread_rwlock_t  lock;
+} IndexObject;
+
+/* Set _hindex.Error from code and last error on this thread, return null */
+static PyObject * _raise(int code) {
+  const char * msg = hindex_last_error();
+  PyObject * exc = PyObject_CallFunction(HindexError, "s", *msg ? msg : hindex_strerror(code));
+  if ( exc ) {
+    PyObject * pcode = PyLong_FromLong(code);
+    PyObject_SetAttrString(exc, "code", pcode);
+    Py_XDECREF(pcode);
+    PyErr_SetObject(HindexError, exc);
+    Py_DECREF(exc);
+  }
+  return 0;
+}
+
+/* Take lock with the GIL released, return false if closed */
+static bool _lock(IndexObject * self, bool write) {
+  Py_BEGIN_ALLOW_THREADS
+  if ( write )
+    pthread_rwlock_wrlock(&self->lock);
+  else
+    pthread_rwlock_rdlock(&self->lock);
+  Py_END_ALLOW_THREADS
+  if ( self->h )
+    return true;
+  pthread_rwlock_unlock(&self->lock);
+  PyErr_SetString(PyExc_ValueError, "Index is closed");
+  return false;
+}
+
+/* Convert str, bytes or None argument to char * */
+static int _bytes_arg(PyObject * o, void * p) {
+  const char ** s = p;
+  if ( o == Py_None )
+    *s = 0;
+  else if ( PyUnicode_Check(o) )
+    *s = PyUnicode_AsUTF8(o);
+  else if ( PyBytes_Check(o) )
+    *s = PyBytes_AS_STRING(o);
+  else {
+    PyErr_SetString(PyExc_TypeError, "Expected str, bytes or None");
+    return 0;
+  }
+  return *s || o == Py_None;
+}
+
+/* Convert (first_line, last_line, start, end) tuple argument */
+static int _range_arg(PyObject * o, void * p) {
+  struct hindex_range * r = p;
+  return PyArg_ParseTuple(o, "LLLL;Range must be (first_line, last_line, start, end)", &r->first_line, &r->last_line, &r->start, &r->end);
+}
+
+static PyObject * _range_tuple(struct hindex_range * r) {
+  return Py_BuildValue("(LLLL)", r->first_line, r->last_line, r->start, r->end);
+}
+
+static int Index_init(IndexObject * self, PyObject * args, PyObject * kwds) {
+  static char * kwlist[] = { "filename", "chunk_size", "snaplen", "index_dir", "index_file", "hidden", "fullname", "force", "no_build", 0 };
+  const char * filename;
+  struct hindex_options opts = { 0 };
+  if ( ! PyArg_ParseTupleAndKeywords(args, kwds, "s|llzzpppp", kwlist, &filename, &opts.chunk_size, &opts.snaplen,
+                                     &opts.index_dir, &opts.index_file, &opts.hidden, &opts.fullname, &opts.force, &opts.no_build) )
+    return -1;
+  if ( self->h ) {
+    PyErr_SetString(PyExc_ValueError, "Index already open");
+    return -1;
+  }
+  int code;
+  Py_BEGIN_ALLOW_THREADS
+  code = hindex_open(filename, &opts, &self->h);
+  Py_END_ALLOW_THREADS
+  if ( code != HINDEX_OK ) {
+    _raise(code);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject * Index_new(PyTypeObject * type, PyObject * args, PyObject * kwds) {
+  IndexObject * self = (IndexObject *) type->tp_alloc(type, 0);
+  if ( self ) {
+    self->h = 0;
+    pthread_rwlock_init(&self->lock, 0);
+  }
+  return (PyObject *) self;
+}
+
+static void Index_dealloc(IndexObject * self) {
+  hindex_close(self->h);
+  pthread_rwlock_destroy(&self->lock);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject * Index_close(IndexObject * self, PyObject * unused) {
+  Py_BEGIN_ALLOW_THREADS
+  pthread_rwlock_wrlock(&self->lock);
+  Py_END_ALLOW_THREADS
+  hindex_close(self->h);
+  self->h = 0;
+  pthread_rwlock_unlock(&self->lock);
+  Py_RETURN_NONE;
+}
+
+static PyObject * Index_refresh(IndexObject * self, PyObject * unused) {
+  if ( ! _lock(self, true) )
+    return 0;
+  int code;
+  Py_BEGIN_ALLOW_THREADS
+  code = hindex_refresh(self->h);
+  Py_END_ALLOW_THREADS
+  pthread_rwlock_unlock(&self->lock);
+  if ( code != HINDEX_OK )
+    return _raise(code);
+  Py_RETURN_NONE;
+}
+
+static PyObject * Index_lines(IndexObject * self, PyObject * args, PyObject * kwds) {
+  static char * kwlist[] = { "start", "end", "count", 0 };
+  long long start = 0, end = 0, count = -1;
+  if ( ! PyArg_ParseTupleAndKeywords(args, kwds, "|LLL", kwlist, &start, &end, &count) )
+    return 0;
+  if ( ! _lock(self, false) )
+    return 0;
+  struct hindex_range r;
+  int code;
+  Py_BEGIN_ALLOW_THREADS
+  code = hindex_lines(self->h, start, end, count, &r);
+  Py_END_ALLOW_THREADS
+  pthread_rwlock_unlock(&self->lock);
+  return code != HINDEX_OK ? _raise(code) : _range_tuple(&r);
+}
+
+static PyObject * Index_content(IndexObject * self, PyObject * args, PyObject * kwds) {
+  static char * kwlist[] = { "min", "max", "count", 0 };
+  const char * min = 0, * max = 0;
+  long long count = -1;
+  if ( ! PyArg_ParseTupleAndKeywords(args, kwds, "|O&O&L", kwlist, _bytes_arg, &min, _bytes_arg, &max, &count) )
+    return 0;
+  if ( ! _lock(self, false) )
+    return 0;
+  struct hindex_range r;
+  int code;
+  Py_BEGIN_ALLOW_THREADS
+  code = hindex_content(self->h, min, max, count, &r);
+  Py_END_ALLOW_THREADS
+  pthread_rwlock_unlock(&self->lock);
+  return code != HINDEX_OK ? _raise(code) : _range_tuple(&r);
+}
+
+static PyObject * Index_read(IndexObject * self, PyObject * args) {
+  struct hindex_range r;
+  if ( ! PyArg_ParseTuple(args, "O&", _range_arg, &r) )
+    return 0;
+  if ( r.end < r.start )
+    r.end = r.start;
+  PyObject * data = PyBytes_FromStringAndSize(0, r.end - r.start);
+  if ( ! data )
+    return 0;
+  if ( ! _lock(self, false) ) {
+    Py_DECREF(data);
+    return 0;
+  }
+  long long n;
+  char * buf = PyBytes_AS_STRING(data);
+  Py_BEGIN_ALLOW_THREADS
+  n = hindex_read(self->h, &r, buf, r.end - r.start);
+  Py_END_ALLOW_THREADS
+  pthread_rwlock_unlock(&self->lock);
+  if ( n < 0 ) {
+    Py_DECREF(data);
+    return _raise(n);
+  }
+  if ( n < r.end - r.start )
+    _PyBytes_Resize(&data, n);
+  return data;
+}
+
+static PyObject * Index_readinto(IndexObject * self, PyObject * args) {
+  struct hindex_range r;
+  Py_buffer view;
+  if ( ! PyArg_ParseTuple(args, "O&w*", _range_arg, &r, &view) )
+    return 0;
+  if ( ! _lock(self, false) ) {
+    PyBuffer_Release(&view);
+    return 0;
+  }
+  long long n;
+  Py_BEGIN_ALLOW_THREADS
+  n = hindex_read(self->h, &r, view.buf, view.len);
+  Py_END_ALLOW_THREADS
+  pthread_rwlock_unlock(&self->lock);
+  PyBuffer_Release(&view);
+  return n < 0 ? _raise(n) : PyLong_FromLongLong(n);
+}
+
+static PyObject * Index_write(IndexObject * self, PyObject * args, PyObject * kwds) {
+  static char * kwlist[] = { "range", "fd", "line_number", 0 };
+  struct hindex_range r;
+  int fd, line_number = 0;
+  if ( ! PyArg_ParseTupleAndKeywords(args, kwds, "O&i|p", kwlist, _range_arg, &r, &fd, &line_number) )
+    return 0;
+  if ( ! _lock(self, false) )
+    return 0;
+  int code;
+  Py_BEGIN_ALLOW_THREADS
+  code = hindex_write(self->h, &r, fd, line_number);
+  Py_END_ALLOW_THREADS
+  pthread_rwlock_unlock(&self->lock);
+  if ( code != HINDEX_OK )
+    return _raise(code);
+  Py_RETURN_NONE;
+}
+
+static PyObject * Index_enter(IndexObject * self, PyObject * unused) {
+  Py_INCREF(self);
+  return (PyObject *) self;
+}
+
+static PyObject * Index_exit(IndexObject * self, PyObject * args) {
+  return Index_close(self, 0);
+}
+
+static PyObject * Index_get_file_size(IndexObject * self, void * closure) {
+  return self->h ? PyLong_FromLongLong(hindex_file_size(self->h)) : (Py_INCREF(Py_None), Py_None);
+}
+
+static PyObject * Index_get_file_lines(IndexObject * self, void * closure) {
+  return self->h ? PyLong_FromLongLong(hindex_file_lines(self->h)) : (Py_INCREF(Py_None), Py_None);
+}
+
+static PyObject * Index_get_index_filename(IndexObject * self, void * closure) {
+  return self->h ? PyUnicode_FromString(hindex_index_filename(self->h)) : (Py_INCREF(Py_None), Py_None);
+}
+
+static PyObject * Index_get_snaplen(IndexObject * self, void * closure) {
+  return self->h ? PyLong_FromLong(hindex_snaplen(self->h)) : (Py_INCREF(Py_None), Py_None);
+}
+
+static PyMethodDef Index_methods[] = {
+  { "close", (PyCFunction) Index_close, METH_NOARGS, "Close the index" },
+  { "refresh", (PyCFunction) Index_refresh, METH_NOARGS, "Freshen the index of a file that grew or changed" },
+  { "lines", (PyCFunction) Index_lines, METH_VARARGS | METH_KEYWORDS,
+    "lines(start=0, end=0, count=-1) -> range of lines start..end (0 for unbounded), at most count lines if >= 0" },
+  { "content", (PyCFunction) Index_content, METH_VARARGS | METH_KEYWORDS,
+    "content(min=None, max=None, count=-1) -> range of lines >= min with prefix <= max, at most count lines if >= 0" },
+  { "read", (PyCFunction) Index_read, METH_VARARGS, "read(range) -> bytes of the lines of range" },
+  { "readinto", (PyCFunction) Index_readinto, METH_VARARGS, "readinto(range, buffer) -> bytes of range read into writable buffer" },
+  { "write", (PyCFunction) Index_write, METH_VARARGS | METH_KEYWORDS,
+    "write(range, fd, line_number=False): write lines of range to file descriptor fd, numbered as -n" },
+  { "__enter__", (PyCFunction) Index_enter, METH_NOARGS, 0 },
+  { "__exit__", (PyCFunction) Index_exit, METH_VARARGS, 0 },
+  { 0 }
+};
+
+static PyGetSetDef Index_getset[] = {
+  { "file_size", (getter) Index_get_file_size, 0, "Size in bytes of file as last indexed", 0 },
+  { "file_lines", (getter) Index_get_file_lines, 0, "Lines in file as last indexed", 0 },
+  { "index_filename", (getter) Index_get_index_filename, 0, "Index file name", 0 },
+  { "snaplen", (getter) Index_get_snaplen, 0, "Snap len of index, 0 if none", 0 },
+  { 0 }
+};
+
+static PyTypeObject IndexType = {
+  PyVarObject_HEAD_INIT(0, 0)
+  .tp_name = "_hindex.Index",
+  .tp_doc = "Index(filename, chunk_size=0, snaplen=0, index_dir=None, index_file=None, hidden=False, fullname=False, force=False, no_build=False)\n\n"
+            "Index of a file, built or freshened unless no_build, as hindex_open() in libhindex.h.\n"
+            "Ranges are (first_line, last_line, start, end) tuples.",
+  .tp_basicsize = sizeof(IndexObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = Index_new,
+  .tp_init = (initproc) Index_init,
+  .tp_dealloc = (destructor) Index_dealloc,
+  .tp_methods = Index_methods,
+  .tp_getset = Index_getset,
+};
+
+static struct PyModuleDef hindexmodule = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "_hindex",
+  .m_doc = "C engine of hindex for hindex.py, see libhindex.h",
+  .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__hindex(void) {
+  if ( PyType_Ready(&IndexType) < 0 )
+    return 0;
+  PyObject * m = PyModule_Create(&hindexmodule);
+  if ( ! m )
+    return 0;
+  HindexError = PyErr_NewException("_hindex.Error", PyExc_OSError, 0);
+  Py_XINCREF(HindexError);
+  Py_INCREF(&IndexType);
+  if ( PyModule_AddObject(m, "Error", HindexError) < 0 || PyModule_AddObject(m, "Index", (PyObject *) &IndexType) < 0 ) {
+    Py_DECREF(m);
+    return 0;
+  }
+  return m;
+}
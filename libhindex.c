@@ -0,0 +1,374 @@
+/*
+
+libhindex.c - library interface to hindex, see libhindex.h
+
+The engine in hindex.c is compiled in without its command line main(),
+and with _error() collecting messages for hindex_last_error() rather
+than printing them.
+
+*/
+
+#define HINDEX_LIBRARY
+#include "hindex.c"
+
+/* Open index handle */
+struct hindex_handle {
+  struct hindex idx;
+  char *        filename_full;
+  char *        index_filename;
+  long          chunk_size;
+  long          snaplen;
+  bool          no_build;
+  bool          force;
+};
+
+/* Iterator over lines of a range */
+struct hindex_iter {
+  FILE *        fp;
+  long long     pos;
+  long long     end;
+  long long     lineno;
+  struct records rec;
+};
+
+/* Start of each call: clear last error */
+static void _lib_begin() {
+  _last_error[0] = '\0';
+  _error_code = HINDEX_OK;
+}
+
+/* Code for failure of engine function, defaulting to I/O error */
+static int _lib_fail() {
+  return _error_code != HINDEX_OK ? _error_code : HINDEX_ERR_IO;
+}
+
+/* Record error with code and return it */
+static int _lib_error(int code, char * msg) {
+  _error_as(code, msg);
+  return code;
+}
+
+/* Load or build index of h into idx */
+static int _lib_load(hindex_t * h, struct hindex * idx) {
+  char buf[BUFSIZE];
+  bool success;
+  if ( h->no_build ) {
+    success = get_index_info(h->filename_full, h->index_filename, idx);
+    if ( success && idx->status != INDEX_STATUS_FRESH ) {
+      sprintf(buf, "Index \"%s\" on \"%s\": %s", h->index_filename, h->filename_full, INDEX_STATUS_NAME[idx->status]);
+      clear_hindex(idx);
+      return _lib_error(HINDEX_ERR_STALE, buf);
+    }
+  }
+  else
+    success = index_file(idx, h->filename_full, h->index_filename, h->chunk_size, h->snaplen, 0, true, false, h->force, false, false);
+  if ( ! success ) {
+    clear_hindex(idx);
+    return _lib_fail();
+  }
+  /* index_file() keeps the snap len of an existing index */
+  h->snaplen = idx->snaplen;
+  return HINDEX_OK;
+}
+
+HINDEX_API int hindex_open(const char * filename, const struct hindex_options * opts, hindex_t ** hp) {
+  char buf[BUFSIZE], fullbuf[PATH_MAX];
+  _lib_begin();
+  if ( ! filename || ! hp )
+    return _lib_error(HINDEX_ERR_ARG, "No file name or handle given");
+  *hp = 0;
+  struct hindex_options none = { 0 };
+  if ( ! opts )
+    opts = &none;
+  if ( opts->chunk_size < 0 || opts->snaplen < 0 )
+    return _lib_error(HINDEX_ERR_ARG, "Chunk size and snap len must not be negative");
+
+  if ( ! realpath(filename, fullbuf) ) {
+    sprintf(buf, "Cannot get full path of \"%s\":", filename);
+    _error(buf);
+    return _lib_error(HINDEX_ERR_IO, strerror(errno));
+  }
+
+  hindex_t * h = calloc(1, sizeof *h);
+  if ( ! h || ! (h->filename_full = strdup(fullbuf)) ) {
+    free(h);
+    return _lib_error(HINDEX_ERR_NOMEM, "Cannot allocate index handle");
+  }
+  h->chunk_size = opts->chunk_size ? opts->chunk_size : DEFAULT_CHUNK_SIZE;
+  h->snaplen = opts->snaplen;
+  h->no_build = opts->no_build;
+  h->force = opts->force;
+  if ( opts->index_file )
+    h->index_filename = strdup(opts->index_file);
+  else
+    h->index_filename = get_index_filename(h->filename_full, (char *) (opts->index_dir ? opts->index_dir : DEFAULT_INDEX_DIR), opts->hidden, opts->fullname);
+  if ( ! h->index_filename ) {
+    hindex_close(h);
+    return _lib_fail();
+  }
+
+  init_hindex(&h->idx);
+  int code = _lib_load(h, &h->idx);
+  if ( code != HINDEX_OK ) {
+    hindex_close(h);
+    return code;
+  }
+  /* Rebuild only when opening */
+  h->force = false;
+  *hp = h;
+  return HINDEX_OK;
+}
+
+HINDEX_API int hindex_refresh(hindex_t * h) {
+  _lib_begin();
+  if ( ! h )
+    return _lib_error(HINDEX_ERR_ARG, "No handle given");
+  /* Keep the current index if refreshing fails */
+  struct hindex idx;
+  init_hindex(&idx);
+  int code = _lib_load(h, &idx);
+  if ( code != HINDEX_OK )
+    return code;
+  clear_hindex(&h->idx);
+  h->idx = idx;
+  return HINDEX_OK;
+}
+
+HINDEX_API void hindex_close(hindex_t * h) {
+  if ( ! h )
+    return;
+  clear_hindex(&h->idx);
+  free(h->filename_full);
+  free(h->index_filename);
+  free(h);
+}
+
+HINDEX_API long long hindex_file_size(hindex_t * h) {
+  return h->idx.file_size;
+}
+
+HINDEX_API long long hindex_file_lines(hindex_t * h) {
+  return h->idx.file_lines;
+}
+
+HINDEX_API const char * hindex_index_filename(hindex_t * h) {
+  return h->index_filename;
+}
+
+HINDEX_API long hindex_snaplen(hindex_t * h) {
+  return h->snaplen;
+}
+
+/* Resolve range as _range_offsets() */
+static int _lib_range(hindex_t * h, long long start, long long end, unsigned char * greater_than, unsigned char * less_than, long long count, struct hindex_range * r) {
+  char buf[BUFSIZE];
+  FILE * src_fp = fopen(h->filename_full, "rb");
+  if ( ! src_fp ) {
+    sprintf(buf, "Cannot read data file \"%s\":", h->filename_full);
+    _error(buf);
+    return _lib_error(HINDEX_ERR_IO, strerror(errno));
+  }
+  bool success = _range_offsets(&h->idx, src_fp, start, end, greater_than, less_than, count, &r->first_line, &r->last_line, &r->start, &r->end);
+  fclose(src_fp);
+  return success ? HINDEX_OK : _lib_fail();
+}
+
+HINDEX_API int hindex_lines(hindex_t * h, long long start, long long end, long long count, struct hindex_range * r) {
+  _lib_begin();
+  if ( ! h || ! r || start < 0 || end < 0 )
+    return _lib_error(HINDEX_ERR_ARG, "No handle or range given, or negative line number");
+  return _lib_range(h, start, end, 0, 0, count, r);
+}
+
+HINDEX_API int hindex_content(hindex_t * h, const char * min, const char * max, long long count, struct hindex_range * r) {
+  _lib_begin();
+  if ( ! h || ! r )
+    return _lib_error(HINDEX_ERR_ARG, "No handle or range given");
+  if ( (min || max) && ! h->snaplen ) {
+    char buf[BUFSIZE];
+    sprintf(buf, "Index \"%s\" was not built with a snap len for content lookup", h->index_filename);
+    return _lib_error(HINDEX_ERR_SNAPLEN, buf);
+  }
+  return _lib_range(h, 0, 0, (unsigned char *) min, (unsigned char *) max, count, r);
+}
+
+/* Open data file of h for reading with open(2) */
+static int _lib_open_data(hindex_t * h, int * fd_p) {
+  char buf[BUFSIZE];
+  *fd_p = open(h->filename_full, O_RDONLY);
+  if ( *fd_p >= 0 )
+    return HINDEX_OK;
+  sprintf(buf, "Cannot read data file \"%s\":", h->filename_full);
+  _error(buf);
+  return _lib_error(HINDEX_ERR_IO, strerror(errno));
+}
+
+HINDEX_API long long hindex_read(hindex_t * h, const struct hindex_range * r, void * buf, size_t size) {
+  _lib_begin();
+  if ( ! h || ! r || ( ! buf && size ) || r->start < 0 || r->end < r->start )
+    return _lib_error(HINDEX_ERR_ARG, "No handle, range or buffer given, or invalid range");
+  if ( size > r->end - r->start )
+    size = r->end - r->start;
+  int src_fd;
+  int code = _lib_open_data(h, &src_fd);
+  if ( code != HINDEX_OK )
+    return code;
+  size_t nread = 0;
+  while ( nread < size ) {
+    ssize_t n = pread(src_fd, (char *) buf + nread, size - nread, r->start + nread);
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n < 0 ) {
+      code = _lib_error(HINDEX_ERR_IO, strerror(errno));
+      break;
+    }
+    /* Stop short if the file was truncated */
+    if ( ! n )
+      break;
+    nread += n;
+  }
+  close(src_fd);
+  return code != HINDEX_OK ? code : (long long) nread;
+}
+
+HINDEX_API int hindex_write(hindex_t * h, const struct hindex_range * r, int fd, int line_number) {
+  _lib_begin();
+  if ( ! h || ! r || fd < 0 || r->start < 0 || r->end < r->start )
+    return _lib_error(HINDEX_ERR_ARG, "No handle, range or output given, or invalid range");
+  int src_fd;
+  int code = _lib_open_data(h, &src_fd);
+  if ( code != HINDEX_OK )
+    return code;
+  /* Output through the buffer of the command line, as one batch range (-I) */
+  FILE * out_fp = 0;
+  int out_fd = dup(fd);
+  if ( out_fd < 0 || ! (out_fp = fdopen(out_fd, "wb")) ) {
+    code = _lib_error(HINDEX_ERR_IO, strerror(errno));
+    if ( out_fd >= 0 )
+      close(out_fd);
+    close(src_fd);
+    return code;
+  }
+  struct batch_range br = { 0 };
+  br.first = r->first_line;
+  br.pos = r->start;
+  br.endpos = r->end;
+  struct outbuf ob;
+  ob_init(&ob, out_fp);
+  bool ok = _emit_batch_range(&ob, &h->idx.rec, src_fd, &br, -1, line_number, 0);
+  ok = ob_finish(&ob) && ok;
+  if ( ! ok ) {
+    _error("Error writing range to output:");
+    code = _lib_error(HINDEX_ERR_IO, strerror(errno));
+  }
+  fclose(out_fp);
+  close(src_fd);
+  return code;
+}
+
+HINDEX_API int hindex_iter_open(hindex_t * h, const struct hindex_range * r, hindex_iter_t ** itp) {
+  char buf[BUFSIZE];
+  _lib_begin();
+  if ( ! h || ! r || ! itp || r->start < 0 || r->end < r->start )
+    return _lib_error(HINDEX_ERR_ARG, "No handle, range or iterator given, or invalid range");
+  *itp = 0;
+  hindex_iter_t * it = calloc(1, sizeof *it);
+  if ( ! it )
+    return _lib_error(HINDEX_ERR_NOMEM, "Cannot allocate iterator");
+  it->fp = fopen(h->filename_full, "rb");
+  if ( ! it->fp ) {
+    free(it);
+    sprintf(buf, "Cannot read data file \"%s\":", h->filename_full);
+    _error(buf);
+    return _lib_error(HINDEX_ERR_IO, strerror(errno));
+  }
+  if ( fseeko(it->fp, r->start, SEEK_SET) ) {
+    hindex_iter_close(it);
+    sprintf(buf, "Error seeking to position %lld in file \"%s\":", r->start, h->filename_full);
+    _error(buf);
+    return _lib_error(HINDEX_ERR_IO, strerror(errno));
+  }
+  it->pos = r->start;
+  it->end = r->end;
+  it->lineno = r->first_line;
+  /* Own copy of the records, as a refresh frees those of the index */
+  if ( ! records_copy(&it->rec, &h->idx.rec) ) {
+    hindex_iter_close(it);
+    return _lib_error(HINDEX_ERR_NOMEM, "Cannot allocate iterator");
+  }
+  *itp = it;
+  return HINDEX_OK;
+}
+
+HINDEX_API int hindex_iter_next(hindex_iter_t * it, const char ** line, size_t * len, long long * lineno) {
+  _lib_begin();
+  if ( ! it )
+    return _lib_error(HINDEX_ERR_ARG, "No iterator given");
+  if ( it->pos >= it->end )
+    return 0;
+  long nread = 0;
+  unsigned char * data = _read_line(it->fp, &it->rec, &nread);
+  if ( ! nread ) {
+    if ( ferror(it->fp) )
+      return _lib_error(HINDEX_ERR_IO, strerror(errno));
+    /* File was truncated under us */
+    it->pos = it->end;
+    return 0;
+  }
+  it->pos += nread;
+  *line = (const char *) data;
+  *len = nread;
+  if ( lineno )
+    *lineno = it->lineno;
+  it->lineno++;
+  return 1;
+}
+
+HINDEX_API void hindex_iter_close(hindex_iter_t * it) {
+  if ( ! it )
+    return;
+  if ( it->fp )
+    fclose(it->fp);
+  records_free(&it->rec);
+  free(it);
+}
+
+HINDEX_API int hindex_foreach(hindex_t * h, const struct hindex_range * r, hindex_line_fn fn, void * ctx) {
+  if ( ! fn ) {
+    _lib_begin();
+    return _lib_error(HINDEX_ERR_ARG, "No callback given");
+  }
+  hindex_iter_t * it;
+  int code = hindex_iter_open(h, r, &it);
+  if ( code != HINDEX_OK )
+    return code;
+  const char * line;
+  size_t len;
+  long long lineno;
+  while ( (code = hindex_iter_next(it, &line, &len, &lineno)) == 1 ) {
+    code = fn(ctx, line, len, lineno);
+    if ( code )
+      break;
+  }
+  hindex_iter_close(it);
+  return code;
+}
+
+HINDEX_API const char * hindex_strerror(int code) {
+  switch ( code ) {
+  case HINDEX_OK:             return "Success";
+  case HINDEX_ERR_ARG:        return "Invalid argument";
+  case HINDEX_ERR_IO:         return "Cannot read or write file";
+  case HINDEX_ERR_FORMAT:     return "Invalid index file";
+  case HINDEX_ERR_SNAPLEN:    return "Index has no snap len for content lookup";
+  case HINDEX_ERR_UNORDERED:  return "Data not in order over snap len";
+  case HINDEX_ERR_CHANGED:    return "File shrank while indexing";
+  case HINDEX_ERR_STALE:      return "Index missing or out of date";
+  case HINDEX_ERR_NOMEM:      return "Out of memory";
+  }
+  return "Unknown error";
+}
+
+HINDEX_API const char * hindex_last_error(void) {
+  return _last_error;
+}
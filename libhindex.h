@@ -0,0 +1,122 @@
+/* libhindex.h - library interface to hindex, a Huge file INDEXer
+
+   Build with "make lib" for libhindex.a and libhindex.so, and link
+   with -lhindex -lcrypto -lm -lpthread -lz.
+
+   A handle holds the index of one file, opened (and built or freshened
+   if need be) with hindex_open().  Lookups resolve a range of lines,
+   given by line numbers or by content when the index was built with a
+   snap length, to the byte offsets [start, end) of those lines in the
+   file.  Their lines can then be read with a callback or an iterator.
+
+   Nothing is printed.  Functions return HINDEX_OK or a negative
+   HINDEX_ERR_* code, and hindex_last_error() describes the last
+   failure on the calling thread.
+
+   Threads may do lookups and read lines on the same handle at once,
+   each opens the file anew.  hindex_refresh() and hindex_close() must
+   not run concurrently with other calls on the handle.
+*/
+
+#ifndef LIBHINDEX_H
+#define LIBHINDEX_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HINDEX_API __attribute__((visibility("default")))
+
+/* Error codes */
+#define HINDEX_OK              0
+#define HINDEX_ERR_ARG        -1  /* Invalid argument */
+#define HINDEX_ERR_IO         -2  /* Cannot read or write a file */
+#define HINDEX_ERR_FORMAT     -3  /* Index file is corrupt or for another file */
+#define HINDEX_ERR_SNAPLEN    -4  /* Content lookup needs an index built with a snap length */
+#define HINDEX_ERR_UNORDERED  -5  /* Data not in order over the snap length */
+#define HINDEX_ERR_CHANGED    -6  /* File shrank while indexing it */
+#define HINDEX_ERR_STALE      -7  /* Index missing or out of date, and not building */
+#define HINDEX_ERR_NOMEM      -8  /* Out of memory */
+
+typedef struct hindex_handle hindex_t;
+typedef struct hindex_iter hindex_iter_t;
+
+/* Options for hindex_open(), as the command line options of the same
+   letter.  Zero fields take the command line defaults. */
+struct hindex_options {
+  long         chunk_size;   /* -C, bytes between index entries */
+  long         snaplen;      /* -P, leading bytes of lines indexed for content lookup */
+  const char * index_dir;    /* -D, directory of index files, "." for that of the file */
+  const char * index_file;   /* -i, index file name, overriding index_dir */
+  int          hidden;       /* -H, hide index file with leading "." */
+  int          fullname;     /* -F, name index file after the file, not its hash */
+  int          force;        /* -f, rebuild index from scratch */
+  int          no_build;     /* Only load an up to date index, never write one */
+};
+
+/* Lines first_line..last_line (1-origin) at byte offsets [start, end)
+   of the file.  Empty if last_line < first_line, with start == end. */
+struct hindex_range {
+  long long first_line;
+  long long last_line;
+  long long start;
+  long long end;
+};
+
+/* Called with each line of a range, including its newline if any,
+   and its line number.  Return 0 to continue, other values stop. */
+typedef int (*hindex_line_fn)(void * ctx, const char * line, size_t len, long long lineno);
+
+/* Open, building or freshening the index unless opts->no_build.  opts may be null. */
+HINDEX_API int hindex_open(const char * filename, const struct hindex_options * opts, hindex_t ** hp);
+
+/* Freshen the index of a file that grew or changed (or reload it if no_build) */
+HINDEX_API int hindex_refresh(hindex_t * h);
+
+HINDEX_API void hindex_close(hindex_t * h);
+
+/* Size in bytes and lines of the file as last indexed */
+HINDEX_API long long hindex_file_size(hindex_t * h);
+HINDEX_API long long hindex_file_lines(hindex_t * h);
+
+/* Index file name and snap length in use */
+HINDEX_API const char * hindex_index_filename(hindex_t * h);
+HINDEX_API long hindex_snaplen(hindex_t * h);
+
+/* Range of lines start..end, as -S and -E, at most count lines if
+   count >= 0.  Zero start or end is unbounded. */
+HINDEX_API int hindex_lines(hindex_t * h, long long start, long long end, long long count, struct hindex_range * r);
+
+/* Range of lines >= min and with prefix <= max, as -G and -L, at most
+   count lines if count >= 0.  Null min or max is unbounded. */
+HINDEX_API int hindex_content(hindex_t * h, const char * min, const char * max, long long count, struct hindex_range * r);
+
+/* Read up to size bytes of range r into buf, returning bytes read or an error */
+HINDEX_API long long hindex_read(hindex_t * h, const struct hindex_range * r, void * buf, size_t size);
+
+/* Write lines of range r to fd, as the command line would with or
+   without -n, copying in the kernel where possible */
+HINDEX_API int hindex_write(hindex_t * h, const struct hindex_range * r, int fd, int line_number);
+
+/* Call fn for each line of range r, returning the first nonzero value
+   fn returns, else HINDEX_OK or an error */
+HINDEX_API int hindex_foreach(hindex_t * h, const struct hindex_range * r, hindex_line_fn fn, void * ctx);
+
+/* Iterate over lines of range r.  hindex_iter_next() returns 1 and
+   sets the line, its length and number, 0 at the end of the range, or
+   an error.  The line is valid until the next call on this thread. */
+HINDEX_API int hindex_iter_open(hindex_t * h, const struct hindex_range * r, hindex_iter_t ** itp);
+HINDEX_API int hindex_iter_next(hindex_iter_t * it, const char ** line, size_t * len, long long * lineno);
+HINDEX_API void hindex_iter_close(hindex_iter_t * it);
+
+/* Description of error code, and message of last failure on this thread */
+HINDEX_API const char * hindex_strerror(int code);
+HINDEX_API const char * hindex_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Check -r on lines and records longer than its 1 MB read block: output
+# must match the forward output reversed, and memory stay bounded.
+#
+# Usage: test/reverse.sh [HINDEX]
+
+HINDEX=${1:-./hindex}
+DIR=${TMPDIR:-/tmp}/hindex-test.$$
+FILE=$DIR/reverse.txt
+
+mkdir -p "$DIR" || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+# Short lines around a 40 MB line, records ending in ';' likewise
+awk 'BEGIN {
+  for ( i = 1; i <= 3000; i++ ) {
+    printf "%06d ", i
+    if ( i == 1500 ) { for ( j = 0; j < 40 * 1024; j++ ) printf "%01023d", j; }
+    printf "line\n"
+  }
+}' > "$FILE"
+tr '\n' ';' < "$FILE" > "$FILE.semi"
+
+fail=0
+check() {
+  if [ "$2" = "$3" ]; then echo "ok   $1"; else echo "FAIL $1"; fail=1; fi
+}
+
+"$HINDEX" -q -b -C 100000 -D "$DIR" "$FILE" || exit 1
+"$HINDEX" -q -b -C 100000 -X ';' -D "$DIR" "$FILE.semi" || exit 1
+for range in "" "-S 1400 -E 1600" "-S 1500 -E 1500" "-E 1500"; do
+  want=$("$HINDEX" -q -D "$DIR" -n $range "$FILE" | tac | cksum)
+  got=$("$HINDEX" -q -D "$DIR" -n -r $range "$FILE" | cksum)
+  check "-r $range" "$want" "$got"
+  want=$("$HINDEX" -q -D "$DIR" $range "$FILE.semi" | tac -s ';' | cksum)
+  got=$("$HINDEX" -q -D "$DIR" -r $range "$FILE.semi" | cksum)
+  check "-r -X ';' $range" "$want" "$got"
+done
+want=$(sed -n '1500,1600p' "$FILE" | tac | head -n 101 | tail -n 1 | cksum)
+got=$("$HINDEX" -q -D "$DIR" -r -S 1400 -E 1600 -N 101 "$FILE" | tail -n 1 | cksum)
+check "-r -N through long line" "$want" "$got"
+
+rss=$("$HINDEX" -q -D "$DIR" -r -T text "$FILE" 2>&1 > /dev/null | awk '/max_rss_kb/ { gsub(",", "", $2); print $2 }')
+if [ "$rss" -lt 20000 ]; then echo "ok   -r memory ${rss} KB"; else echo "FAIL -r memory ${rss} KB"; fail=1; fi
+
+exit $fail